@@ -0,0 +1,216 @@
+#ifndef __SYLAR_CHANNEL_H__
+#define __SYLAR_CHANNEL_H__
+
+//Go 风格的 channel，有界的：满了发的人等，空了收的人等，自带背压
+//等的时候用的是 fiber_sync 里的东西，协程里只挂起协程，普通线程里才阻塞线程
+//所以 线程 -> 协程、协程 -> 协程 都能用，IOManager 里的 handler 收外面线程的数据，不会把工作线程卡住
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "fiber_sync.h"
+
+namespace sylar
+{
+
+template<class T>
+class Channel : Noncopyable
+{
+public:
+    typedef std::shared_ptr<Channel> ptr;
+    typedef FiberMutex MutexType;
+
+    //capacity 至少是 1，不支持不带缓冲的那种
+    Channel(size_t capacity)
+        :m_capacity(capacity ? capacity : 1)
+    {
+    }
+
+    //满了就等着；关了返回 false，东西没发出去
+    bool send(T v)
+    {
+        MutexType::Lock lock(m_mutex);
+        while(!m_closed && m_queue.size() >= m_capacity)
+        {
+            m_notFull.wait(m_mutex);
+        }
+        if(m_closed)
+        {
+            return false;
+        }
+        m_queue.push_back(std::move(v));
+        m_notEmpty.notify();
+        notifyWatchers();
+        return true;
+    }
+
+    //不等，满了或者关了返回 false，这时候 v 不会被 move 走
+    bool trySend(T& v)
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_closed || m_queue.size() >= m_capacity)
+        {
+            return false;
+        }
+        m_queue.push_back(std::move(v));
+        m_notEmpty.notify();
+        notifyWatchers();
+        return true;
+    }
+
+    //空了就等着；关了并且里面的都收完了返回 false
+    bool recv(T& v)
+    {
+        MutexType::Lock lock(m_mutex);
+        while(m_queue.empty() && !m_closed)
+        {
+            m_notEmpty.wait(m_mutex);
+        }
+        return popLocked(v);
+    }
+
+    bool tryRecv(T& v)
+    {
+        MutexType::Lock lock(m_mutex);
+        return popLocked(v);
+    }
+
+    //关掉，等着的都叫醒。已经在里面的还能继续收完
+    void close()
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_closed)
+        {
+            return;
+        }
+        m_closed = true;
+        m_notEmpty.notifyAll();
+        m_notFull.notifyAll();
+        notifyWatchers();
+    }
+
+    bool isClosed()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_closed;
+    }
+
+    size_t size()
+    {
+        MutexType::Lock lock(m_mutex);
+        return m_queue.size();
+    }
+
+    size_t getCapacity() const { return m_capacity; }
+
+    //扇入：从几个 channel 里收，哪个有就收哪个，返回收到的下标；全都关了而且收完了返回 -1
+    //每次从不同的位置开始看，前面的一直有数据也不会把后面的饿死
+    //都是空的就在每个上面挂一个信号量，谁先来数据（或者关了）谁叫醒我们，醒了再看一遍
+    static int Select(const std::vector<ptr>& chans, T& v)
+    {
+        size_t n = chans.size();
+        if(n == 0)
+        {
+            return -1;
+        }
+
+        static thread_local size_t t_round = 0;
+        size_t start = t_round++;
+        while(true)
+        {
+            size_t closed = 0;
+            for(size_t k = 0; k < n; ++k)
+            {
+                size_t i = (start + k) % n;
+                MutexType::Lock lock(chans[i]->m_mutex);
+                if(chans[i]->popLocked(v))
+                {
+                    return i;
+                }
+                if(chans[i]->m_closed)
+                {
+                    ++closed;
+                }
+            }
+            if(closed == n)
+            {
+                return -1;
+            }
+
+            FiberSemaphore sem;
+            size_t added = 0;
+            //挂的过程中有的来了数据，就不用等了
+            bool ready = false;
+            closed = 0;
+            for(; added < n; ++added)
+            {
+                Channel* chan = chans[added].get();
+                MutexType::Lock lock(chan->m_mutex);
+                if(!chan->m_queue.empty())
+                {
+                    ready = true;
+                    break;
+                }
+                if(chan->m_closed)
+                {
+                    //关了的不会再叫人，不用挂
+                    ++closed;
+                    continue;
+                }
+                chan->m_watchers.push_back(&sem);
+            }
+            if(!ready && closed < n)
+            {
+                sem.wait();
+            }
+
+            //摘下来之后就不会再有人碰 sem 了（叫人都是拿着 channel 的锁叫的）
+            for(size_t i = 0; i < added; ++i)
+            {
+                Channel* chan = chans[i].get();
+                MutexType::Lock lock(chan->m_mutex);
+                auto it = std::find(chan->m_watchers.begin(), chan->m_watchers.end(), &sem);
+                if(it != chan->m_watchers.end())
+                {
+                    chan->m_watchers.erase(it);
+                }
+            }
+        }
+    }
+private:
+    //拿着锁调用
+    bool popLocked(T& v)
+    {
+        if(m_queue.empty())
+        {
+            return false;
+        }
+        v = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_notFull.notify();
+        return true;
+    }
+
+    //拿着锁调用
+    void notifyWatchers()
+    {
+        for(auto i : m_watchers)
+        {
+            i->notify();
+        }
+    }
+private:
+    MutexType m_mutex;
+    size_t m_capacity;
+    bool m_closed = false;
+    std::deque<T> m_queue;
+    FiberCondition m_notEmpty;
+    FiberCondition m_notFull;
+    //在 Select 里等着的
+    std::vector<FiberSemaphore*> m_watchers;
+};
+
+}
+
+#endif
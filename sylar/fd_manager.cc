@@ -68,6 +68,13 @@ bool FdCtx::init()
     return m_isInit;
 }
 
+bool FdCtx::close()
+{
+    //只是打个标记，等在上面的协程被 cancelAll 叫醒之后看到它就不会再去挂事件了
+    m_isClosed = true;
+    return true;
+}
+
 void FdCtx::setTimeout(int type, uint64_t v)
 {
     //复用一下 socket的标志
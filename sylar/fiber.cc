@@ -4,6 +4,14 @@
 #include "log.h"
 #include "scheduler.h"
 #include <atomic>
+#include <string.h>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <cxxabi.h>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
 
 namespace sylar
 {
@@ -22,24 +30,276 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
     Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024, "fiber stack size");
 
-//fiber栈内存申请类
-class MallocStackAllocator
+//两个小一点的档位，给不怎么递归、不在栈上放大对象的简单 handler 用
+static ConfigVar<uint32_t>::ptr g_fiber_stack_size_small =
+    Config::Lookup<uint32_t>("fiber.stack_size_small", 64 * 1024, "small fiber stack size");
+static ConfigVar<uint32_t>::ptr g_fiber_stack_size_medium =
+    Config::Lookup<uint32_t>("fiber.stack_size_medium", 256 * 1024, "medium fiber stack size");
+
+//测量栈用量，要把整个栈填一遍，只在调栈大小的时候打开
+static ConfigVar<bool>::ptr g_fiber_stack_watermark =
+    Config::Lookup("fiber.stack_watermark", false, "measure fiber stack peak usage");
+
+//每个线程最多缓存多少个空闲的栈
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_size =
+    Config::Lookup<uint32_t>("fiber.stack_pool_size", 64, "fiber stack pool size per thread");
+
+static uint32_t s_stack_pool_size = 0;
+static bool s_stack_watermark = false;
+
+struct _FiberIniter
+{
+    _FiberIniter()
+    {
+        s_stack_pool_size = g_fiber_stack_pool_size->getValue();
+        g_fiber_stack_pool_size->addListener([](const uint32_t& old_value, const uint32_t& new_value)
+        {
+            s_stack_pool_size = new_value;
+        });
+
+        s_stack_watermark = g_fiber_stack_watermark->getValue();
+        g_fiber_stack_watermark->addListener([](const bool& old_value, const bool& new_value)
+        {
+            s_stack_watermark = new_value;
+        });
+    }
+};
+
+static _FiberIniter s_fiber_initer;
+
+//协程局部变量的槽位，分出去就不回收了，FiberLocal 一般都是静态的
+static std::atomic<size_t> s_local_slots {0};
+static void (*s_local_deleters[Fiber::MAX_LOCAL_SLOTS])(void*);
+
+//栈上填的花纹
+static const uint64_t s_stack_canary = 0xA5A5A5A5A5A5A5A5ull;
+
+//按回调类型（没 demangle 的名字）汇总的栈用量
+struct StackSiteStat
+{
+    uint64_t count = 0;
+    uint64_t max = 0;
+    uint64_t total = 0;
+};
+
+static Mutex s_stack_usage_mutex;
+static std::map<std::string, StackSiteStat> s_stack_usage;
+
+//fiber栈内存申请类，以前是直接 malloc 的
+// malloc 的话栈溢出了会悄悄踩坏堆，而且一个连接一个协程，1M 1M 地申请释放也很折腾分配器
+//现在直接 mmap，最下面留一页 PROT_NONE，溢出了立刻段错误
+//用完的栈按大小挂在本线程的缓存里，下次直接拿
+//缓存是后进先出的，最近用过的几个留着热的；再往下的说明闲下来了，把页还给系统，只留地址空间
+class MmapStackAllocator
 {
 public:
     static void* Alloc(size_t size)
     {
-        return malloc(size);
+        size = RoundUp(size);
+        StackCache* cache = GetCache();
+        if(cache)
+        {
+            auto it = cache->buckets.find(size);
+            if(it != cache->buckets.end() && !it->second.empty())
+            {
+                void* vp = it->second.back().stack;
+                it->second.pop_back();
+                --cache->count;
+                return vp;
+            }
+        }
+
+        size_t page = PageSize();
+        void* base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE
+                        , MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        SYLAR_ASSERT2(base != MAP_FAILED, "mmap fiber stack");
+        //栈是往下长的，保护页放在最低的地方
+        int rt = mprotect(base, page, PROT_NONE);
+        SYLAR_ASSERT2(!rt, "mprotect fiber stack guard");
+        return (char*)base + page;
     }
 
-    //留出 size，以后可以考虑切换用 mmap 的方式
     static void Dealloc(void* vp, size_t size)
     {
-        return free(vp);
+        size = RoundUp(size);
+        size_t page = PageSize();
+        StackCache* cache = GetCache();
+        if(cache && cache->count < s_stack_pool_size)
+        {
+            std::vector<CachedStack>& bucket = cache->buckets[size];
+            bucket.push_back(CachedStack{vp, false});
+            ++cache->count;
+
+            //刚被挤出热区的那个，已经有一阵没用了
+            //栈顶那一页下次马上就要用，留着；下面的都还给系统，再用到的时候重新缺页
+            if(bucket.size() > s_hot_stacks)
+            {
+                CachedStack& idle = bucket[bucket.size() - 1 - s_hot_stacks];
+                if(!idle.released)
+                {
+                    madvise(idle.stack, size - page, MADV_DONTNEED);
+                    idle.released = true;
+                }
+            }
+            return;
+        }
+        munmap((char*)vp - page, size + page);
+    }
+private:
+    //每种大小留几个热的栈不还页，一个连接一个协程的时候基本就在这几个里面转
+    static const size_t s_hot_stacks = 8;
+
+    struct CachedStack
+    {
+        void* stack;
+        //页已经还给系统了
+        bool released;
+    };
+
+    struct StackCache
+    {
+        //栈大小 -> 空闲的栈
+        std::map<size_t, std::vector<CachedStack> > buckets;
+        size_t count = 0;
+
+        ~StackCache()
+        {
+            size_t page = PageSize();
+            for(auto& i : buckets)
+            {
+                for(auto& j : i.second)
+                {
+                    munmap((char*)j.stack - page, i.first + page);
+                }
+            }
+        }
+    };
+
+    //线程退出的时候缓存先析构了，之后再来释放的（比如线程局部的协程）直接 munmap
+    struct StackCacheHolder
+    {
+        StackCache* cache = nullptr;
+        bool destroyed = false;
+
+        ~StackCacheHolder()
+        {
+            delete cache;
+            cache = nullptr;
+            destroyed = true;
+        }
+    };
+
+    static StackCache* GetCache()
+    {
+        static thread_local StackCacheHolder s_holder;
+        if(!s_holder.cache && !s_holder.destroyed)
+        {
+            s_holder.cache = new StackCache;
+        }
+        return s_holder.cache;
+    }
+
+    static size_t PageSize()
+    {
+        static size_t s_page = sysconf(_SC_PAGESIZE);
+        return s_page;
+    }
+
+    //至少两页，一页留着热的，剩下的才有得还
+    static size_t RoundUp(size_t size)
+    {
+        size_t page = PageSize();
+        size = (size + page - 1) / page * page;
+        return size < page * 2 ? page * 2 : size;
     }
 };
 
 //别名，typedef 也行。方便切换。默认构造函数只有主协程！
-using StackAllocator = MallocStackAllocator;
+using StackAllocator = MmapStackAllocator;
+
+#ifndef SYLAR_FIBER_USE_UCONTEXT
+//sylar_swap_context(from, to)：把 callee-saved 的寄存器压到当前栈上，栈顶存进 *from
+//然后换成 to 这个栈，弹出它当时压的寄存器，ret 回它切走的地方
+//新协程的栈是 initContext 伪造的，ret 出去正好落到入口函数
+//其他寄存器调用方自己会保存，信号掩码也不动，所以整个切换不进内核
+extern "C" void sylar_swap_context(void** from, void* to);
+
+#if defined(__x86_64__)
+//rbp rbx r12-r15，加上 mxcsr 跟 x87 控制字（ABI 规定这两个也要保留）
+__asm__(
+    ".text\n"
+    ".globl sylar_swap_context\n"
+    ".hidden sylar_swap_context\n"
+    ".type sylar_swap_context,@function\n"
+    ".align 16\n"
+"sylar_swap_context:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $16, %rsp\n"
+    "stmxcsr 8(%rsp)\n"
+    "fnstcw 12(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr 8(%rsp)\n"
+    "fldcw 12(%rsp)\n"
+    "addq $16, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size sylar_swap_context,.-sylar_swap_context\n"
+);
+
+//栈上的布局，从栈顶往下：mxcsr/fpcw(16) r15 r14 r13 r12 rbx rbp 返回地址
+static const size_t s_context_frame_size = 16 + 8 * 7;
+#elif defined(__aarch64__)
+//x19-x28、x29(fp)、x30(lr)，d8-d15
+__asm__(
+    ".text\n"
+    ".globl sylar_swap_context\n"
+    ".hidden sylar_swap_context\n"
+    ".type sylar_swap_context,%function\n"
+    ".align 4\n"
+"sylar_swap_context:\n"
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".size sylar_swap_context,.-sylar_swap_context\n"
+);
+
+static const size_t s_context_frame_size = 160;
+#endif
+#endif
 
 uint64_t Fiber::GetFiberId()
 {
@@ -71,34 +331,28 @@ Fiber::Fiber()
 }
 
 //真正的才开始开辟协程
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(Task cb, StackClass stack_class)
+    :Fiber(std::move(cb), GetStackSize(stack_class), false)
+{
+    m_stackClass = stack_class;
+}
+
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller)
     :m_id(++s_fiber_id)
-    ,m_cb(cb)
+    ,m_cb(std::move(cb))
 {
     SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber id = " << m_id;
     //这个是真正的协程创建
     ++s_fiber_count;
     //不给就以配置为准
     m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
-
-    m_stack = StackAllocator::Alloc(m_stacksize);
-    if(getcontext(&m_ctx))
+    if(!stacksize)
     {
-        SYLAR_ASSERT2(false, "getcontext");
+        m_stackClass = STACK_DEFAULT;
     }
 
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    if(!use_caller)
-    {
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    }
-    else
-    {
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
-    }
+    m_stack = StackAllocator::Alloc(m_stacksize);
+    initContext(use_caller);
 }
 
 Fiber::~Fiber()
@@ -111,10 +365,13 @@ Fiber::~Fiber()
                 || m_state == EXCEPT
                 || m_state == INIT, m_state);
 
+        flushStackUsage();
         StackAllocator::Dealloc(m_stack, m_stacksize);
     }
     else
     {
+        //主协程上也可以存，线程退出的时候放掉
+        clearLocals();
         //主协程
         SYLAR_ASSERT(!m_cb);
         //主协程是不会停的
@@ -131,7 +388,7 @@ Fiber::~Fiber()
     SYLAR_LOG_DEBUG(g_logger) << "fiber destory " << m_id;
 }
 
-void Fiber::reset(std::function<void()> cb)
+void Fiber::reset(Task cb)
 {
     //主协程是不会有栈的
     SYLAR_ASSERT(m_stack);
@@ -140,20 +397,178 @@ void Fiber::reset(std::function<void()> cb)
                     || m_state == EXCEPT
                     || m_state == INIT);
 
-    m_cb = cb;
+    flushStackUsage();
+    //上一个回调留下的请求上下文不能带给下一个
+    clearLocals();
+    m_cb = std::move(cb);
     //重新初始化
+    initContext(false);
+    m_state = INIT;
+}
+
+void Fiber::initContext(bool use_caller)
+{
+    void (*entry)() = use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc;
+    //use caller 的那个是调度器自己的主循环，不用量
+    if(!use_caller)
+    {
+        fillCanary();
+    }
+#ifdef SYLAR_FIBER_USE_UCONTEXT
     if(getcontext(&m_ctx))
     {
-        SYLAR_ASSERT2(false, "getcontext in reset");
+        SYLAR_ASSERT2(false, "getcontext");
     }
 
-    //等于重新初始化了吧
     m_ctx.uc_link = nullptr;
     m_ctx.uc_stack.ss_sp = m_stack;
     m_ctx.uc_stack.ss_size = m_stacksize;
 
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    m_state = INIT;
+    makecontext(&m_ctx, entry, 0);
+#else
+    //伪造一个"刚刚切走"的栈，sylar_swap_context 切进来 ret 就到 entry 了
+    //栈顶 16 对齐，ret 之后 rsp/sp 要跟正常 call 进函数的时候一样
+    uintptr_t top = ((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    //entry 的返回地址放 0，回溯到这里就停了（反正 entry 也不会返回）
+    top -= 8;
+    *(uintptr_t*)top = 0;
+    uintptr_t* frame = (uintptr_t*)(top - s_context_frame_size);
+    memset(frame, 0, s_context_frame_size);
+    frame[s_context_frame_size / 8 - 1] = (uintptr_t)entry;
+    //默认的 mxcsr 跟 x87 控制字
+    *(uint32_t*)((char*)frame + 8) = 0x1F80;
+    *(uint16_t*)((char*)frame + 12) = 0x037F;
+#elif defined(__aarch64__)
+    uintptr_t* frame = (uintptr_t*)(top - s_context_frame_size);
+    memset(frame, 0, s_context_frame_size);
+    //x30(lr) 的位置，fp 是 0，回溯到这里就停了
+    frame[11] = (uintptr_t)entry;
+#endif
+    m_ctx = frame;
+#endif
+}
+
+void Fiber::SwapContext(Fiber* from, Fiber* to)
+{
+#ifdef SYLAR_FIBER_USE_UCONTEXT
+    if(swapcontext(&from->m_ctx, &to->m_ctx))
+    {
+        SYLAR_ASSERT2(false, "swapcontext");
+    }
+#else
+    sylar_swap_context(&from->m_ctx, to->m_ctx);
+#endif
+}
+
+void Fiber::fillCanary()
+{
+    if(!s_stack_watermark)
+    {
+        m_canary = false;
+        return;
+    }
+
+    char* top = (char*)m_stack + m_stacksize;
+    if(m_canary)
+    {
+        //上一次量到的用量再多补一页：量完之后回到调度器还有几层很浅的调用
+        size_t dirty = m_stackPeak + 4096;
+        dirty = dirty > m_stacksize ? m_stacksize : dirty;
+        memset(top - dirty, 0xA5, dirty);
+    }
+    else
+    {
+        memset(m_stack, 0xA5, m_stacksize);
+        m_canary = true;
+    }
+}
+
+uint32_t Fiber::measureStack() const
+{
+    //从栈底往上找，第一个不是花纹的地方就是最深用到的地方
+    const uint64_t* p = (const uint64_t*)m_stack;
+    const uint64_t* end = (const uint64_t*)((char*)m_stack + (m_stacksize & ~(size_t)7));
+    while(p < end && *p == s_stack_canary)
+    {
+        ++p;
+    }
+    return (char*)m_stack + m_stacksize - (char*)p;
+}
+
+void Fiber::flushStackUsage()
+{
+    if(!m_stackSite)
+    {
+        return;
+    }
+
+    Mutex::Lock lock(s_stack_usage_mutex);
+    StackSiteStat& stat = s_stack_usage[m_stackSite];
+    ++stat.count;
+    stat.total += m_stackPeak;
+    if(m_stackPeak > stat.max)
+    {
+        stat.max = m_stackPeak;
+    }
+    m_stackSite = nullptr;
+}
+
+size_t Fiber::GetStackSize(StackClass stack_class)
+{
+    switch(stack_class)
+    {
+        case STACK_SMALL:
+            return g_fiber_stack_size_small->getValue();
+        case STACK_MEDIUM:
+            return g_fiber_stack_size_medium->getValue();
+        default:
+            return g_fiber_stack_size->getValue();
+    }
+}
+
+void Fiber::GetStackUsage(std::vector<StackUsage>& usage)
+{
+    std::map<std::string, StackSiteStat> stats;
+    {
+        Mutex::Lock lock(s_stack_usage_mutex);
+        stats = s_stack_usage;
+    }
+
+    for(auto& i : stats)
+    {
+        int status = 0;
+        char* name = abi::__cxa_demangle(i.first.c_str(), nullptr, nullptr, &status);
+        usage.push_back(StackUsage{name && status == 0 ? name : i.first
+                , i.second.count
+                , i.second.max
+                , i.second.count ? i.second.total / i.second.count : 0});
+        free(name);
+    }
+    std::sort(usage.begin(), usage.end(), [](const StackUsage& a, const StackUsage& b) {
+        return a.max > b.max;
+    });
+}
+
+std::string Fiber::DumpStackUsage()
+{
+    std::vector<StackUsage> usage;
+    GetStackUsage(usage);
+
+    std::stringstream ss;
+    for(auto& i : usage)
+    {
+        ss << "max=" << i.max << " avg=" << i.avg << " count=" << i.count
+           << " site=" << i.site << std::endl;
+    }
+    return ss.str();
+}
+
+//调度器的主协程，没有调度器的线程（直接用 Fiber 的）就是线程的主协程
+static Fiber* GetSwapFiber()
+{
+    Fiber* main_fiber = Scheduler::GetMainFiber();
+    return main_fiber ? main_fiber : t_threadFiber.get();
 }
 
 //当前协程置换成目标线程协程
@@ -164,10 +579,7 @@ void Fiber::call()
     SetThis(this);
 
     m_state = EXEC;
-    if(swapcontext(&(*t_threadFiber).m_ctx, &m_ctx))
-    {
-        SYLAR_ASSERT2(false, "swapcontext in call");
-    }
+    SwapContext(t_threadFiber.get(), this);
 }
 
 void Fiber::swapIn()
@@ -179,12 +591,9 @@ void Fiber::swapIn()
 
     //切换上下文，从主协程手里拿过来
     //注释是因为 scheduler 不能这样了，要切换回 scheduler 的主协程
-    //但这样修改就没办法单独使用 Fiber 模块了，额
+    //没有调度器的时候还是跟线程的主协程切，单独用 Fiber 模块也可以
     // if(swapcontext(&t_threadFiber->m_ctx, &m_ctx))
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx))
-    {
-        SYLAR_ASSERT2(false, "swapcontext in swapIn");
-    }
+    SwapContext(GetSwapFiber(), this);
 }
 
 void Fiber::back()
@@ -193,22 +602,21 @@ void Fiber::back()
 
     SetThis(t_threadFiber.get());
     //只能跟真正的主协程进行切换
-    if(swapcontext(&m_ctx, &t_threadFiber->m_ctx ))
-    {
-        SYLAR_ASSERT2(false, "swapcontext in swapOut2");
-    }
+    SwapContext(this, t_threadFiber.get());
 }
 
 //之前是有专门判断的，现在又改回去了
 void Fiber::swapOut()
 {
-    SetThis(Scheduler::GetMainFiber());
+#ifndef NDEBUG
+    //scheduleInline 的回调是在调度器主协程上直接跑的，没有协程可以让出去
+    SYLAR_ASSERT2(!Scheduler::InInlineTask(), "inline task must not yield");
+#endif
+    Fiber* main_fiber = GetSwapFiber();
+    SetThis(main_fiber);
 
     //这个同上面，跟调度器协程切换
-    if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx))
-    {
-        SYLAR_ASSERT2(false, "swapcontext in swapOut1");
-    }
+    SwapContext(this, main_fiber);
 }
 
 void Fiber::SetThis(Fiber* f)
@@ -231,6 +639,56 @@ Fiber::ptr Fiber::GetThis()
     return t_fiber->shared_from_this();
 }
 
+size_t Fiber::AllocLocalSlot(void (*deleter)(void*))
+{
+    size_t index = s_local_slots++;
+    SYLAR_ASSERT2(index < MAX_LOCAL_SLOTS, "too many FiberLocal slots");
+    s_local_deleters[index] = deleter;
+    return index;
+}
+
+void* Fiber::GetLocal(size_t index)
+{
+    Fiber* cur = t_fiber ? t_fiber : GetThis().get();
+    return index < cur->m_locals.size() ? cur->m_locals[index] : nullptr;
+}
+
+void Fiber::SetLocal(size_t index, void* value)
+{
+    Fiber* cur = t_fiber ? t_fiber : GetThis().get();
+    if(index >= cur->m_locals.size())
+    {
+        if(!value)
+        {
+            return;
+        }
+        cur->m_locals.resize(index + 1, nullptr);
+    }
+    void* old = cur->m_locals[index];
+    cur->m_locals[index] = value;
+    if(old)
+    {
+        s_local_deleters[index](old);
+    }
+}
+
+void Fiber::clearLocals()
+{
+    //先整个拿出来再放，析构里面再去碰别的局部变量也不会出问题
+    while(!m_locals.empty())
+    {
+        std::vector<void*> locals;
+        locals.swap(m_locals);
+        for(size_t i = 0; i < locals.size(); ++i)
+        {
+            if(locals[i])
+            {
+                s_local_deleters[i](locals[i]);
+            }
+        }
+    }
+}
+
 void Fiber::YieldToReady()
 {
     //静态方法，对当前正在执行的 fiber 进行操作
@@ -242,10 +700,21 @@ void Fiber::YieldToReady()
 void Fiber::YieldToHold()
 {
     Fiber::ptr cur = GetThis();
-    cur->m_state = HOLD;
+    //在调度器里先别改成 HOLD：事件可能已经在别的线程上触发，那边看到 HOLD 就会 swapIn，
+    //而这边上下文还没存完。保持 EXEC，等切回调度器主协程后由 run 改成 HOLD，
+    //这段时间被取到的会因为 EXEC 放回队列
+    if(!Scheduler::GetMainFiber())
+    {
+        cur->m_state.store(HOLD, std::memory_order_release);
+    }
     cur->swapOut();
 }
 
+bool Fiber::ShouldYield()
+{
+    return Scheduler::ShouldYield();
+}
+
 uint64_t Fiber::TotalFibers()
 {
     return s_fiber_count;
@@ -259,6 +728,9 @@ void Fiber::MainFunc()
     Fiber::ptr cur = GetThis();
     SYLAR_ASSERT(cur);
 
+    //回调跑完就清掉了，先记下是哪来的
+    const char* site = cur->m_canary ? cur->m_cb.name() : nullptr;
+
     try
     {
         cur->m_cb();
@@ -280,6 +752,14 @@ void Fiber::MainFunc()
         SYLAR_LOG_ERROR(g_logger) << "Fiber Except";
     }
     
+    //只能在这里量，还在自己的栈上，后面回调度器只剩很浅的几层了
+    //汇总放到 reset / 析构的时候做，那时候已经在调度器的栈上了
+    if(site)
+    {
+        cur->m_stackPeak = cur->measureStack();
+        cur->m_stackSite = site;
+    }
+
     //解决的就是 + 1 的问题。
     //cur 引起释放之后，它的栈也会被释放掉。继而这里的 cur 等等栈变量，会被自动销毁。
     auto raw_ptr = cur.get();
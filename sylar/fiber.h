@@ -2,15 +2,26 @@
 #define __FIBER_H__
 
 #include <memory>
+#include <atomic>
+
+//默认用手写的汇编切换上下文，只保存 callee-saved 的寄存器
+//glibc 的 swapcontext 每次都要 rt_sigprocmask 一下，协程切得多的时候全耗在这个系统调用上了
+//cmake 打开 SYLAR_FIBER_UCONTEXT，或者不是 x86-64 / aarch64 的时候，退回 ucontext
+#if defined(SYLAR_FIBER_UCONTEXT) || !(defined(__x86_64__) || defined(__aarch64__))
+#define SYLAR_FIBER_USE_UCONTEXT
 #include <ucontext.h>
+#endif
 //C++好用的库，functional 跟 shared_ptr 必须是靠前的几个
 //functional 解决了函数指针不太适合的几种场景
 //比如不能动态传不同参数的回调进去。如果多几个参数，还得用类传进来啥的
 //函数指针就是典型的c风格编程。functional就现代化的多
 #include <functional>
+#include <vector>
+#include <string>
 
 //用到互斥量那些
 #include "thread.h"
+#include "task.h"
 
 namespace sylar
 {
@@ -33,16 +44,37 @@ public:
         READY,
         EXCEPT
     };
+
+    //栈大小的档位，简单的 handler 用小栈，同样的内存能多开好几倍的协程
+    //具体大小看配置 fiber.stack_size_small / fiber.stack_size_medium / fiber.stack_size
+    enum StackClass
+    {
+        STACK_DEFAULT = 0,
+        STACK_SMALL,
+        STACK_MEDIUM,
+        STACK_CLASS_COUNT
+    };
+
+    //fiber.stack_watermark 打开之后，每个回调类型的栈用量统计
+    struct StackUsage
+    {
+        std::string site;   //回调的类型名（demangle 过的）
+        uint64_t count;     //跑了几次
+        uint64_t max;       //最多用了多少字节
+        uint64_t avg;
+    };
 private:
     //不允许默认构造，必须带入口函数
     Fiber();
 
 public:
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    //入口用 Task，std::function、lambda 都能直接传进来，调度器里也能直接 move 进来不用再拷一遍
+    Fiber(Task cb, size_t stacksize = 0, bool use_caller = false);
+    Fiber(Task cb, StackClass stack_class);
     ~Fiber();
 
     //比如，已经执行完了，就可以重新定义函数复用进去,INIT, TERM 两种状态可以合法调用
-    void reset(std::function<void()> cb);
+    void reset(Task cb);
 
     //切换，不不提供了。这不是完整的任意切换的、可以进入的协程。
     //子协程执行完之后，就会把运行的控制权丢回去给主协程（线程下的唯一主协程）
@@ -57,7 +89,13 @@ public:
     void back();
 
     uint64_t getId() const { return m_id; }
-    State getState() const { return m_state; }
+    //acquire：看到 HOLD 的话，切出去时存的上下文也一定看得到，见 Scheduler::run
+    State getState() const { return m_state.load(std::memory_order_acquire); }
+    uint32_t getStackSize() const { return m_stacksize; }
+    //按哪个档位分的栈，自己指定大小的是 STACK_CLASS_COUNT
+    StackClass getStackClass() const { return m_stackClass; }
+    //上一次跑完的时候栈最深用到了多少字节，没打开 fiber.stack_watermark 就是 0
+    uint32_t getStackPeak() const { return m_stackPeak; }
 
 public:
     //设置当前协程
@@ -69,6 +107,9 @@ public:
     static void YieldToReady();
     //协程切换到后台，并且设置为hold
     static void YieldToHold();
+    //当前任务已经连续跑太久了（超过 scheduler.yield_slice_ms，默认 0 不开，一直是 false），该让一让别人
+    //不做 IO 的长计算隔一阵看一眼：if(Fiber::ShouldYield()) Fiber::YieldToReady();
+    static bool ShouldYield();
 
     //调试，总协程数
     static uint64_t TotalFibers();
@@ -78,15 +119,56 @@ public:
     static void CallerMainFunc();
     static uint64_t GetFiberId();
 
+    //档位对应的栈大小
+    static size_t GetStackSize(StackClass stack_class);
+    //按回调类型汇总的栈用量，最深的排前面
+    static void GetStackUsage(std::vector<StackUsage>& usage);
+    static std::string DumpStackUsage();
+
+    //协程局部变量（见 fiber_local.h）：槽位全局分配，每个协程按下标存自己的值，取的时候不加锁、不查表
+    static const size_t MAX_LOCAL_SLOTS = 64;
+    //分一个槽位，deleter 用来放掉存进去的值
+    static size_t AllocLocalSlot(void (*deleter)(void*));
+    //当前协程这个槽位的值，没设置过是空
+    static void* GetLocal(size_t index);
+    //设置当前协程这个槽位的值，原来有的先放掉
+    static void SetLocal(size_t index, void* value);
+    //放掉这个协程所有的局部变量，reset、析构、回到调度器缓存的时候都会调
+    void clearLocals();
+
+private:
+    //按入口函数准备好上下文，第一次切进来就从入口开始跑
+    void initContext(bool use_caller);
+    //保存当前上下文到 from，切到 to
+    static void SwapContext(Fiber* from, Fiber* to);
+    //栈用量测量：跑之前把栈填满固定的花纹，跑完从栈底往上找第一个被改过的地方
+    void fillCanary();
+    uint32_t measureStack() const;
+    //把上一次量到的用量汇总到按回调类型的统计里
+    void flushStackUsage();
 private:
     uint64_t m_id = 0;
     uint32_t m_stacksize = 0;
-    State m_state = INIT;
+    StackClass m_stackClass = STACK_CLASS_COUNT;
+    //别的线程会看（取任务的时候看还是不是 EXEC），run 里切回来以后 release 写 HOLD
+    std::atomic<State> m_state = {INIT};
 
+#ifdef SYLAR_FIBER_USE_UCONTEXT
     ucontext_t m_ctx;
+#else
+    //切出去的时候寄存器都压在自己的栈上了，这里只记栈顶
+    void* m_ctx = nullptr;
+#endif
     void* m_stack = nullptr;
-
-    std::function<void()> m_cb;
+    //栈已经填过花纹了，下次只要把用脏了的那一截补回去
+    bool m_canary = false;
+    uint32_t m_stackPeak = 0;
+    //上一次跑的回调类型名，还没汇总的
+    const char* m_stackSite = nullptr;
+    //协程局部变量，下标是槽位
+    std::vector<void*> m_locals;
+
+    Task m_cb;
 };
 
 }
@@ -0,0 +1,79 @@
+#ifndef __SYLAR_FIBER_LOCAL_H__
+#define __SYLAR_FIBER_LOCAL_H__
+
+//协程局部变量：跟 thread_local 一样用，但是跟着协程走
+//协程被偷到别的线程上继续跑，拿到的还是自己的那份；trace id、deadline、租户这类请求上下文放这里
+//每个 FiberLocal 占一个全局槽位，取值就是当前协程按下标取一下，不加锁、不哈希
+//协程 reset、析构、回到调度器缓存的时候统一放掉，下一个回调看不到上一个的
+//不在协程里（线程的主协程、scheduleInline 的回调）存的是线程主协程上的那份，相当于 thread_local
+
+#include <utility>
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace sylar
+{
+
+template<class T>
+class FiberLocal : Noncopyable
+{
+public:
+    //槽位分出去就不还了，一般定义成静态的
+    FiberLocal()
+        :m_index(Fiber::AllocLocalSlot(&Delete))
+    {
+    }
+
+    //当前协程的值，没设置过返回空
+    T* get() const
+    {
+        return static_cast<T*>(Fiber::GetLocal(m_index));
+    }
+
+    //没有的话默认构造一个
+    T& operator*() const
+    {
+        T* v = get();
+        if(!v)
+        {
+            v = new T();
+            Fiber::SetLocal(m_index, v);
+        }
+        return *v;
+    }
+
+    T* operator->() const
+    {
+        return &**this;
+    }
+
+    void set(T v) const
+    {
+        T* cur = get();
+        if(cur)
+        {
+            *cur = std::move(v);
+        }
+        else
+        {
+            Fiber::SetLocal(m_index, new T(std::move(v)));
+        }
+    }
+
+    //放掉当前协程的值
+    void reset() const
+    {
+        Fiber::SetLocal(m_index, nullptr);
+    }
+private:
+    static void Delete(void* v)
+    {
+        delete static_cast<T*>(v);
+    }
+private:
+    size_t m_index;
+};
+
+}
+
+#endif
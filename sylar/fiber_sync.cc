@@ -0,0 +1,616 @@
+#include "fiber_sync.h"
+#include "log.h"
+#include "macro.h"
+#include "iomanager.h"
+
+namespace sylar
+{
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+//当前是不是在调度器调度起来的协程里
+//线程的主协程 id 是 0；use caller 的线程里，调度器的主协程是 root fiber，也不能挂起
+static bool InScheduledFiber()
+{
+    return Scheduler::GetThis()
+        && Fiber::GetFiberId() != 0
+        && Fiber::GetThis().get() != Scheduler::GetMainFiber();
+}
+
+FiberWaitQueue::Waiter::Waiter()
+{
+    if(InScheduledFiber())
+    {
+        scheduler = Scheduler::GetThis();
+        fiber = Fiber::GetThis();
+        prio = Scheduler::GetCurrentPriority();
+    }
+}
+
+void FiberWaitQueue::push(Waiter* w)
+{
+    w->next = nullptr;
+    if(m_tail)
+    {
+        m_tail->next = w;
+    }
+    else
+    {
+        m_head = w;
+    }
+    m_tail = w;
+    ++m_size;
+}
+
+FiberWaitQueue::Waiter* FiberWaitQueue::pop()
+{
+    Waiter* w = m_head;
+    if(w)
+    {
+        m_head = w->next;
+        if(!m_head)
+        {
+            m_tail = nullptr;
+        }
+        w->next = nullptr;
+        --m_size;
+    }
+    return w;
+}
+
+FiberWaitQueue::Waiter* FiberWaitQueue::popAll()
+{
+    Waiter* w = m_head;
+    m_head = m_tail = nullptr;
+    m_size = 0;
+    return w;
+}
+
+bool FiberWaitQueue::remove(Waiter* w)
+{
+    Waiter* prev = nullptr;
+    for(Waiter* i = m_head; i; prev = i, i = i->next)
+    {
+        if(i != w)
+        {
+            continue;
+        }
+        if(prev)
+        {
+            prev->next = i->next;
+        }
+        else
+        {
+            m_head = i->next;
+        }
+        if(m_tail == i)
+        {
+            m_tail = prev;
+        }
+        i->next = nullptr;
+        --m_size;
+        return true;
+    }
+    return false;
+}
+
+void FiberWaitQueue::Park(Waiter& w)
+{
+    //看 scheduler 不看 fiber：放开锁之后叫醒的人随时会把 fiber 拿走
+    if(!w.scheduler)
+    {
+        w.sem.wait();
+        return;
+    }
+
+    //不用 YieldToHold：它先把状态改成 HOLD 再切出去，叫醒的人要是这时候 schedule 了
+    //别的线程就会在我们还没切走的时候切进这个协程。保持 EXEC 切出去，调度器看到 EXEC 会先放回去等一下
+    //切回到调度器之后 run 会把状态改成 HOLD
+    //这时候 fiber 的引用在 Waiter 或者调度器的队列里，这里拿裸指针就行
+    Fiber* cur = Fiber::GetThis().get();
+    cur->swapOut();
+}
+
+void FiberWaitQueue::Wake(Waiter* list)
+{
+    while(list)
+    {
+        Waiter* w = list;
+        list = list->next;
+
+        if(w->scheduler)
+        {
+            Scheduler* scheduler = w->scheduler;
+            Scheduler::Priority prio = w->prio;
+            Fiber::ptr fiber;
+            fiber.swap(w->fiber);
+            //从这里开始 w 就可能没了
+            scheduler->schedule(std::move(fiber), -1, prio);
+        }
+        else
+        {
+            w->sem.notify();
+        }
+    }
+}
+
+//带超时等的时候，定时器跟等的人共用的状态
+//定时器先拿 mutex 看 done，没 done 的话等的人一定还挂着，queue 也一定还在
+struct TimedWait
+{
+    Spinlock mutex;
+    bool done = false;
+    bool timedout = false;
+    FiberWaitQueue* queue = nullptr;
+    FiberWaitQueue::Waiter* waiter = nullptr;
+};
+
+//不是 IOManager 的调度器没有定时器，带超时等的时候用这个共用的：一个后台线程专门跑到期的回调
+//回调只是把等的协程摘下来 schedule 回去，不会阻塞，一个线程够用了。第一次用到的时候才起线程
+class FallbackTimerManager : public TimerManager
+{
+public:
+    static FallbackTimerManager* GetInstance()
+    {
+        //故意不析构：进程退出的时候后台线程可能还在 wait，析构了它就要用到释放掉的东西
+        static FallbackTimerManager* s_instance = new FallbackTimerManager;
+        return s_instance;
+    }
+private:
+    FallbackTimerManager()
+    {
+        m_thread.reset(new Thread(std::bind(&FallbackTimerManager::run, this), "sync_timer"));
+    }
+
+    void run()
+    {
+        std::vector<std::function<void()> > cbs;
+        while(true)
+        {
+            uint64_t next = getNextTimer();
+            if(next == ~0ull)
+            {
+                m_sem.wait();
+            }
+            else if(next > 0)
+            {
+                m_sem.waitFor(next);
+            }
+            listExpiredCb(cbs);
+            for(auto& i : cbs)
+            {
+                i();
+            }
+            cbs.clear();
+        }
+    }
+
+    void onTimerInsertedAtFront() override
+    {
+        m_sem.notify();
+    }
+private:
+    Semaphore m_sem;
+    Thread::ptr m_thread;
+};
+
+bool FiberWaitQueue::parkFor(Waiter& w, uint64_t timeout_ms)
+{
+    if(timeout_ms == ~0ull)
+    {
+        Park(w);
+        return true;
+    }
+
+    if(!w.scheduler)
+    {
+        if(w.sem.waitFor(timeout_ms))
+        {
+            return true;
+        }
+        {
+            MutexType::Lock lock(m_mutex);
+            if(remove(&w))
+            {
+                return false;
+            }
+        }
+        //摘不下来说明刚好被人摘走了，它马上会 notify，要等它碰完 sem 才能走
+        w.sem.wait();
+        return true;
+    }
+
+    //IOManager 里用它自己的定时器，叫醒不用跨线程；普通 Scheduler 用共用的后台定时器
+    TimerManager* timers = IOManager::GetThis();
+    if(!timers)
+    {
+        timers = FallbackTimerManager::GetInstance();
+    }
+
+    std::shared_ptr<TimedWait> tw(new TimedWait);
+    tw->queue = this;
+    tw->waiter = &w;
+    std::weak_ptr<TimedWait> weak_tw(tw);
+    Timer::ptr timer = timers->addTimer(timeout_ms, [weak_tw](){
+        std::shared_ptr<TimedWait> tw = weak_tw.lock();
+        if(!tw)
+        {
+            return;
+        }
+        Waiter* w = nullptr;
+        {
+            Spinlock::Lock lock(tw->mutex);
+            if(tw->done)
+            {
+                return;
+            }
+            MutexType::Lock qlock(tw->queue->m_mutex);
+            if(tw->queue->remove(tw->waiter))
+            {
+                tw->timedout = true;
+                w = tw->waiter;
+            }
+        }
+        //摘下来了就只有我们能叫醒它
+        Wake(w);
+    }, false, true);
+
+    Park(w);
+    {
+        Spinlock::Lock lock(tw->mutex);
+        tw->done = true;
+    }
+    timer->cancel();
+    return !tw->timedout;
+}
+
+void FiberMutex::lock()
+{
+    int c = 0;
+    if(m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    //有人拿着，标记成有人在等，然后去排队
+    if(c != 2)
+    {
+        c = m_state.exchange(2, std::memory_order_acquire);
+    }
+    while(c != 0)
+    {
+        FiberWaitQueue::Waiter w;
+        {
+            FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+            //在锁里面再看一次，解锁的人是先改状态再拿这个锁叫人的，所以不会漏
+            if(m_state.load(std::memory_order_relaxed) == 2)
+            {
+                m_waiters.push(&w);
+                lock.unlock();
+                FiberWaitQueue::Park(w);
+            }
+        }
+        //醒了也不是直接交给我们的，要重新抢，抢到的时候保守一点标成 2
+        c = m_state.exchange(2, std::memory_order_acquire);
+    }
+}
+
+bool FiberMutex::tryLock()
+{
+    int c = 0;
+    return m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+void FiberMutex::unlock()
+{
+    if(m_state.fetch_sub(1, std::memory_order_release) == 1)
+    {
+        //1 -> 0，没人等
+        return;
+    }
+
+    m_state.store(0, std::memory_order_release);
+    FiberWaitQueue::Waiter* w = nullptr;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        w = m_waiters.pop();
+    }
+    FiberWaitQueue::Wake(w);
+}
+
+FiberSemaphore::FiberSemaphore(int64_t count)
+    :m_count(count)
+{
+}
+
+void FiberSemaphore::wait()
+{
+    if(m_count.fetch_sub(1, std::memory_order_acquire) > 0)
+    {
+        return;
+    }
+
+    FiberWaitQueue::Waiter w;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        if(m_pending > 0)
+        {
+            //notify 比我们排队还早到
+            --m_pending;
+            return;
+        }
+        m_waiters.push(&w);
+    }
+    //叫醒的时候名额是直接交给我们的，醒了就是拿到了
+    FiberWaitQueue::Park(w);
+}
+
+bool FiberSemaphore::tryWait()
+{
+    int64_t c = m_count.load(std::memory_order_relaxed);
+    while(c > 0)
+    {
+        if(m_count.compare_exchange_weak(c, c - 1, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FiberSemaphore::notify()
+{
+    if(m_count.fetch_add(1, std::memory_order_release) >= 0)
+    {
+        return;
+    }
+
+    //有人在等（或者马上要排进来）
+    FiberWaitQueue::Waiter* w = nullptr;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        w = m_waiters.pop();
+        if(!w)
+        {
+            ++m_pending;
+        }
+    }
+    FiberWaitQueue::Wake(w);
+}
+
+void FiberCondition::wait(FiberMutex& mutex)
+{
+    FiberWaitQueue::Waiter w;
+    {
+        //先排上队再放开 mutex，改条件的人要拿 mutex，所以 notify 不会在我们排队之前漏掉
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        m_waiters.push(&w);
+    }
+    mutex.unlock();
+    FiberWaitQueue::Park(w);
+    mutex.lock();
+}
+
+bool FiberCondition::waitFor(FiberMutex& mutex, uint64_t timeout_ms)
+{
+    FiberWaitQueue::Waiter w;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        m_waiters.push(&w);
+    }
+    mutex.unlock();
+    bool rt = m_waiters.parkFor(w, timeout_ms);
+    mutex.lock();
+    return rt;
+}
+
+void FiberCondition::notify()
+{
+    //没人等就不拿锁了。等的人是拿着 mutex 排队的，notify 的人拿着 mutex 的话一定看得到
+    if(m_waiters.empty())
+    {
+        return;
+    }
+
+    FiberWaitQueue::Waiter* w = nullptr;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        w = m_waiters.pop();
+    }
+    FiberWaitQueue::Wake(w);
+}
+
+void FiberCondition::notifyAll()
+{
+    if(m_waiters.empty())
+    {
+        return;
+    }
+
+    FiberWaitQueue::Waiter* w = nullptr;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        w = m_waiters.popAll();
+    }
+    FiberWaitQueue::Wake(w);
+}
+
+void WaitGroup::add(int64_t n)
+{
+    //加的时候没人会因为这个醒，不用锁
+    if(n > 0)
+    {
+        m_count.fetch_add(n);
+        return;
+    }
+
+    //减要在锁里面减：wait 的人也是拿着锁看的，看到 0 的时候我们已经放开锁不会再碰这个对象了
+    //WaitGroup 一般就放在等的协程的栈上，wait 一返回就没了
+    FiberWaitQueue::Waiter* w = nullptr;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        int64_t v = m_count.fetch_add(n) + n;
+        SYLAR_ASSERT2(v >= 0, "WaitGroup count < 0");
+        if(v == 0)
+        {
+            w = m_waiters.popAll();
+        }
+    }
+    FiberWaitQueue::Wake(w);
+}
+
+void WaitGroup::done()
+{
+    add(-1);
+}
+
+void WaitGroup::wait()
+{
+    waitFor(~0ull);
+}
+
+bool WaitGroup::waitFor(uint64_t timeout_ms)
+{
+    FiberWaitQueue::Waiter w;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_waiters.mutex());
+        if(m_count == 0)
+        {
+            return true;
+        }
+        m_waiters.push(&w);
+    }
+    return m_waiters.parkFor(w, timeout_ms);
+}
+
+void FiberRWMutex::rdlock()
+{
+    //快路径：没有写拿着，也没人排队，读的个数 +1 就行
+    uint32_t s = m_state.load(std::memory_order_relaxed);
+    while(!(s & (WRITER | WAITERS)))
+    {
+        if(m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            return;
+        }
+    }
+
+    FiberWaitQueue::Waiter w;
+    FiberWaitQueue::MutexType::Lock lock(m_readers.mutex());
+    s = m_state.load(std::memory_order_relaxed);
+    while(true)
+    {
+        if(!(s & WRITER) && m_writersWaiting == 0)
+        {
+            if(m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                return;
+            }
+            continue;
+        }
+        //挂上 WAITERS，之后所有的状态变化都要在锁里面做
+        if(m_state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    m_readers.push(&w);
+    lock.unlock();
+    //解锁的人会直接帮我们把读的个数加上
+    FiberWaitQueue::Park(w);
+}
+
+void FiberRWMutex::wrlock()
+{
+    uint32_t s = 0;
+    if(m_state.compare_exchange_strong(s, WRITER, std::memory_order_acquire, std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    FiberWaitQueue::Waiter w;
+    FiberWaitQueue::MutexType::Lock lock(m_readers.mutex());
+    s = m_state.load(std::memory_order_relaxed);
+    while(true)
+    {
+        if((s & ~WAITERS) == 0 && m_writersWaiting == 0)
+        {
+            if(m_state.compare_exchange_weak(s, s | WRITER, std::memory_order_acquire, std::memory_order_relaxed))
+            {
+                return;
+            }
+            continue;
+        }
+        if(m_state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    ++m_writersWaiting;
+    m_writers.push(&w);
+    lock.unlock();
+    //解锁的人会直接把 WRITER 给我们挂上
+    FiberWaitQueue::Park(w);
+}
+
+void FiberRWMutex::unlock()
+{
+    uint32_t s = m_state.load(std::memory_order_relaxed);
+    while(!(s & WAITERS))
+    {
+        uint32_t ns = (s & WRITER) ? 0 : s - 1;
+        if(m_state.compare_exchange_weak(s, ns, std::memory_order_release, std::memory_order_relaxed))
+        {
+            return;
+        }
+    }
+    unlockSlow();
+}
+
+void FiberRWMutex::unlockSlow()
+{
+    FiberWaitQueue::Waiter* w = nullptr;
+    {
+        FiberWaitQueue::MutexType::Lock lock(m_readers.mutex());
+        //挂着 WAITERS 的时候，别人的快路径都走不通，状态只会在这个锁里面改
+        uint32_t s = m_state.load(std::memory_order_relaxed);
+        SYLAR_ASSERT(s & WAITERS);
+        if(s & WRITER)
+        {
+            s &= ~WRITER;
+        }
+        else
+        {
+            SYLAR_ASSERT(s & READER_MASK);
+            --s;
+        }
+
+        if(!(s & READER_MASK))
+        {
+            if(m_writersWaiting)
+            {
+                //写优先，直接交给排队的第一个写
+                w = m_writers.pop();
+                --m_writersWaiting;
+                s |= WRITER;
+            }
+            else
+            {
+                //读的一起放进去
+                w = m_readers.popAll();
+                for(FiberWaitQueue::Waiter* i = w; i; i = i->next)
+                {
+                    ++s;
+                }
+            }
+        }
+
+        if(m_writers.empty() && m_readers.empty())
+        {
+            s &= ~WAITERS;
+        }
+        m_state.store(s, std::memory_order_release);
+    }
+    FiberWaitQueue::Wake(w);
+}
+
+}
@@ -0,0 +1,160 @@
+#ifndef __SYLAR_FIBER_SYNC_H__
+#define __SYLAR_FIBER_SYNC_H__
+
+//协程版的同步原语
+//thread.h 里的锁等的时候整个线程都阻塞了，这个线程上的其他协程也跟着一起卡住
+//这里的等的时候只挂起当前协程（不进内核），被叫醒的时候 schedule 回它原来的调度器
+//没有竞争的时候只有一次原子操作，有竞争才会去拿内部的自旋锁排队
+//不在协程里（普通线程、调度器自己的主协程）用的话，退回用信号量阻塞线程
+
+#include <atomic>
+#include "thread.h"
+#include "fiber.h"
+#include "scheduler.h"
+
+namespace sylar
+{
+
+//等待队列，下面几个的慢路径共用
+class FiberWaitQueue : Noncopyable
+{
+public:
+    typedef Spinlock MutexType;
+
+    //等待者，放在等的人自己的栈上，挂起期间一直有效
+    struct Waiter
+    {
+        //构造的时候就看好是挂起协程，还是阻塞线程
+        Waiter();
+
+        //空的就是不在协程里，用 sem 等，构造完就不会再改了
+        Scheduler* scheduler = nullptr;
+        //叫醒的人会把它拿走交给调度器
+        Fiber::ptr fiber;
+        Scheduler::Priority prio = Scheduler::NORMAL;
+        //不在协程里的时候用
+        Semaphore sem;
+        Waiter* next = nullptr;
+    };
+
+    //下面几个都要拿着 mutex() 调用
+    void push(Waiter* w);
+    //摘一个，没有返回空
+    Waiter* pop();
+    //全部摘下来，用 next 串着
+    Waiter* popAll();
+    //w 还在队列上就摘下来返回 true，已经被摘走（正在被叫醒）返回 false
+    bool remove(Waiter* w);
+    bool empty() const { return m_size == 0; }
+    //锁外面也能看个大概
+    size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+    MutexType& mutex() { return m_mutex; }
+
+    //挂起，直到被 Wake。调用之前要先放开 mutex()
+    static void Park(Waiter& w);
+    //跟 Park 一样，但最多等 timeout_ms（~0ull 就是一直等），超时了自己从队列上摘下来，返回 false
+    //协程里用当前 IOManager 的定时器来叫醒；普通 Scheduler 上没有定时器，用一个共用的后台定时器线程
+    //不在协程里就是信号量带超时等
+    bool parkFor(Waiter& w, uint64_t timeout_ms);
+    //叫醒一串（用 next 串着的），不要拿着 mutex() 调，里面会去 schedule
+    //叫醒之后 Waiter 随时可能没了，所以 next 要先读出来，这里面处理好了
+    static void Wake(Waiter* list);
+private:
+    MutexType m_mutex;
+    Waiter* m_head = nullptr;
+    Waiter* m_tail = nullptr;
+    std::atomic<size_t> m_size = {0};
+};
+
+//协程互斥锁
+//state：0 没锁，1 锁了没人等，2 锁了可能有人在等（解锁的时候要去叫人）
+class FiberMutex : Noncopyable
+{
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    void lock();
+    bool tryLock();
+    void unlock();
+private:
+    std::atomic<int> m_state = {0};
+    FiberWaitQueue m_waiters;
+};
+
+//协程信号量
+//count 小于 0 的时候，绝对值就是在等的人数
+class FiberSemaphore : Noncopyable
+{
+public:
+    FiberSemaphore(int64_t count = 0);
+
+    void wait();  // -1
+    bool tryWait();
+    void notify(); // +1
+private:
+    std::atomic<int64_t> m_count;
+    //notify 的时候等的人已经减过了，但还没来得及排进队列，先记一个，它排队的时候直接拿走
+    int64_t m_pending = 0;
+    FiberWaitQueue m_waiters;
+};
+
+//协程条件变量，配合 FiberMutex 用
+class FiberCondition : Noncopyable
+{
+public:
+    //进来的时候要拿着 mutex，等的时候放开，醒来之前重新拿上
+    //可能会假醒，调用的地方要自己 while 判断条件
+    void wait(FiberMutex& mutex);
+    //最多等 timeout_ms，超时返回 false（醒来的时候同样是拿着 mutex 的）
+    //在哪都能用：IOManager、普通 Scheduler 的协程，或者普通线程，超时怎么实现见 FiberWaitQueue::parkFor
+    bool waitFor(FiberMutex& mutex, uint64_t timeout_ms);
+    void notify();
+    void notifyAll();
+private:
+    FiberWaitQueue m_waiters;
+};
+
+//等一组任务做完：派出去之前 add，每个做完 done，wait 的协程挂起直到减到 0
+class WaitGroup : Noncopyable
+{
+public:
+    void add(int64_t n = 1);
+    void done();
+    void wait();
+    //最多等 timeout_ms，超时返回 false，跟 FiberCondition::waitFor 一样在哪都能用
+    bool waitFor(uint64_t timeout_ms);
+    int64_t getCount() const { return m_count; }
+private:
+    std::atomic<int64_t> m_count = {0};
+    FiberWaitQueue m_waiters;
+};
+
+//协程读写锁，写优先：有写在等的时候，新来的读也要排队，不然写会被一直读饿着
+//state 低 30 位是读的个数，WRITER 是有写拿着，WAITERS 是有人在排队（有的话快路径就不能走了）
+class FiberRWMutex : Noncopyable
+{
+public:
+    typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+    typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+    void rdlock();
+    void wrlock();
+    void unlock();
+private:
+    void unlockSlow();
+private:
+    static const uint32_t WRITER = 1u << 30;
+    static const uint32_t WAITERS = 1u << 31;
+    static const uint32_t READER_MASK = WRITER - 1;
+
+    std::atomic<uint32_t> m_state = {0};
+    //下面这些都在 m_readers 的锁里面改
+    FiberWaitQueue m_readers;
+    FiberWaitQueue m_writers;
+    size_t m_writersWaiting = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include "future.h"
+#include "util.h"
+
+namespace sylar
+{
+
+bool FutureStateBase::isReady()
+{
+    MutexType::Lock lock(m_mutex);
+    return m_ready;
+}
+
+void FutureStateBase::wait()
+{
+    waitFor(~0ull);
+}
+
+bool FutureStateBase::waitFor(uint64_t timeout_ms)
+{
+    MutexType::Lock lock(m_mutex);
+    if(m_ready)
+    {
+        return true;
+    }
+    if(timeout_ms == ~0ull)
+    {
+        while(!m_ready)
+        {
+            m_cond.wait(m_mutex);
+        }
+        return true;
+    }
+
+    uint64_t deadline = GetCurrentMS() + timeout_ms;
+    while(!m_ready)
+    {
+        uint64_t now = GetCurrentMS();
+        if(now >= deadline)
+        {
+            return false;
+        }
+        m_cond.waitFor(m_mutex, deadline - now);
+    }
+    return true;
+}
+
+bool FutureStateBase::setException(std::exception_ptr error)
+{
+    MutexType::Lock lock(m_mutex);
+    if(m_ready)
+    {
+        return false;
+    }
+    m_error = error;
+    markReady(lock);
+    return true;
+}
+
+uint64_t FutureStateBase::onReady(std::function<void()> cb)
+{
+    MutexType::Lock lock(m_mutex);
+    if(!m_ready)
+    {
+        uint64_t id = m_nextCallbackId++;
+        m_callbacks.emplace_back(id, std::move(cb));
+        return id;
+    }
+    lock.unlock();
+    cb();
+    return 0;
+}
+
+bool FutureStateBase::removeOnReady(uint64_t id)
+{
+    MutexType::Lock lock(m_mutex);
+    for(auto it = m_callbacks.begin(); it != m_callbacks.end(); ++it)
+    {
+        if(it->first == id)
+        {
+            m_callbacks.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t FutureStateBase::pendingCallbacks()
+{
+    MutexType::Lock lock(m_mutex);
+    return m_callbacks.size();
+}
+
+void FutureStateBase::markReady(MutexType::Lock& lock)
+{
+    m_ready = true;
+    m_cond.notifyAll();
+    std::vector<std::pair<uint64_t, std::function<void()> > > cbs;
+    cbs.swap(m_callbacks);
+    //回调在锁外面跑，回调里面再来碰这个 future 也不会死锁
+    lock.unlock();
+    for(auto& i : cbs)
+    {
+        i.second();
+    }
+}
+
+void FutureStateBase::waitAndRethrow()
+{
+    wait();
+    //有结果之后就不会再改了，不用锁
+    if(m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+}
+
+}
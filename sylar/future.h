@@ -0,0 +1,266 @@
+#ifndef __SYLAR_FUTURE_H__
+#define __SYLAR_FUTURE_H__
+
+//Future / Promise：派出去的活，结果（或者异常）从这里拿回来
+//等的时候用的是 fiber_sync 的条件变量，协程里只挂起协程
+//超时走当前 IOManager 的定时器，普通 Scheduler 的协程里走共用的后台定时器线程，普通线程里是信号量带超时
+//一个请求要并行调几个后端：每个 Async 出去拿一个 Future，再 WhenAll 等齐，不用一个个串着调
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <exception>
+#include "fiber_sync.h"
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+
+namespace sylar
+{
+
+//跟值类型无关的部分：状态、等待、异常、回调
+class FutureStateBase : Noncopyable
+{
+public:
+    typedef FiberMutex MutexType;
+
+    bool isReady();
+    void wait();
+    //最多等 timeout_ms（~0ull 就是一直等），超时返回 false。不要求在 IOManager 里，见文件开头
+    bool waitFor(uint64_t timeout_ms);
+    //已经有结果了返回 false
+    bool setException(std::exception_ptr error);
+    //有结果了就调 cb（在设置结果的那个上下文里调），已经有了就直接调
+    //返回挂上的回调的编号，removeOnReady 用；已经有结果、直接调掉了的返回 0
+    uint64_t onReady(std::function<void()> cb);
+    //还没跑的回调摘掉，已经跑了（或者正在跑）返回 false
+    bool removeOnReady(uint64_t id);
+    //还挂着没跑的回调个数，测试、监控用
+    size_t pendingCallbacks();
+protected:
+    //拿着锁、确认还没结果、值已经放好之后调：叫醒等的人，跑回调
+    void markReady(MutexType::Lock& lock);
+    //等到有结果，有异常就抛出来
+    void waitAndRethrow();
+protected:
+    MutexType m_mutex;
+    FiberCondition m_cond;
+    bool m_ready = false;
+    std::exception_ptr m_error;
+    std::vector<std::pair<uint64_t, std::function<void()> > > m_callbacks;
+    uint64_t m_nextCallbackId = 1;
+};
+
+template<class T>
+class FutureState : public FutureStateBase
+{
+public:
+    typedef std::shared_ptr<FutureState> ptr;
+
+    bool setValue(T v)
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_ready)
+        {
+            return false;
+        }
+        m_value.reset(new T(std::move(v)));
+        markReady(lock);
+        return true;
+    }
+
+    const T& get()
+    {
+        waitAndRethrow();
+        return *m_value;
+    }
+private:
+    //不要求 T 能默认构造
+    std::unique_ptr<T> m_value;
+};
+
+template<>
+class FutureState<void> : public FutureStateBase
+{
+public:
+    typedef std::shared_ptr<FutureState> ptr;
+
+    bool setValue()
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_ready)
+        {
+            return false;
+        }
+        markReady(lock);
+        return true;
+    }
+
+    void get()
+    {
+        waitAndRethrow();
+    }
+};
+
+//拿结果的一端，可以拷贝，多个地方一起等同一个结果
+template<class T>
+class Future
+{
+public:
+    Future() {}
+    Future(typename FutureState<T>::ptr state)
+        :m_state(std::move(state))
+    {
+    }
+
+    bool valid() const { return m_state != nullptr; }
+    bool isReady() const { return m_state->isReady(); }
+    void wait() const { m_state->wait(); }
+    bool waitFor(uint64_t timeout_ms) const { return m_state->waitFor(timeout_ms); }
+    uint64_t onReady(std::function<void()> cb) const { return m_state->onReady(std::move(cb)); }
+    bool removeOnReady(uint64_t id) const { return m_state->removeOnReady(id); }
+    size_t pendingCallbacks() const { return m_state->pendingCallbacks(); }
+
+    //等到有结果；对面设置的是异常的话，这里原样抛出来
+    auto get() const -> decltype(std::declval<FutureState<T> >().get())
+    {
+        return m_state->get();
+    }
+private:
+    typename FutureState<T>::ptr m_state;
+};
+
+//给结果的一端，只能设置一次，再设置返回 false
+template<class T>
+class Promise
+{
+public:
+    Promise()
+        :m_state(new FutureState<T>)
+    {
+    }
+
+    Future<T> getFuture() const { return Future<T>(m_state); }
+
+    template<class... Args>
+    bool setValue(Args&&... args) const { return m_state->setValue(std::forward<Args>(args)...); }
+    bool setException(std::exception_ptr error) const { return m_state->setException(error); }
+private:
+    typename FutureState<T>::ptr m_state;
+};
+
+namespace detail
+{
+
+template<class R>
+struct Fulfill
+{
+    template<class F>
+    static void run(const Promise<R>& p, F& f)
+    {
+        p.setValue(f());
+    }
+};
+
+template<>
+struct Fulfill<void>
+{
+    template<class F>
+    static void run(const Promise<void>& p, F& f)
+    {
+        f();
+        p.setValue();
+    }
+};
+
+}
+
+//把 f 丢给调度器去跑（默认当前的），返回值或者抛出来的异常都放进 Future
+template<class F>
+auto Async(F f, Scheduler* sc = nullptr) -> Future<decltype(f())>
+{
+    typedef decltype(f()) R;
+    Promise<R> p;
+    Future<R> future = p.getFuture();
+    if(!sc)
+    {
+        sc = Scheduler::GetThis();
+    }
+    SYLAR_ASSERT2(sc, "Async needs a scheduler");
+    sc->schedule([p, f]() mutable {
+        try
+        {
+            detail::Fulfill<R>::run(p, f);
+        }
+        catch(...)
+        {
+            p.setException(std::current_exception());
+        }
+    });
+    return future;
+}
+
+//全部都有结果了返回 true，超时返回 false。有异常的也算有结果，get 的时候再抛
+//超时跟 Future::waitFor 一样，普通 Scheduler、普通线程里也能用
+template<class T>
+bool WhenAll(const std::vector<Future<T> >& futures, uint64_t timeout_ms = ~0ull)
+{
+    uint64_t deadline = timeout_ms == ~0ull ? ~0ull : GetCurrentMS() + timeout_ms;
+    for(auto& i : futures)
+    {
+        uint64_t left = ~0ull;
+        if(deadline != ~0ull)
+        {
+            uint64_t now = GetCurrentMS();
+            left = deadline > now ? deadline - now : 0;
+        }
+        if(!i.waitFor(left))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//随便哪个有结果了就返回它的下标，超时返回 -1（超时在哪都能用，同 WhenAll）
+//没结果的每个挂一个回调，谁先来谁把下标填进去，只有第一个填得进去
+//返回之前把没跑的回调都摘掉，不然对着同一批长期没结果的 future 反复 WhenAny，回调会越挂越多
+template<class T>
+int WhenAny(const std::vector<Future<T> >& futures, uint64_t timeout_ms = ~0ull)
+{
+    for(size_t i = 0; i < futures.size(); ++i)
+    {
+        if(futures[i].isReady())
+        {
+            return i;
+        }
+    }
+    if(futures.empty())
+    {
+        return -1;
+    }
+
+    Promise<int> first;
+    std::vector<uint64_t> ids(futures.size(), 0);
+    for(size_t i = 0; i < futures.size(); ++i)
+    {
+        int idx = i;
+        ids[i] = futures[i].onReady([first, idx](){
+            first.setValue(idx);
+        });
+    }
+    Future<int> f = first.getFuture();
+    bool ready = f.waitFor(timeout_ms);
+    for(size_t i = 0; i < futures.size(); ++i)
+    {
+        if(ids[i])
+        {
+            futures[i].removeOnReady(ids[i]);
+        }
+    }
+    return ready ? f.get() : -1;
+}
+
+}
+
+#endif
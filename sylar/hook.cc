@@ -7,6 +7,7 @@
 #include "iomanager.h"
 #include "fd_manager.h"
 #include "macro.h"
+#include "uring.h"
 #include <stdarg.h>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
@@ -94,10 +95,37 @@ struct timer_info
     int cancelled = 0;
 };
 
+//io_uring 后端直接交给内核做的那一次操作，字段按 SQE 的填
+struct uring_op
+{
+    uint8_t opcode;
+    const void* addr;
+    uint32_t len;
+    uint64_t off;
+    uint32_t flags;
+};
+
+//没有 io_uring 的头文件就都是空的，do_io 只走 epoll
+#if SYLAR_HAVE_URING
+#define URING_OP(name, ...) uring_op name##_op = {__VA_ARGS__}; const uring_op* name = &name##_op;
+#else
+#define URING_OP(name, ...) const uring_op* name = nullptr;
+#endif
+
+//errno 是线程局部的，glibc 的 __errno_location 是 const 函数，同一个函数里编译器只取一次地址一直用
+//协程挂起再醒来可能已经换了线程，还拿老地址的话读写的就是别的线程的 errno。会挂起的函数里都用这个
+static __attribute__((noinline)) int& fiber_errno()
+{
+    //不让编译器把它也当成 const 的
+    __asm__ __volatile__("");
+    return errno;
+}
+
 // ioevent里 的 event，timeout_so 是fdmanager里超时的类型。args 是要hook的函数的匿名参数。forward 展开
+// op 是 io_uring 后端换成的操作，没有（nullptr）就还是走 epoll
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_func_name,
-        uint32_t event, int timeout_so, Args&&... args)
+        uint32_t event, int timeout_so, const uring_op* op, Args&&... args)
 {
     //如果不 hook，就原参数
     if(!sylar::t_hook_enable)
@@ -120,7 +148,7 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_func_name,
     if(ctx->isClose())
     {
         //存在且关闭了
-        errno = EBADF;
+        fiber_errno() = EBADF;
         return -1;
     }
 
@@ -136,23 +164,64 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_func_name,
     // condition timer
     std::shared_ptr<timer_info> tinfo(new timer_info);
 
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    //io_uring 后端：读（accept）多半是要等的，不先试了，直接交给内核；写多半一次就写进去了，还是先试，写不进去再交
+    bool uring = op && iom && iom->isUring();
+    bool tried = event == sylar::IOManager::WRITE;
+
 //精华部分
 retry:
-    ssize_t n = fun(fd, std::forward<Args>(args)...);
-    while(n == -1 && errno == EINTR)
+    ssize_t n = -1;
+    if(uring && !tried)
+    {
+        //交进去的请求会拿着文件的引用，关掉之后再交的话 close 就关不掉它了
+        if(ctx->isClose())
+        {
+            fiber_errno() = EBADF;
+            return -1;
+        }
+        n = iom->uringIo(fd, op->opcode, op->addr, op->len, op->off, op->flags, to);
+        if(n != -ENOSYS)
+        {
+            if(n >= 0)
+            {
+                return n;
+            }
+            fiber_errno() = -n;
+            return -1;
+        }
+        //交不进去（SQ 满了之类的），这一次还是走 epoll
+        uring = false;
+    }
+    tried = true;
+    n = fun(fd, std::forward<Args>(args)...);
+    while(n == -1 && fiber_errno() == EINTR)
     {
         //中断，重试
         n = fun(fd, std::forward<Args>(args)...);
     }
 
-    if(n == -1 && errno == EAGAIN)
+    if(n == -1 && fiber_errno() == EAGAIN && uring)
+    {
+        tried = false;
+        goto retry;
+    }
+    if(n == -1 && fiber_errno() == EAGAIN)
     {
         //阻塞状态，没数据了
-        sylar::IOManager* iom = sylar::IOManager::GetThis();
+        //没有传入 cb，所以是直接用本 fiber 做为回调。fd 一直挂在 epoll 上，这里一般不用 epoll_ctl
+        int rt = iom->waitEvent(fd, (sylar::IOManager::Event)(event));
+        if(rt == 1)
+        {
+            //上次 EAGAIN 之后已经来过边沿了，不挂起，直接再读写一次
+            goto retry;
+        }
+
         sylar::Timer::ptr timer;
         std::weak_ptr<timer_info> winfo(tinfo);
 
-        if(to != (uint64_t)-1)
+        //先挂上再加定时器，直接重试的那次就不用白加一个了。事件在这中间来了也不要紧，协程切出去之前不会被拿去跑
+        if(rt == 0 && to != (uint64_t)-1)
         {
             //注意这里的回调，是可能被不同线程调度到的。所以加了很多的判断（有可能跟下面的同时进行）
             timer = iom->addConditionTimer(to, [winfo, fd, iom, event](){
@@ -164,20 +233,13 @@ retry:
                 t->cancelled = ETIMEDOUT;
                 //取消时间，强制唤醒。因为已经超时了
                 iom->cancelEvent(fd, (sylar::IOManager::Event)(event));
-            }, winfo);
+            }, winfo, false, true);
         }
-        //没有传入 cb，所以是直接用本 fiber 做为回调
-        int rt = iom->addEvent(fd, (sylar::IOManager::Event)(event));
         if(rt)
         {
             SYLAR_LOG_ERROR(g_logger) << hook_func_name << " addEvent("
                     << fd << ", " << event << ")";
 
-            if(timer)
-            {
-                timer->cancel();
-            }
-            
             //直接失败
             return -1;
         }
@@ -198,7 +260,14 @@ retry:
             if(tinfo->cancelled)
             {
                 //说明超时了
-                errno = tinfo->cancelled;
+                fiber_errno() = tinfo->cancelled;
+                return -1;
+            }
+
+            //close 叫醒的
+            if(ctx->isClose())
+            {
+                fiber_errno() = EBADF;
                 return -1;
             }
 
@@ -236,9 +305,10 @@ unsigned int sleep(unsigned int seconds)
     //过多少秒之后换回来，就是重新 schedule 这个 fiber
     // iom->addTimer(seconds * 1000, std::bind(&sylar::IOManager::schedule, iom, fiber));
     //上面的不支持 scheduler 是模板，先用lambda 处理一下
+    //回调只是把协程放回去，不会让出，直接在调度器主协程上跑
     iom->addTimer(seconds * 1000, [iom, fiber](){
         iom->schedule(fiber);
-    });
+    }, false, true);
 
     //换出去
     sylar::Fiber::YieldToHold();
@@ -263,7 +333,7 @@ int usleep(useconds_t usec)
     //上面的不支持 scheduler 是模板，先用lambda 处理一下
     iom->addTimer(usec / 1000, [iom, fiber](){
         iom->schedule(fiber);
-    });
+    }, false, true);
 
     //换出去
     sylar::Fiber::YieldToHold();
@@ -284,7 +354,7 @@ int nanosleep(const struct timespec *req, struct timespec *rem)
 
     iom->addTimer(timeout_ms, [iom, fiber](){
         iom->schedule(fiber);
-    });
+    }, false, true);
 
     //换出去
     sylar::Fiber::YieldToHold();
@@ -305,6 +375,12 @@ int socket(int domain, int type, int protocol)
     }
     //自动创建
     sylar::FdMgr::GetInstance()->get(fd, true);
+    //fd 号是新的，IOManager 里同号的旧状态（挂载、就绪缓存）清掉
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(iom)
+    {
+        iom->cancelAll(fd);
+    }
 
     return fd;
 }
@@ -326,7 +402,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
     if(!ctx || ctx->isClose())
     {
-        errno = EBADF; //bad fd
+        fiber_errno() = EBADF; //bad fd
         return -1;
     }
 
@@ -346,7 +422,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     int n = connect_f(fd, addr, addrlen);
     if(n == 0)
         return 0;
-    else if(n != -1 || errno != EINPROGRESS)
+    else if(n != -1 || fiber_errno() != EINPROGRESS)
     {
         return n;
     }
@@ -367,10 +443,11 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
             }
             t->cancelled = ETIMEDOUT;
             iom->cancelEvent(fd, sylar::IOManager::WRITE);
-        }, winfo);
+        }, winfo, false, true);
     }
 
-    int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
+    //连上了会来一次可写的边沿；已经来过了（返回 1）就不用等，直接去看结果
+    int rt = iom->waitEvent(fd, sylar::IOManager::WRITE);
     if(rt == 0)
     {
         sylar::Fiber::YieldToHold();
@@ -380,7 +457,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         }
         if(tinfo->cancelled)
         {
-            errno = tinfo->cancelled;
+            fiber_errno() = tinfo->cancelled;
             return -1;
         }
     }
@@ -390,7 +467,10 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         {
             timer->cancel();
         }
-        SYLAR_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+        if(rt < 0)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "connect addEvent(" << fd << ", WRITE) error";
+        }
     }
 
     //下面是差异
@@ -408,7 +488,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     }
     else
     {
-        errno = error;
+        fiber_errno() = error;
         return -1;
     }
 }
@@ -423,10 +503,17 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
     //accept 用的是 read 事件
-    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    URING_OP(op, IORING_OP_ACCEPT, addr, 0, (uint64_t)addrlen, 0);
+    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, op, addr, addrlen);
     if(fd >= 0)
     {
         sylar::FdMgr::GetInstance()->get(fd, true);//初始化
+        //跟 socket 一样，同号的旧状态清掉
+        sylar::IOManager* iom = sylar::IOManager::GetThis();
+        if(iom)
+        {
+            iom->cancelAll(fd);
+        }
     }
 
     return fd;
@@ -436,53 +523,98 @@ int accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 ssize_t read(int fd, void *buf, size_t count)
 {
     //不像 accept ，因为 accept 会获得新的fd，还需要去初始化一下，这个就完全不用
-    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+    //只有 socket 才会走到 io_uring，socket 上 read 就是 recv
+    URING_OP(op, IORING_OP_RECV, buf, (uint32_t)count, 0, 0);
+    return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, op, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
 {
-    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    URING_OP(op, IORING_OP_RECVMSG, &msg, 1, 0, 0);
+    return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, op, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags)
 {
-    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    URING_OP(op, IORING_OP_RECV, buf, (uint32_t)len, 0, (uint32_t)flags);
+    return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, op, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
 {
-    return do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    //io_uring 没有 recvfrom，拼成 recvmsg，回来再把地址长度写回去
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_name = src_addr;
+    socklen_t namelen = src_addr && addrlen ? *addrlen : 0;
+    msg.msg_namelen = namelen;
+    URING_OP(op, IORING_OP_RECVMSG, &msg, 1, 0, (uint32_t)flags);
+    ssize_t n = do_io(sockfd, recvfrom_f, "recvfrom", sylar::IOManager::READ, SO_RCVTIMEO, op, buf, len, flags, src_addr, addrlen);
+    //走 epoll 的话 recvfrom 自己写过了，msg 没动
+    if(n >= 0 && addrlen && msg.msg_namelen != namelen)
+    {
+        *addrlen = msg.msg_namelen;
+    }
+    return n;
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
-    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
+    URING_OP(op, IORING_OP_RECVMSG, msg, 1, 0, (uint32_t)flags);
+    return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, op, msg, flags);
 }
 
 //write
 ssize_t write(int fd, const void *buf, size_t count)
 {
-    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    URING_OP(op, IORING_OP_SEND, buf, (uint32_t)count, 0, 0);
+    return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, op, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
 {
-    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    URING_OP(op, IORING_OP_SENDMSG, &msg, 1, 0, 0);
+    return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, op, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags)
 {
-    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+    URING_OP(op, IORING_OP_SEND, msg, (uint32_t)len, 0, (uint32_t)flags);
+    return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, op, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
 {
-    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+    struct iovec iov;
+    iov.iov_base = (void*)msg;
+    iov.iov_len = len;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_name = (void*)to;
+    mh.msg_namelen = tolen;
+    URING_OP(op, IORING_OP_SENDMSG, &mh, 1, 0, (uint32_t)flags);
+    return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, op, msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags)
 {
-    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    URING_OP(op, IORING_OP_SENDMSG, msg, 1, 0, (uint32_t)flags);
+    return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, op, msg, flags);
 }
 
 int close(int fd)
@@ -495,6 +627,8 @@ int close(int fd)
     sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
     if(ctx)
     {
+        //先标记再叫醒：叫醒的协程可能马上在别的线程上重试，这时候 fd 还没真的关，不拦住的话又挂回 epoll 上，关掉之后就再也醒不过来了
+        ctx->close();
         auto iom = sylar::IOManager::GetThis();
         if(iom)
         {
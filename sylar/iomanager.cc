@@ -1,18 +1,58 @@
 #include "iomanager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
+#include "uring.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <algorithm>
 
 namespace sylar
 {
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+//没活了先别急着睡：空转最多这么多微秒，看 epoll 跟队列，来了活直接接着跑，省掉写 pipe、epoll 唤醒那一套
+//实际转多久看最近几次等了多久，经常要等很久的话就不转了。0 不转
+static ConfigVar<uint32_t>::ptr g_iomanager_spin_us =
+    Config::Lookup<uint32_t>("iomanager.spin_us", 100, "max microseconds an idle worker spins before epoll_wait blocks");
+
+//最多几个线程同时空转，0 是自动：可用的 cpu 数的一半，只有一个 cpu 的时候不转（转着也等不来活）
+static ConfigVar<uint32_t>::ptr g_iomanager_max_spinners =
+    Config::Lookup<uint32_t>("iomanager.max_spinners", 0, "max idle workers spinning at once, 0 for half the cpus");
+
+//每个工作线程一个自己的 epoll，fd 定在注册它的线程上，事件不会跑到别的线程去，也不会一个事件叫醒一群
+//代价是那个线程忙的时候，它的 fd 来了事件别的线程帮不上（任务还是能偷），热的分片用 migrateFd 挪
+static ConfigVar<bool>::ptr g_iomanager_sharded =
+    Config::Lookup<bool>("iomanager.sharded", false, "one epoll per worker, fds pinned to the worker that registered them");
+
+//epoll 或者 uring。uring 是 hook 的 socket IO 直接交给 io_uring 做，内核不支持的话还是退回 epoll
+static ConfigVar<std::string>::ptr g_iomanager_backend =
+    Config::Lookup<std::string>("iomanager.backend", "epoll", "io backend: epoll or uring (falls back to epoll)");
+
+//每个工作线程的环有多大
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_entries =
+    Config::Lookup<uint32_t>("iomanager.uring_entries", 256, "io_uring submission queue entries per worker");
+
+//攒够这么多个请求就提交，不然等本线程这一轮的活跑完（或者攒了这么多轮）再一起交
+static ConfigVar<uint32_t>::ptr g_iomanager_uring_batch =
+    Config::Lookup<uint32_t>("iomanager.uring_batch", 16, "io_uring submissions batched before io_uring_enter");
+
+static inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event)
 {
     switch(event)
@@ -31,6 +71,7 @@ void IOManager::FdContext::resetContext(EventContext& ctx)
     ctx.scheduler = nullptr;
     ctx.fiber.reset();
     ctx.cb = nullptr;
+    ctx.prio = Scheduler::NORMAL;
 }
 
 void IOManager::FdContext::triggerEvent(IOManager::Event event)
@@ -43,11 +84,11 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event)
     if(ctx.cb)
     {
         //里面会 swap 掉， cb 就会是空。智能指针的指针
-        ctx.scheduler->schedule(&ctx.cb);
+        ctx.scheduler->schedule(&ctx.cb, -1, ctx.prio);
     }
     else
     {
-        ctx.scheduler->schedule(&ctx.fiber);
+        ctx.scheduler->schedule(&ctx.fiber, -1, ctx.prio);
     }
 
     //用完了
@@ -58,12 +99,20 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event)
 IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     :Scheduler(threads, use_caller, name)
 {
+    m_maxSpinUs = g_iomanager_spin_us->getValue();
+    m_maxSpinners = g_iomanager_max_spinners->getValue();
+    if(!m_maxSpinners)
+    {
+        m_maxSpinners = GetAllowedCpus().size() / 2;
+    }
+    m_sharded = g_iomanager_sharded->getValue();
     m_epfd = epoll_create(5000); //linux 2.8 以后被忽略了
     SYLAR_ASSERT(m_epfd > 0);
 
-    //使用管道
-    int rt = pipe(m_tickleFds);
-    SYLAR_ASSERT(!rt);
+    //以前是一根 pipe，写一次随便叫醒一个等 epoll 的，写满了还会断言
+    //现在是 eventfd，计数只会加不会满；poller 用公共的这个，别的线程各用各的
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    SYLAR_ASSERT(m_wakeFd >= 0);
 
     //epoll 的事件结构体
     epoll_event event;
@@ -71,20 +120,47 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     memset(&event, 0, sizeof(epoll_event));
     //边缘触发儿
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0]; // 0 就是读的？还是i写的来着。。
-
-    //修改句柄的属性，设置成不阻塞
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    SYLAR_ASSERT(!rt);
+    event.data.fd = m_wakeFd;
 
     //往句柄里面加事件
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
+    int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_wakeFd, &event);
     SYLAR_ASSERT(!rt);
 
-    //默认给64个大小
-    // m_fdContexts.resize(64);
+    //工作线程在 Scheduler 的构造里已经定好了，下标跟 m_threadIds 对齐
+    for(size_t i = 0; i < getWorkerCount(); ++i)
+    {
+        Waker* waker = new Waker;
+        waker->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(waker->fd >= 0);
+        if(m_sharded)
+        {
+            //叫它就是写它 epoll 里的这个 eventfd
+            waker->epfd = epoll_create1(EPOLL_CLOEXEC);
+            SYLAR_ASSERT(waker->epfd >= 0);
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = waker->fd;
+            rt = epoll_ctl(waker->epfd, EPOLL_CTL_ADD, waker->fd, &event);
+            SYLAR_ASSERT(!rt);
+        }
+        m_wakers.push_back(waker);
+    }
 
-    contextResize(32);
+    if(g_iomanager_backend->getValue() == "uring")
+    {
+        m_uring = initUring();
+    }
+    else if(g_iomanager_backend->getValue() != "epoll")
+    {
+        SYLAR_LOG_WARN(g_logger) << "unknown iomanager.backend=" << g_iomanager_backend->getValue()
+            << ", use epoll";
+    }
+
+    //第一块先分配好，一般的程序 fd 都在这里面
+    for(size_t i = 0; i < FD_CHUNK_COUNT; ++i)
+    {
+        m_fdChunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+    allocFdChunk(0);
 
     //scheduler 创建好了，就默认启动
     start();
@@ -95,89 +171,275 @@ IOManager::~IOManager()
     stop();
     close(m_epfd);
 
-    //两个句柄也
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    close(m_wakeFd);
+    for(auto i : m_wakers)
+    {
+        close(i->fd);
+        if(i->epfd >= 0)
+        {
+            close(i->epfd);
+        }
+#if SYLAR_HAVE_URING
+        delete i->ring;
+#endif
+        delete i;
+    }
+
+    for(size_t i = 0; i < FD_CHUNK_COUNT; ++i)
+    {
+        //如果已经分配出去了的
+        delete[] m_fdChunks[i].load(std::memory_order_relaxed);
+    }
+}
+
+//以前是一整个 vector，扩容要拿写锁把所有做 IO 的线程都挡住，查一次也要拿读锁
+//现在按块分配，块分配了就不动，查就是两次下标
+IOManager::FdContext* IOManager::allocFdChunk(size_t idx)
+{
+    //绑了 NUMA 节点的话，不管是哪个线程来分配，新的 FdContext 都放到那个节点上
+    int node = getMemoryNode();
+    int old_node = node >= 0 ? GetThreadMemoryNode() : -1;
+    bool switch_node = node >= 0 && node != old_node;
+    if(switch_node)
+    {
+        SetThreadMemoryNode(node);
+    }
 
-    for(size_t i = 0; i < m_fdContexts.size(); ++i)
+    FdContext* chunk = new FdContext[FD_CHUNK_SIZE];
+    for(size_t i = 0; i < FD_CHUNK_SIZE; ++i)
     {
-        if(m_fdContexts[i])
+        chunk[i].fd = idx * FD_CHUNK_SIZE + i;
+    }
+
+    if(switch_node)
+    {
+        SetThreadMemoryNode(old_node);
+    }
+
+    FdContext* expected = nullptr;
+    if(!m_fdChunks[idx].compare_exchange_strong(expected, chunk
+                , std::memory_order_acq_rel, std::memory_order_acquire))
+    {
+        //别人先装上了
+        delete[] chunk;
+        return expected;
+    }
+    return chunk;
+}
+
+IOManager::FdContext* IOManager::getFdContext(int fd, bool auto_create)
+{
+    if(fd < 0 || (size_t)fd >= FD_CHUNK_SIZE * FD_CHUNK_COUNT)
+    {
+        return nullptr;
+    }
+    size_t idx = fd / FD_CHUNK_SIZE;
+    FdContext* chunk = m_fdChunks[idx].load(std::memory_order_acquire);
+    if(!chunk)
+    {
+        if(!auto_create)
         {
-            //如果已经分配出去了的
-            delete m_fdContexts[i];
+            return nullptr;
         }
+        chunk = allocFdChunk(idx);
     }
+    return &chunk[fd % FD_CHUNK_SIZE];
 }
 
-//下面这个方法完全是为了 addEvent 的锁优化
-//因为不这么做的话，addEvent 必须加写锁（因为fd可能会被创建两次）
-//所以不如一开始就创建妥当，后面你的增减事件就都是直接使用了
-//读锁就可以
-void IOManager::contextResize(size_t size)
+int IOManager::epollOf(FdContext* fd_ctx) const
 {
-    m_fdContexts.resize(size);
+    if(m_sharded && fd_ctx->shard >= 0)
+    {
+        return m_wakers[fd_ctx->shard]->epfd;
+    }
+    return m_epfd;
+}
 
-    for(size_t i = 0; i < m_fdContexts.size(); ++i)
+void IOManager::pinFd(FdContext* fd_ctx)
+{
+    if(!m_sharded || fd_ctx->shard >= 0)
     {
-        if(!m_fdContexts[i])
+        return;
+    }
+    int n = m_wakers.size();
+    int worker = getWorkerIndex();
+    int shard = -1;
+    std::shared_ptr<ShardPicker> picker = std::atomic_load(&m_shardPicker);
+    if(picker && *picker)
+    {
+        shard = (*picker)(fd_ctx->fd, worker);
+    }
+    if(shard < 0 || shard >= n)
+    {
+        //工作线程注册的就定在自己身上，之后也是自己等、自己处理，缓存是热的
+        shard = worker >= 0 ? worker
+            : (int)(m_shardCursor.fetch_add(1, std::memory_order_relaxed) % n);
+    }
+    fd_ctx->shard = shard;
+    m_wakers[shard]->fds.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IOManager::unpinFd(FdContext* fd_ctx)
+{
+    if(fd_ctx->shard < 0)
+    {
+        return;
+    }
+    m_wakers[fd_ctx->shard]->fds.fetch_sub(1, std::memory_order_relaxed);
+    fd_ctx->shard = -1;
+}
+
+std::vector<IOManager::ShardStats> IOManager::getShardStats()
+{
+    std::vector<ShardStats> stats;
+    if(!m_sharded)
+    {
+        return stats;
+    }
+    for(size_t i = 0; i < m_wakers.size(); ++i)
+    {
+        ShardStats s;
+        s.index = i;
+        s.fds = m_wakers[i]->fds.load(std::memory_order_relaxed);
+        s.events = m_wakers[i]->events.load(std::memory_order_relaxed);
+        s.parked = m_wakers[i]->parked.load(std::memory_order_relaxed);
+        stats.push_back(s);
+    }
+    return stats;
+}
+
+void IOManager::setShardPicker(ShardPicker picker)
+{
+    std::atomic_store(&m_shardPicker, std::make_shared<ShardPicker>(std::move(picker)));
+}
+
+bool IOManager::migrateFd(int fd, size_t shard)
+{
+    if(!m_sharded || shard >= m_wakers.size())
+    {
+        return false;
+    }
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx)
+    {
+        return false;
+    }
+
+    FdContext::MutexType::Lock lock(fd_ctx->mutex);
+    if(fd_ctx->shard < 0)
+    {
+        return false;
+    }
+    if(fd_ctx->shard == (int)shard)
+    {
+        return true;
+    }
+    if(fd_ctx->registered)
+    {
+        //先挂到新的上再从旧的摘掉。旧的那边要是已经拿到了事件，派发的时候拿着锁看 events，没人等的只会记成就绪
+        epoll_event epevent;
+        epevent.events = EPOLLET | fd_ctx->registered;
+        epevent.data.ptr = fd_ctx;
+        int new_epfd = m_wakers[shard]->epfd;
+        int rt = epoll_ctl(new_epfd, EPOLL_CTL_ADD, fd, &epevent);
+        if(rt)
         {
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << new_epfd << ", "
+                << EPOLL_CTL_ADD << "," << fd << "," << epevent.events << "):"
+                << rt << " (" << errno << ") (" << strerror(errno) << ")";
+            return false;
         }
+        //已经就绪的 fd 挂上去，睡在新 epoll 上的会被叫醒，不用另外叫
+        epoll_ctl(epollOf(fd_ctx), EPOLL_CTL_DEL, fd, &epevent);
     }
+    unpinFd(fd_ctx);
+    fd_ctx->shard = shard;
+    m_wakers[shard]->fds.fetch_add(1, std::memory_order_relaxed);
+    return true;
 }
 
 //往epoll里面增加事件
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
 {
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
+    return registerEvent(fd, event, std::move(cb), true);
+}
+
+int IOManager::waitEvent(int fd, Event event)
+{
+    return registerEvent(fd, event, nullptr, false);
+}
 
-    //看看 fd 是不是超出了允许的范围（所以需要读锁）
-    if((int)m_fdContexts.size() > fd)
+int IOManager::armFd(FdContext* fd_ctx, Event event)
+{
+    pinFd(fd_ctx);
+    int epfd = epollOf(fd_ctx);
+    int op = fd_ctx->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    Event registered = (Event)(fd_ctx->registered | event);
+    epoll_event epevent;
+    //我们用的是 ET 模式，Event 的值就是 EPOLLIN、EPOLLOUT
+    epevent.events = EPOLLET | registered;
+    epevent.data.ptr = fd_ctx; //回调的时候，就能拿到是在哪个 fd_ctx 上触发的
+    int rt = epoll_ctl(epfd, op, fd_ctx->fd, &epevent);
+    if(rt && (errno == EEXIST || errno == ENOENT))
     {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
+        //记的跟内核里的对不上：cancelAll 之后 fd 没关、同号的旧 fd 没经过 hook 的 close，换一个再来
+        op = op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        rt = epoll_ctl(epfd, op, fd_ctx->fd, &epevent);
     }
-    else
+    if(rt)
+    {
+        //errno 是系统错误
+        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
+            << op << "," << fd_ctx->fd << "," << epevent.events << "):"
+            << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        return -1;
+    }
+    fd_ctx->registered = registered;
+    return 0;
+}
+
+int IOManager::registerEvent(int fd, Event event, std::function<void()> cb, bool rearm)
+{
+    //排空已经放弃等事件了，再挂上去就没人叫醒了。hook 的 IO 重试到这里会直接失败返回
+    if(m_drainExpired)
+    {
+        errno = ECANCELED;
+        return -1;
+    }
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if(!fd_ctx)
     {
-        //写锁，增加，动态扩容
-        lock.unlock();
-        RWMutexType::WriteLock lock(m_mutex);
-        //std 是x2的，为什么用fd不是本身的fd的size，是因为
-        contextResize(fd * 1.5);
-        fd_ctx = m_fdContexts[fd];
+        SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+        errno = EBADF;
+        return -1;
     }
 
     //因为要修改它，也要加锁
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(fd_ctx->events && event)
+    if(fd_ctx->events & event)
     {
         SYLAR_LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
                         << " event=" << event
                         << " fd_ctx.event=" << fd_ctx->events;
 
         //如果要加的 event 已经有了，那说明是有问题。意味着至少两个线程同时对一个ctx进行了操作。危险
-        //如果位操作 & 不为0，说明是同类事件
         SYLAR_ASSERT(!(fd_ctx->events & event));
     }
 
-    //如果已经有原来的事件，那就是 mod，否则就是 add
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    //我们用的是 ET 模式，位操作加上新的 event
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx; //回调的时候，就能拿到是在哪个 fd_ctx 上触发的
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt)
+    //没人等的时候来过边沿了。hook 那边是刚读到 EAGAIN 才来的，之后的边沿是新的，直接重试，不挂起也不用别人来叫
+    //addEvent 不知道这个边沿被读掉了没有，不信缓存，MOD 一次让内核按现在的状态再报
+    bool ready = fd_ctx->ready & event;
+    fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+    if(ready && !rearm)
     {
-        //errno 是系统错误
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-
-        return -1;
+        return 1;
+    }
+    if(!(fd_ctx->registered & event) || rearm)
+    {
+        if(armFd(fd_ctx, event))
+        {
+            return -1;
+        }
     }
 
     ++m_pendingEventCount;
@@ -192,6 +454,7 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
     SYLAR_ASSERT(!event_ctx.cb);
 
     event_ctx.scheduler = Scheduler::GetThis();
+    event_ctx.prio = Scheduler::GetCurrentPriority();
     if(cb)
     {
         event_ctx.cb.swap(cb);
@@ -204,27 +467,23 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
         SYLAR_ASSERT(event_ctx.fiber->getState() == Fiber::EXEC);
     }
 
+    //分片模式下分片的主人自己会等，用不着别人接班
+    if(!m_sharded)
+    {
+        ensurePoller();
+    }
     return 0;
 }
 
 bool IOManager::delEvent(int fd, Event event)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd)
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx)
     {
         //没有这个句柄
         return false;
     }
 
-    // 默认初始化，所以肯定有
-    // if(!m_fdContexts[fd])
-    // {
-        
-    // }
-
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     if(!(fd_ctx->events & event))
     {
@@ -232,27 +491,9 @@ bool IOManager::delEvent(int fd, Event event)
         return false;
     }
 
-    //类似add，反操作
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt)
-    {
-        //errno 是系统错误
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-
-        return false;
-    }
-
+    //fd 还挂在 epoll 上，只是没人等了，事件来了记成就绪
     --m_pendingEventCount;
-    fd_ctx->events = new_events;
+    fd_ctx->events = (Event)(fd_ctx->events & ~event);
     FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
     fd_ctx->resetContext(event_ctx);
 
@@ -262,22 +503,13 @@ bool IOManager::delEvent(int fd, Event event)
 //跟删除差不多。区别是 cancel 找到了对应的对象，把它强制触发执行。
 bool IOManager::cancelEvent(int fd, Event event)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd)
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx)
     {
         //没有这个句柄
         return false;
     }
 
-    // 默认初始化，所以肯定有
-    // if(!m_fdContexts[fd])
-    // {
-        
-    // }
-
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
-
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
     if(!(fd_ctx->events & event))
     {
@@ -285,25 +517,6 @@ bool IOManager::cancelEvent(int fd, Event event)
         return false;
     }
 
-    //类似add，反操作
-    Event new_events = (Event)(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt)
-    {
-        //errno 是系统错误
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << "," << fd << "," << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-
-        return false;
-    }
-
     //区别在此
     fd_ctx->triggerEvent(event);
     --m_pendingEventCount;
@@ -313,44 +526,44 @@ bool IOManager::cancelEvent(int fd, Event event)
 
 bool IOManager::cancelAll(int fd)
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd)
+    FdContext* fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx)
     {
         //没有这个句柄
         return false;
     }
 
-    // 默认初始化，所以肯定有
-    // if(!m_fdContexts[fd])
-    // {
-        
-    // }
-
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
+    //交给内核还在做的也撤掉，等着的协程会带着 -ECANCELED 回来
+    bool cancelled = cancelUring(fd_ctx);
 
     FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(!fd_ctx->events)
+    //挂过的都要摘：内核只在文件最后一个引用没了的时候自己摘，dup、fork 出去的还拿着的话旧的挂载还在，
+    //data.ptr 是这个 fd 号的 FdContext，号复用之后旧文件的边沿会报到新连接头上。一个连接也就多这一次 epoll_ctl
+    //分片模式下更要摘，下次有人等的时候可能定到别的分片上，旧的那个 epoll 还挂着的话两边都会报
+    if(fd_ctx->registered != NONE)
     {
-        //没有事件
-        return false;
+        epoll_event epevent;
+        epevent.events = 0;
+        epevent.data.ptr = fd_ctx;
+        int epfd = epollOf(fd_ctx);
+        int rt = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &epevent);
+        //已经关掉了的（没经过 hook 的 close）摘不到，不要紧
+        if(rt && errno != ENOENT && errno != EBADF)
+        {
+            //errno 是系统错误
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
+                << EPOLL_CTL_DEL << ", " << fd << ", " << epevent.events << "):"
+                << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        }
     }
-
-    int op = EPOLL_CTL_DEL;
-
-    epoll_event epevent;
-    epevent.events = 0;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt)
+    //close 也走这里，分片要放掉，不然 fd 号复用了还会定在原来的分片上
+    unpinFd(fd_ctx);
+    fd_ctx->registered = NONE;
+    fd_ctx->ready = NONE;
+    if(!fd_ctx->events)
     {
-        //errno 是系统错误
-        SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-            << op << ", " << fd << ", " << epevent.events << "):"
-            << rt << " (" << errno << ") (" << strerror(errno) << ")";
-
-        return false;
+        //没有事件
+        return cancelled;
     }
 
     if(fd_ctx->events & READ)
@@ -374,6 +587,235 @@ bool IOManager::cancelAll(int fd)
     return true;
 }
 
+//io_uring 后端。epoll 那套一次没数据的读是：读一次 EAGAIN、epoll_ctl 挂上、epoll_wait 醒来、epoll_ctl 摘掉、再读一次
+//这里是填一个 SQE，这一轮调度的攒在一起一次 io_uring_enter，做完了从 CQ 里拿结果。环的 fd 挂在 epoll 上，有做完的就会叫醒等 epoll 的来收
+bool IOManager::initUring()
+{
+#if SYLAR_HAVE_URING
+    m_uringBatch = std::max(1u, g_iomanager_uring_batch->getValue());
+    for(size_t i = 0; i < m_wakers.size(); ++i)
+    {
+        Waker* waker = m_wakers[i];
+        waker->ring = new Uring;
+        bool ok = waker->ring->init(g_iomanager_uring_entries->getValue());
+        if(ok)
+        {
+            epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLET;
+            //Waker 的地址最低位是 0，或上 1 跟 FdContext 区分开
+            event.data.u64 = (uint64_t)waker | 1;
+            int epfd = m_sharded ? waker->epfd : m_epfd;
+            ok = !epoll_ctl(epfd, EPOLL_CTL_ADD, waker->ring->getFd(), &event);
+        }
+        if(!ok)
+        {
+            SYLAR_LOG_WARN(g_logger) << "io_uring init failed, errno=" << errno
+                << " (" << strerror(errno) << "), use epoll";
+            for(auto w : m_wakers)
+            {
+                delete w->ring;
+                w->ring = nullptr;
+            }
+            return false;
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "iomanager " << getName() << " use io_uring, rings=" << m_wakers.size();
+    return true;
+#else
+    SYLAR_LOG_WARN(g_logger) << "built without io_uring, use epoll";
+    return false;
+#endif
+}
+
+int IOManager::uringIo(int fd, uint8_t opcode, const void* addr, uint32_t len
+        , uint64_t off, uint32_t op_flags, uint64_t timeout_ms)
+{
+#if SYLAR_HAVE_URING
+    int index = m_uring ? getWorkerIndex() : -1;
+    if(index < 0)
+    {
+        return -ENOSYS;
+    }
+    //排空放弃了，跟 addEvent 一样直接失败
+    if(m_drainExpired)
+    {
+        return -ECANCELED;
+    }
+    FdContext* fd_ctx = getFdContext(fd, true);
+    if(!fd_ctx)
+    {
+        return -EBADF;
+    }
+    Uring* ring = m_wakers[index]->ring;
+    bool timed = timeout_ms != ~0ull;
+    //带超时的要两个 SQE 挨着放
+    unsigned need = timed ? 2 : 1;
+    if(ring->space() < need)
+    {
+        pumpUring(m_wakers[index]);
+        if(ring->space() < need)
+        {
+            return -ENOSYS;
+        }
+    }
+
+    UringWait wait;
+    wait.fiber = Fiber::GetThis();
+    SYLAR_ASSERT(wait.fiber->getState() == Fiber::EXEC);
+    wait.scheduler = this;
+    wait.prio = Scheduler::GetCurrentPriority();
+    wait.fd_ctx = fd_ctx;
+
+    io_uring_sqe* sqe = ring->getSqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->msg_flags = op_flags;
+    sqe->user_data = (uint64_t)&wait;
+    //超时是挂在它后面的 LINK_TIMEOUT，到点了它会带着 -ECANCELED 回来
+    //timespec 是交的时候内核才读，交的时候协程已经挂起了，栈还在
+    __kernel_timespec ts;
+    if(timed)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = timeout_ms % 1000 * 1000000;
+        io_uring_sqe* tsqe = ring->getSqe();
+        tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+        tsqe->fd = -1;
+        tsqe->addr = (uint64_t)&ts;
+        tsqe->len = 1;
+        tsqe->user_data = 0;
+    }
+    ++fd_ctx->uringOps;
+    ++m_pendingEventCount;
+    uint64_t start = timed ? GetCurrentMS() : 0;
+
+    //不在这里交：这一轮调度完了 flushPending 一起交
+    Fiber::YieldToHold();
+
+    if(timed && wait.res == -ECANCELED && GetCurrentMS() - start >= timeout_ms)
+    {
+        return -ETIMEDOUT;
+    }
+    //剩下撤掉的只有 close（cancelAll）跟排空放弃，close 的算 EBADF，跟 epoll 那边醒来再读一样
+    //不能等醒来再看 FdMgr：close 那边 cancelAll 完了才 del，这时候还不一定删掉
+    if(wait.res == -ECANCELED && !m_drainExpired)
+    {
+        return -EBADF;
+    }
+    return wait.res;
+#else
+    return -ENOSYS;
+#endif
+}
+
+void IOManager::flushPending()
+{
+    if(!m_uring)
+    {
+        return;
+    }
+    int index = getWorkerIndex();
+    if(index < 0)
+    {
+        return;
+    }
+#if SYLAR_HAVE_URING
+    Waker* self = m_wakers[index];
+    unsigned queued = self->ring->queued();
+    if(!queued)
+    {
+        return;
+    }
+    //攒够一批、攒着的已经等了好几轮、或者本线程手上没别的活了（这一轮完了），就交
+    if(queued >= m_uringBatch || ++self->ringAge >= m_uringBatch || !hasLocalTasks())
+    {
+        pumpUring(self);
+    }
+#endif
+}
+
+size_t IOManager::pumpUring(Waker* waker)
+{
+#if SYLAR_HAVE_URING
+    if(waker->ring->queued())
+    {
+        int rt = waker->ring->submit();
+        waker->ringAge = 0;
+        if(rt < 0 && rt != -EAGAIN && rt != -EBUSY && rt != -EINTR)
+        {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_enter(" << waker->ring->getFd() << "):"
+                << rt << " (" << strerror(-rt) << ")";
+        }
+    }
+    //交的时候就做完了的（数据本来就在）马上收掉，不用等 epoll 叫人来收
+    return reapUring(waker);
+#else
+    return 0;
+#endif
+}
+
+size_t IOManager::reapUring(Waker* waker)
+{
+    size_t n = 0;
+#if SYLAR_HAVE_URING
+    //正在收的人收完放手之后会再看一眼这个标记，我们挂上的这次它一定会补收
+    waker->reapAgain.store(true);
+    while(waker->reapAgain.load() && !waker->reaping.exchange(true))
+    {
+        waker->reapAgain.store(false);
+        n += waker->ring->reap([this](uint64_t data, int res){
+            UringWait* wait = (UringWait*)data;
+            if(!wait)
+            {
+                //超时、取消自己的结果，不用管
+                return;
+            }
+            wait->res = res;
+            --wait->fd_ctx->uringOps;
+            Scheduler* scheduler = wait->scheduler;
+            Scheduler::Priority prio = wait->prio;
+            Fiber::ptr fiber;
+            fiber.swap(wait->fiber);
+            --m_pendingEventCount;
+            //放回去之后协程随时会跑起来，wait 在它栈上，之后就不能再碰了
+            scheduler->schedule(&fiber, -1, prio);
+        });
+        waker->reaping.store(false);
+    }
+#endif
+    return n;
+}
+
+bool IOManager::cancelUring(FdContext* fd_ctx)
+{
+#if SYLAR_HAVE_URING
+    if(!m_uring || fd_ctx->uringOps.load() == 0)
+    {
+        return false;
+    }
+    //本线程攒着还没交的先交掉，还在 SQ 里的撤不到
+    //别的线程攒着没交的撤不到，交上去会在关掉的 fd 上失败回来，跟 epoll 那边 close 之后再挂事件一样
+    int index = getWorkerIndex();
+    if(index >= 0)
+    {
+        pumpUring(m_wakers[index]);
+    }
+    //不知道是哪个线程交的，每个环都撤一遍，close 的时候才有
+    for(auto w : m_wakers)
+    {
+        w->ring->cancelFd(fd_ctx->fd);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 IOManager* IOManager::GetThis()
 {
     //继承自 Scheduler，所以转换一下就完成了
@@ -383,14 +825,216 @@ IOManager* IOManager::GetThis()
 //三个继承来的，很重要的接口
 void IOManager::tickle()
 {
-    //pipe 的另一端，0，已经放到 epoll wait 里面去了
-    if(hasIdleThreads())
+    if(!hasIdleThreads())
     {
         //没有空闲的线程，发了也没用。已经在while里面执行中
         return;
     }
-    int rt = write(m_tickleFds[1], "T", 1);
-    SYLAR_ASSERT(rt == 1); // 1 是实际写入的长度
+    //有人在空转，减掉一个就算交给它了，它停下来的时候发现减不动就知道不能去睡
+    size_t spinning = m_spinningCount.load();
+    while(spinning)
+    {
+        if(m_spinningCount.compare_exchange_weak(spinning, spinning - 1))
+        {
+            return;
+        }
+    }
+    //先叫睡着的，等 epoll 的那个接着等 IO；没人睡着再叫它
+    if(wakeParked())
+    {
+        return;
+    }
+    wakePoller();
+}
+
+void IOManager::wakePoller()
+{
+    if(m_sharded)
+    {
+        int poller = m_poller.load();
+        if(poller >= 0)
+        {
+            wakeWorker(poller);
+        }
+        else
+        {
+            wakeParked();
+        }
+        return;
+    }
+    //它醒来是先读空再清标记，所以标记还在的时候写的那次它一定会看到
+    if(m_wakePending.exchange(true))
+    {
+        recordTickleSaved();
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write(m_wakeFd, &one, sizeof(one));
+    SYLAR_ASSERT(rt == sizeof(one));
+    recordTickle();
+}
+
+void IOManager::wakeWorker(size_t index)
+{
+    Waker* waker = m_wakers[index];
+    if(waker->pending.exchange(true))
+    {
+        recordTickleSaved();
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write(waker->fd, &one, sizeof(one));
+    SYLAR_ASSERT(rt == sizeof(one));
+    recordTickle();
+}
+
+bool IOManager::wakeParked()
+{
+    size_t n = m_wakers.size();
+    size_t start = m_wakeCursor.fetch_add(1, std::memory_order_relaxed);
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t index = (start + i) % n;
+        Waker* waker = m_wakers[index];
+        //已经有人叫过它了就找下一个，一次叫一个人
+        if(waker->parked.load() && !waker->pending.exchange(true))
+        {
+            uint64_t one = 1;
+            int rt = write(waker->fd, &one, sizeof(one));
+            SYLAR_ASSERT(rt == sizeof(one));
+            recordTickle();
+            return true;
+        }
+    }
+    return false;
+}
+
+void IOManager::ensurePoller()
+{
+    //没人等 epoll、也没人在空转（空转也会看 epoll）的话，叫一个睡着的起来等
+    //这边是先加事件再看 poller，poller 是先放掉名分再看有没有事件，两边总有一边能看到对方
+    if(m_poller.load() == -1 && m_spinningCount.load() == 0)
+    {
+        wakeParked();
+    }
+}
+
+void IOManager::tickleWorker(size_t index)
+{
+    //它在等 epoll 就写公共的，不然写它自己的。它正好在两边换的话
+    //换过去之后会先看一眼队列（信箱）再睡，任务是先放进去再来叫的，漏不掉
+    if(m_poller.load() == (int)index)
+    {
+        wakePoller();
+    }
+    else
+    {
+        wakeWorker(index);
+    }
+}
+
+int IOManager::park(size_t index)
+{
+    static const int MAX_TIMEOUT = 5000;
+    Waker* waker = m_wakers[index];
+    //先挂标记再看：有活、或者已经没人等 epoll 了（要去接班），都别睡
+    //tickle 是先放任务再看标记，poller 是先放掉名分再看标记，两边总有一边能看到对方
+    waker->parked.store(true);
+    int rt = 0;
+    if(hasPendingTasks())
+    {
+        rt = -1;
+    }
+    else if(m_poller.load() != -1)
+    {
+        pollfd pfd;
+        pfd.fd = waker->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, (int)clampCallerDrain(MAX_TIMEOUT));
+    }
+    waker->parked.store(false);
+
+    //先读空再清标记，清掉之后再来的叫醒都会真的写
+    if(waker->pending.load())
+    {
+        uint64_t dummy;
+        while(read(waker->fd, &dummy, sizeof(dummy)) == sizeof(dummy));
+        waker->pending.store(false);
+    }
+    if(rt == 0 && hasPendingTasks())
+    {
+        rt = -1;
+    }
+    return rt;
+}
+
+int IOManager::spinWait(int epfd, epoll_event* events, uint64_t budget_us)
+{
+    //转的人太多了就别转了，cpu 都让它们占了
+    if(m_spinningCount.fetch_add(1) >= m_maxSpinners)
+    {
+        size_t spinning = m_spinningCount.load();
+        while(spinning)
+        {
+            if(m_spinningCount.compare_exchange_weak(spinning, spinning - 1))
+            {
+                return 0;
+            }
+        }
+        //刚加上就被 tickle 交了活
+        return -1;
+    }
+
+    uint64_t start = GetCurrentUS();
+    uint64_t now = start;
+    int rt = 0;
+    bool work = false;
+    do
+    {
+        rt = epoll_wait(epfd, events, 64, 0);
+        if(rt > 0)
+        {
+            break;
+        }
+        if(hasPendingTasks())
+        {
+            work = true;
+            break;
+        }
+        //epoll_wait 也是系统调用，不要转得太密
+        for(int i = 0; i < 32; ++i)
+        {
+            CpuRelax();
+        }
+        now = GetCurrentUS();
+    } while(now - start < budget_us);
+
+    //减不动说明 tickle 已经把它减掉了，活是交给我们的，省下了一次写 pipe，不能去睡
+    bool handed = true;
+    size_t spinning = m_spinningCount.load();
+    while(spinning)
+    {
+        if(m_spinningCount.compare_exchange_weak(spinning, spinning - 1))
+        {
+            handed = false;
+            break;
+        }
+    }
+
+    if(rt > 0)
+    {
+        recordSpin(now - start, true);
+        return rt;
+    }
+    //tickle 是先放任务再来减的，所以减完之后再看一眼，之前漏掉的也能看到
+    if(work || handed || hasPendingTasks())
+    {
+        recordSpin(now - start, true);
+        return -1;
+    }
+    recordSpin(now - start, false);
+    return 0;
 }
 
 bool IOManager::stopping(uint64_t& next_timeout)
@@ -402,6 +1046,56 @@ bool IOManager::stopping(uint64_t& next_timeout)
         && Scheduler::stopping();
 }
 
+bool IOManager::quiescent()
+{
+    return m_pendingEventCount == 0
+        && !hasTimer()
+        && Scheduler::quiescent();
+}
+
+void IOManager::abandonWork(DrainResult& result)
+{
+    m_drainExpired = true;
+
+    std::vector<int> fds;
+    for(size_t i = 0; i < FD_CHUNK_COUNT; ++i)
+    {
+        FdContext* chunk = m_fdChunks[i].load(std::memory_order_acquire);
+        if(!chunk)
+        {
+            continue;
+        }
+        for(size_t j = 0; j < FD_CHUNK_SIZE; ++j)
+        {
+            FdContext::MutexType::Lock lock(chunk[j].mutex);
+            if(chunk[j].events || chunk[j].uringOps.load())
+            {
+                fds.push_back(chunk[j].fd);
+            }
+        }
+    }
+    //cancelAll 会把等着的协程、回调都触发一次，hook 的 IO 醒过来重试，再 addEvent 就失败了
+    for(int fd : fds)
+    {
+        if(cancelAll(fd))
+        {
+            ++result.cancelled_fds;
+        }
+    }
+
+    std::vector<std::function<void()>> cbs;
+    std::vector<std::function<void()>> inline_cbs;
+    result.flushed_timers = flushTimers(cbs, inline_cbs);
+    if(!cbs.empty())
+    {
+        schedule(cbs.begin(), cbs.end());
+    }
+    if(!inline_cbs.empty())
+    {
+        scheduleInline(inline_cbs.begin(), inline_cbs.end());
+    }
+}
+
 bool IOManager::stopping()
 {
     //scheduler 本身不需要这个值
@@ -421,22 +1115,105 @@ void IOManager::idle()
         delete[] ptr;
     });
 
+    //最近几次从进 idle 到来活隔了多久（微秒，滑动平均）。一开始当作很密，先转着看
+    uint64_t gap_ewma = m_maxSpinUs;
+    uint64_t idle_start = GetCurrentUS();
+    //这一轮已经转过了，没转到活，接下来就该睡了
+    bool spun = false;
+    size_t index = getWorkerIndex();
+    //现在是不是轮到我等 epoll，等到了事件但是没活的话就接着等，名分不放
+    //分片模式下每个人都等自己的 epoll，poller 只是顺便替大家等最近的定时器，别的人不看定时器，省得到点一起醒
+    bool polling = false;
+    Waker* self = m_wakers[index];
+    int epfd = m_sharded ? self->epfd : m_epfd;
+
     while(true)
     {
         uint64_t next_timeout = 0;
         if(stopping(next_timeout)) 
         {
+            if(polling)
+            {
+                m_poller.store(-1);
+                polling = false;
+            }
             SYLAR_LOG_INFO(g_logger) << "name=" << getName()
                                      << " idle stopping exit";
+            //stop 的时候大家都在忙的话，tickle 是发不出去的（没人闲着）
+            //所以退出的时候顺手叫醒下一个还睡着的，一个接一个都能退出，不用干等超时
+            tickle();
             break;
         }
+        //caller 线程是 drain 切进来的，排空了或者到点了先回去。等 epoll 的名分放掉，回来再抢
+        if(callerDrainDone())
+        {
+            if(polling)
+            {
+                m_poller.store(-1);
+                polling = false;
+            }
+            Fiber::ptr cur = Fiber::GetThis();
+            auto raw_ptr = cur.get();
+            cur.reset();
+            raw_ptr->swapOut();
+            idle_start = GetCurrentUS();
+            continue;
+        }
 
         //实际的长度（事件数）
         int rt = 0;
-        do
+        //攒着的先交掉、已经做完的收掉，收到了就先回去跑
+        if(m_uring && pumpUring(self))
+        {
+            rt = -1;
+        }
+        //间隔一直比最长的空转时间还长的话，转了也白转
+        uint64_t budget = gap_ewma <= m_maxSpinUs ? std::min(m_maxSpinUs, gap_ewma * 2 + 1) : 0;
+        if(rt == 0 && !polling && !spun && budget && next_timeout && m_maxSpinners)
+        {
+            spun = true;
+            rt = spinWait(epfd, events, budget);
+            if(rt == 0)
+            {
+                //白转了，回到上面重新看一下定时器、要不要退出，然后睡下去
+                continue;
+            }
+        }
+        if(rt == 0 && !polling)
+        {
+            //没人等 epoll 就自己来等，有人等了就睡在自己的 eventfd 上，只有叫到自己才醒
+            int expected = -1;
+            polling = m_poller.compare_exchange_strong(expected, (int)index);
+            if(!polling && !m_sharded)
+            {
+                rt = park(index);
+                spun = false;
+                if(rt == 0)
+                {
+                    //没活，多半是 poller 走了叫我去接班，回去重新来
+                    continue;
+                }
+            }
+            //刚当上 poller，先看一眼队列再睡，tickle 那边是先放任务再看谁在等 epoll
+            else if(hasPendingTasks())
+            {
+                rt = -1;
+            }
+        }
+        //分片模式是睡在自己的 epoll 上，跟 park 一样先挂标记再看一眼队列
+        if(rt == 0 && m_sharded)
+        {
+            self->parked.store(true);
+            if(hasPendingTasks())
+            {
+                rt = -1;
+            }
+        }
+        //-1 是队列里有活了，不用等 epoll，直接回去跑
+        while(rt == 0)
         {
             static const int MAX_TIMEOUT = 5000;
-            if(next_timeout != ~0ull)
+            if(next_timeout != ~0ull && polling)
             {
                 next_timeout = (int)next_timeout > MAX_TIMEOUT ? MAX_TIMEOUT : next_timeout;
             }
@@ -444,56 +1221,107 @@ void IOManager::idle()
             {   
                 next_timeout = MAX_TIMEOUT;
             }
+            next_timeout = clampCallerDrain(next_timeout);
             // SYLAR_LOG_INFO(g_logger) << "epoll wait ! next_timeout:" << next_timeout;
             //没有事件回来，五秒之后也会唤醒，64 就是上面的一次返回处理的数量
-            rt = epoll_wait(m_epfd, events, 64, (int)next_timeout);
+            rt = epoll_wait(epfd, events, 64, (int)next_timeout);
             //EINTR 操作系统返回的中断，指示再去epoll一次
             if(rt < 0 && errno == EINTR)
             {
-
+                rt = 0;
             }
             else
             {
                 break;
             }
-        } while(true);
+        }
+        if(m_sharded)
+        {
+            self->parked.store(false);
+        }
+        spun = false;
+        if(rt < 0)
+        {
+            rt = 0;
+        }
+        //定时器超时醒的也算，反正都是等了这么久才有事做
+        uint64_t gap = GetCurrentUS() - idle_start;
+        gap_ewma = (gap_ewma * 7 + gap) / 8;
+
+        //这一轮派发出去的任务攒起来，最后按数量一次叫醒别的线程来分，不然只有自己一个慢慢跑
+        beginBatch();
 
         //统一先处理一次定时器
         std::vector<std::function<void()>> cbs;
-        listExpiredCb(cbs);
+        std::vector<std::function<void()>> inline_cbs;
+        //排空过了 deadline 的话，后来挂上的定时器也不等了，sleep 之类的马上醒
+        if(m_drainExpired)
+        {
+            flushTimers(cbs, inline_cbs);
+        }
+        else
+        {
+            listExpiredCb(cbs, inline_cbs);
+        }
 
         if(!cbs.empty())
         {
             schedule(cbs.begin(), cbs.end());
             cbs.clear();
         }
+        //只是叫醒协程、取消事件的那些，不用再为它们各切一次协程
+        if(!inline_cbs.empty())
+        {
+            scheduleInline(inline_cbs.begin(), inline_cbs.end());
+            inline_cbs.clear();
+        }
 
         for(int i = 0; i < rt; ++i)
         {
             epoll_event& event = events[i];
             //谨慎判断一下
-            if(event.data.fd == m_tickleFds[0])
+            if(event.data.fd == m_wakeFd)
             {
-                //说明是内部有发消息给我们（比如idle通过 pipe）
-                uint8_t dummy;
-                //一定要读干净，否则 ET 触发不读干净的话就不会再通知了
-                while(read(m_tickleFds[0], &dummy, 1) == 1);
+                //说明是内部有发消息给我们（tickle、定时器插到了最前面）
+                uint64_t dummy;
+                //一定要读干净，再清标记，不然清掉之前写的那次就丢了
+                while(read(m_wakeFd, &dummy, sizeof(dummy)) == sizeof(dummy));
+                m_wakePending.store(false);
+                //空转的时候截到了给 poller 的，可能是定时器要它重新算等多久，转给它
+                if(!polling && m_poller.load() != -1)
+                {
+                    wakePoller();
+                }
                 //已经唤醒了，就不用处理了
                 continue;
             }
+            if(m_sharded && event.data.fd == self->fd)
+            {
+                //叫的就是我，读空再清标记
+                uint64_t dummy;
+                while(read(self->fd, &dummy, sizeof(dummy)) == sizeof(dummy));
+                self->pending.store(false);
+                continue;
+            }
+
+            if(m_uring && (event.data.u64 & 1))
+            {
+                //哪个环有做完的了
+                reapUring((Waker*)(event.data.u64 & ~1ull));
+                continue;
+            }
 
             FdContext* fd_ctx = (FdContext*)event.data.ptr;
             //要操作它
             FdContext::MutexType::Lock lock(fd_ctx->mutex);
-            if(event.events & (EPOLLERR | EPOLLHUP))
-            {
-                //错误或者中断，就加一些读写，让能反应
-                // event.events |= EPOLLIN | EPOLLOUT;//我去，这里写错了。导致 iomanager assert了错误事件（没有监听却trigger）
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
-            }
 
             //只关心两个事件
             int real_events = NONE;
+            if(event.events & (EPOLLERR | EPOLLHUP))
+            {
+                //错误或者中断，读写都算就绪，让能反应
+                real_events = READ | WRITE;
+            }
             if(event.events & EPOLLIN)
             {
                 real_events |= READ;
@@ -503,41 +1331,48 @@ void IOManager::idle()
                 real_events |= WRITE;
             }
 
-            //看有无交集
-            if((fd_ctx->events & real_events) == NONE)
-            {
-                //如果没有，说明也许 fd 的 event 在其他地方已经处理了（比如删除？）
-                continue;
-            }
-
-            //剩余的事件
-            int left_events = (fd_ctx->events & ~real_events);
-            int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-            //可以复用的
-            event.events = EPOLLET | left_events;
-
-            //已经处理了一个，剩下的继续丢进去 epoll 处理
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
-            if(rt2)
+            //fd 一直挂着，不用再 epoll_ctl。有人等的叫醒，没人等的记成就绪，下次来等的时候直接重试
+            int wake_events = fd_ctx->events & real_events;
+            fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~wake_events));
+            if(wake_events == NONE)
             {
-                //errno 是系统错误
-                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << op << "," << fd_ctx->fd << "," << event.events << "):"
-                    << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
                 continue;
             }
 
             //为什么不能是else，是因为有可能两个事件同时触发了
-            if(real_events & READ)
+            if(wake_events & READ)
             {
                 fd_ctx->triggerEvent(READ);
                 --m_pendingEventCount;
             }
-            if(real_events & WRITE)
+            if(wake_events & WRITE)
             {
                 fd_ctx->triggerEvent(WRITE);
                 --m_pendingEventCount;
             }
+            if(m_sharded)
+            {
+                self->events.store(self->events.load(std::memory_order_relaxed) + 1
+                        , std::memory_order_relaxed);
+            }
+        }
+        endBatch();
+
+        if(polling)
+        {
+            //什么活都没派出来（定时器重新算时间、被叫醒了活却让别人拿走了），接着等 epoll
+            if(!hasPendingTasks())
+            {
+                continue;
+            }
+            //要去干活了，名分放掉。还有事件、定时器要等的话，叫一个睡着的来接着等 epoll
+            m_poller.store(-1);
+            polling = false;
+            //分片模式下事件各等各的，只有定时器要人接班
+            if((!m_sharded && m_pendingEventCount > 0) || hasTimer())
+            {
+                ensurePoller();
+            }
         }
 
         //处理完之后，就让出来
@@ -547,13 +1382,15 @@ void IOManager::idle()
 
         //回到调度器的 main fiber 里面去
         raw_ptr->swapOut();
+        idle_start = GetCurrentUS();
     }
 }
 
 void IOManager::onTimerInsertedAtFront()
 {
-    //先唤醒，然后重新计算一个时间
-    tickle();
+    //先唤醒，然后重新计算一个时间。只有等 epoll 的那个在看定时器
+    wakePoller();
+    ensurePoller();
 
 }
 
@@ -3,9 +3,12 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include <sys/epoll.h>
 
 namespace sylar {
 
+class Uring;
+
 //不同于一般的线程池，用信号量来做。底层使用epoll。多继承有点黑科技噢
 //java 只能单继承，更多的是接口编程。
 class IOManager : public Scheduler, public TimerManager {
@@ -32,6 +35,8 @@ private:
             Scheduler* scheduler = nullptr;   //表示事件在哪个 scheduler 上执行
             Fiber::ptr fiber;       //事件的协程
             std::function<void()> cb;//事件的回调
+            //注册事件时候的优先级，事件来了按这个优先级调度回去
+            Scheduler::Priority prio = Scheduler::NORMAL;
         };
         
         EventContext& getContext(Event event);
@@ -42,8 +47,17 @@ private:
         EventContext write;//写事件
         int fd = 0;        //事件关联的句柄
 
-        //已经注册的事件
+        //有人在等的事件
         Event events = NONE;
+        //已经挂到 epoll 上的事件（边沿触发），只加不减，fd 关掉之前一直挂着。事件来了、有人来等都不用再 epoll_ctl
+        //一般的连接只等读，一次 ADD 就够了；写也等过的再 MOD 一次加上。不一上来就挂写：unix socket 对面每读一次都会来一次可写
+        Event registered = NONE;
+        //边沿来了但是没人等，先记着。hook 的 IO 下次 EAGAIN 来等的时候看到就直接重试，不挂起
+        Event ready = NONE;
+        //分片模式下挂在哪个工作线程的 epoll 上，-1 是还没定。第一次注册的时候定下，close 的时候放掉
+        int shard = -1;
+        //交给 io_uring 还没做完的请求数，close 的时候有的话要撤掉
+        std::atomic<int> uringOps = {0};
         MutexType mutex;
     };
     
@@ -51,39 +65,179 @@ public:
     IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
     ~IOManager();
 
-    //1 success, -1 error //0 retry
+    //0 success, -1 error
+    //fd 挂着的话会 MOD 一次让内核把现在的就绪再报一遍，调用方没把数据读完就来等也不会漏
+    //不看缓存的就绪：之前来过的边沿可能早被读掉了，按缓存触发的话回调读到的是 EAGAIN
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+    //hook 用的：刚读写到 EAGAIN 才来等当前协程，fd 挂着的话不用再 epoll_ctl
+    //EAGAIN 之后已经来过边沿了返回 1，什么都不挂，调用方直接重试；挂上了返回 0，要自己 YieldToHold；失败 -1
+    int waitEvent(int fd, Event event);
     bool delEvent(int fd, Event event);     //直接删掉了
     bool cancelEvent(int fd, Event event);  //强制触发一次？
 
+    //fd 要关了（或者不要了）：等着的全部触发，就绪缓存、挂载状态清掉。hook 的 socket、accept 开出新 fd 的时候也调一次，
+    //同号的旧 fd 没经过 hook 的 close 的话状态是旧的。
+    //挂过的 fd 从 epoll 上摘掉，fd 被 dup、fork 出去的话关掉的时候内核不会自己摘
     bool cancelAll(int fd);
 
+    //分片模式：每个工作线程一个自己的 epoll，fd 第一次注册的时候定在注册它的那个线程上，之后它的事件都只在那个线程上等
+    //不是工作线程注册的轮着分。配置 iomanager.sharded 打开，默认还是所有线程一个 epoll
+    bool isSharded() const { return m_sharded; }
+
+    struct ShardStats
+    {
+        size_t index = 0;
+        //定在这个分片上的 fd 数
+        size_t fds = 0;
+        //这个分片派发过的事件数，看哪个分片忙
+        uint64_t events = 0;
+        //现在睡着（在等自己的 epoll）
+        bool parked = false;
+    };
+    std::vector<ShardStats> getShardStats();
+
+    //新 fd 定在哪个分片上：fd、注册它的工作线程下标（不是工作线程是 -1），返回分片下标，返回 -1 或者越界的用默认的
+    typedef std::function<int(int fd, int worker)> ShardPicker;
+    void setShardPicker(ShardPicker picker);
+    //把 fd 挪到别的分片上，热的分片匀一点出去。已经挂着的事件一起挪过去。不是分片模式、fd 没定过返回 false
+    bool migrateFd(int fd, size_t shard);
+
+    //io_uring 后端：配置 iomanager.backend 是 uring、内核也支持的时候打开，不然还是 epoll
+    //每个工作线程一个环，hook 的 socket IO 不再是试一次、挂 epoll、醒了再试，而是直接交给内核做，做完了叫醒协程
+    bool isUring() const { return m_uring; }
+    //当前协程的一次 IO 交给内核做，挂起等它做完：>= 0 是结果，< 0 是 -errno，超时 -ETIMEDOUT
+    //opcode 是 IORING_OP_*，addr/len/off/op_flags 按 SQE 的同名字段填。攒到这一轮调度完一起提交
+    //不是 uring 后端、不在本 IOManager 的工作线程上、SQ 满了，返回 -ENOSYS，调用方自己走 epoll 那一套
+    int uringIo(int fd, uint8_t opcode, const void* addr, uint32_t len
+            , uint64_t off, uint32_t op_flags, uint64_t timeout_ms);
+
     //子类的静态方法可以隐藏掉父类的
     static IOManager* GetThis();
 
 protected:
 //三个虚方法
     void tickle() override;
+    void tickleWorker(size_t index) override;
     bool stopping() override;
+    bool quiescent() override;
+    //排空到了 deadline：所有还在等的 fd 事件 cancelAll，定时器一次性的提前触发、循环的丢掉
+    void abandonWork(DrainResult& result) override;
     void idle() override;
+    void flushPending() override;
 
     //继承自 timer
     void onTimerInsertedAtFront() override;
 
-    void contextResize(size_t size);
+    //fd 对应的 FdContext，不拿锁。auto_create 的话那一块还没分配就分配上
+    //fd 不合法（负的、超出上限）或者不创建的时候那一块还没有，返回空
+    FdContext* getFdContext(int fd, bool auto_create);
+    //分配第 idx 块，几个线程同时来的话只有一个装得上，别的放掉自己的用装上的那个
+    FdContext* allocFdChunk(size_t idx);
+    //fd 所在的 epoll：分片模式是它分片的，不然是公共的。要拿着 fd 的锁
+    int epollOf(FdContext* fd_ctx) const;
+    //addEvent、waitEvent 共用。rearm 是 fd 已经挂着的话要不要再 MOD 一次
+    int registerEvent(int fd, Event event, std::function<void()> cb, bool rearm);
+    //把 fd 挂到（或者重新挂到）它的 epoll 上，挂的是已经挂着的加上 event。要拿着 fd 的锁
+    int armFd(FdContext* fd_ctx, Event event);
+    //分片模式下给新 fd 定分片，要拿着 fd 的锁
+    void pinFd(FdContext* fd_ctx);
+    void unpinFd(FdContext* fd_ctx);
     //这个是特殊用来区分 stopping 的。这个 stopping 会返回下次的定时器的执行时间
     //啊~ 这个补丁好惨
     bool stopping(uint64_t& next_timeout); 
+    //睡下去之前先空转最多 budget_us：看 epoll 有没有事件、队列有没有活
+    //返回事件数；转到了活（或者有人把活交给了我们）返回 -1；白转了返回 0
+    int spinWait(int epfd, epoll_event* events, uint64_t budget_us);
+    //叫醒等 epoll 的那个（poller）：写公共的 eventfd，它还没醒来处理上一次的话就不写了
+    //分片模式没有公共的 epoll，poller 只是替大家等定时器的那个，写它自己的
+    void wakePoller();
+    //只叫醒第 index 个工作线程：写它自己的 eventfd
+    void wakeWorker(size_t index);
+    //找一个睡在自己 eventfd 上的叫起来，一个都没有返回 false
+    bool wakeParked();
+    //有事件、定时器要等却没人在等 epoll 的时候，叫一个睡着的起来接班
+    void ensurePoller();
+    //不用等 epoll（有人在等了）的时候睡在自己的 eventfd 上
+    //有活了返回 -1，醒了但是没活（可能要去接着等 epoll）返回 0
+    int park(size_t index);
+private:
+    struct Waker;
+    //给每个工作线程建环，挂到它要等的那个 epoll 上。有一个建不起来就全放掉，退回 epoll
+    bool initUring();
+    //攒着的交给内核，顺手把已经做完的收掉。返回收了几个
+    size_t pumpUring(Waker* waker);
+    //收 waker 的环上做完的，把等着的协程放回去。别人正在收的话让它多收一遍
+    size_t reapUring(Waker* waker);
+    //fd 还有交给内核没做完的请求就撤掉（close 的时候），有的话返回 true
+    bool cancelUring(FdContext* fd_ctx);
 private:
+    //每个工作线程一个 eventfd，叫谁就写谁的
+    struct Waker
+    {
+        int fd = -1;
+        //写过了它还没醒来处理，再叫就不用写了
+        std::atomic<bool> pending = {false};
+        //正睡在自己的 eventfd 上（分片模式是睡在自己的 epoll 上）
+        std::atomic<bool> parked = {false};
+        //分片模式下自己的 epoll，eventfd 也挂在里面
+        int epfd = -1;
+        std::atomic<size_t> fds = {0};
+        //只有自己加
+        std::atomic<uint64_t> events = {0};
+        //io_uring 后端自己的环，只有自己往里交；做完的谁收都行，同一时间一个人收
+        Uring* ring = nullptr;
+        std::atomic<bool> reaping = {false};
+        std::atomic<bool> reapAgain = {false};
+        //攒着的请求已经等了几轮调度
+        uint32_t ringAge = 0;
+    };
+
+    //交给内核的一次 IO，放在等着的协程栈上，做完了把结果填回来
+    struct UringWait
+    {
+        Fiber::ptr fiber;
+        Scheduler* scheduler = nullptr;
+        Scheduler::Priority prio = Scheduler::NORMAL;
+        FdContext* fd_ctx = nullptr;
+        int res = 0;
+    };
+
     int m_epfd = 0; //epoll的fd
-    //用 pipline的形式，而不是经典的信号量
-    int m_tickleFds[2];
+    //闲着的线程同一时间只有一个在等 epoll（poller），别的睡在自己的 eventfd 上
+    //poller 的 eventfd 是公共的，挂在 epoll 里；谁是 poller 记在 m_poller，没有是 -1
+    int m_wakeFd = -1;
+    std::atomic<bool> m_wakePending = {false};
+    std::atomic<int> m_poller = {-1};
+    std::vector<Waker*> m_wakers;
+    //wakeParked 从哪儿开始找，轮着来
+    std::atomic<size_t> m_wakeCursor = {0};
+
+    //分片模式，构造的时候从配置读，之后不变
+    bool m_sharded = false;
+    //不是工作线程注册的 fd 轮着分
+    std::atomic<size_t> m_shardCursor = {0};
+    //换的时候别的线程可能正在用，所以拿 shared_ptr 原子地换
+    std::shared_ptr<ShardPicker> m_shardPicker;
+
+    //构造的时候定下来，之后不变
+    bool m_uring = false;
+    //攒够这么多个请求、或者攒了这么多轮调度就交
+    uint32_t m_uringBatch = 0;
 
     std::atomic<size_t> m_pendingEventCount = {0}; //等待执行的事件数量
-    RWMutexType m_mutex;
-
-    //上下文数组
-    std::vector<FdContext*> m_fdContexts;
+    //正在空转的线程数。tickle 的时候有人在转就减一个，把活交给它，不用写 pipe
+    std::atomic<size_t> m_spinningCount = {0};
+    //最多空转多久（微秒）、最多几个线程一起转，构造的时候从配置读
+    uint64_t m_maxSpinUs = 0;
+    size_t m_maxSpinners = 0;
+    //排空过了 deadline：不再收新的事件，定时器一挂上就触发
+    std::atomic<bool> m_drainExpired = {false};
+
+    //fd -> FdContext 两级表：一块 FD_CHUNK_SIZE 个，用到了才分配，分配了就不挪也不放，直到析构
+    //查的时候就是两次下标，扩容也不会挡住别的线程。最多管 FD_CHUNK_COUNT * FD_CHUNK_SIZE 个 fd
+    static const size_t FD_CHUNK_SIZE = 4096;
+    static const size_t FD_CHUNK_COUNT = 4096;
+    std::atomic<FdContext*> m_fdChunks[FD_CHUNK_COUNT];
 };
 
 }
@@ -0,0 +1,257 @@
+#ifndef __SYLAR_LOCKFREE_QUEUE_H__
+#define __SYLAR_LOCKFREE_QUEUE_H__
+
+//调度器用到的无锁队列
+//只放指针，对象本身的生命周期由使用者自己管
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include "noncopyable.h"
+
+namespace sylar
+{
+
+//工作窃取队列（Chase-Lev deque）
+//拥有者线程在 bottom 端 push/pop，不加锁（LIFO，刚放进去的任务缓存还是热的）
+//其他线程从 top 端 steal，只用一次 CAS 跟拥有者竞争最后一个元素
+//T 必须是指针类型，空指针表示没取到
+template<class T>
+class WorkStealQueue : Noncopyable
+{
+public:
+    WorkStealQueue(int64_t capacity = 256)
+    {
+        //容量必须是 2 的幂，下标直接 & mask
+        int64_t cap = 1;
+        while(cap < capacity)
+        {
+            cap <<= 1;
+        }
+        m_array.store(new Array(cap), std::memory_order_relaxed);
+    }
+
+    ~WorkStealQueue()
+    {
+        delete m_array.load(std::memory_order_relaxed);
+        for(auto i : m_garbage)
+        {
+            delete i;
+        }
+    }
+
+    //只能拥有者线程调用
+    void push(T v)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array* a = m_array.load(std::memory_order_relaxed);
+        if(b - t > a->capacity - 1)
+        {
+            a = grow(a, b, t);
+        }
+        a->put(b, v);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    //只能拥有者线程调用
+    T pop()
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* a = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+
+        T v = nullptr;
+        if(t <= b)
+        {
+            v = a->get(b);
+            if(t == b)
+            {
+                //只剩最后一个，可能跟小偷抢，输了就当没有
+                if(!m_top.compare_exchange_strong(t, t + 1
+                            , std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    v = nullptr;
+                }
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            //本来就是空的，还原
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return v;
+    }
+
+    //任意线程调用，从另一端偷
+    //CAS 失败也返回空，调用者换一个队列偷就行了，没必要在这里死循环
+    T steal()
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+
+        if(t < b)
+        {
+            Array* a = m_array.load(std::memory_order_acquire);
+            T v = a->get(t);
+            if(!m_top.compare_exchange_strong(t, t + 1
+                        , std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                return nullptr;
+            }
+            return v;
+        }
+        return nullptr;
+    }
+
+    //近似值，其他线程读只能当参考
+    size_t size() const
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? (size_t)(b - t) : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+private:
+    struct Array
+    {
+        int64_t capacity;
+        int64_t mask;
+        std::atomic<T>* buffer;
+
+        Array(int64_t cap)
+            :capacity(cap)
+            ,mask(cap - 1)
+            ,buffer(new std::atomic<T>[cap])
+        {
+        }
+
+        ~Array()
+        {
+            delete[] buffer;
+        }
+
+        void put(int64_t i, T v)
+        {
+            buffer[i & mask].store(v, std::memory_order_relaxed);
+        }
+
+        T get(int64_t i)
+        {
+            return buffer[i & mask].load(std::memory_order_relaxed);
+        }
+    };
+
+    //扩容只有拥有者会做。旧的数组可能还有小偷在读，不能马上释放，挂起来等析构
+    //只会翻倍，所以总的浪费不超过当前大小
+    Array* grow(Array* a, int64_t b, int64_t t)
+    {
+        Array* na = new Array(a->capacity * 2);
+        for(int64_t i = t; i < b; ++i)
+        {
+            na->put(i, a->get(i));
+        }
+        m_garbage.push_back(a);
+        m_array.store(na, std::memory_order_release);
+        return na;
+    }
+private:
+    //top 跟 bottom 用 padding 隔开 cache line，小偷跟拥有者不互相踩
+    //不用 alignas 是因为 c++11 的 new 不保证超对齐
+    std::atomic<int64_t> m_top = {0};
+    char m_pad[64];
+    std::atomic<int64_t> m_bottom = {0};
+    std::atomic<Array*> m_array = {nullptr};
+    std::vector<Array*> m_garbage;
+};
+
+//多生产者单消费者的侵入式队列（Vyukov）
+//push 只有一次 exchange，谁都可以调；pop 只能消费者一个线程调
+//T 里面要有一个 std::atomic<T*> next，节点内存由使用者管
+template<class T>
+class MpscQueue : Noncopyable
+{
+public:
+    MpscQueue()
+        :m_head(&m_stub)
+        ,m_tail(&m_stub)
+    {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    void push(T* n)
+    {
+        m_size.fetch_add(1, std::memory_order_seq_cst);
+        link(n);
+    }
+
+    //生产者 push 到一半的时候（exchange 了还没挂上 next），这里会返回空
+    //所以生产者 push 完之后要负责把消费者叫醒，消费者醒了再来拿
+    T* pop()
+    {
+        T* tail = m_tail;
+        T* next = tail->next.load(std::memory_order_acquire);
+        if(tail == &m_stub)
+        {
+            if(!next)
+            {
+                return nullptr;
+            }
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if(next)
+        {
+            m_tail = next;
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+            return tail;
+        }
+
+        T* head = m_head.load(std::memory_order_acquire);
+        if(tail != head)
+        {
+            return nullptr;
+        }
+
+        //只剩最后一个，把 stub 挂回去才能把它摘下来
+        link(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if(next)
+        {
+            m_tail = next;
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+            return tail;
+        }
+        return nullptr;
+    }
+
+    //近似值
+    size_t size() const { return m_size.load(std::memory_order_seq_cst); }
+    bool empty() const { return size() == 0; }
+private:
+    void link(T* n)
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        T* prev = m_head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+private:
+    std::atomic<T*> m_head;
+    char m_pad[64];
+    //只有消费者碰
+    T* m_tail;
+    T m_stub;
+    std::atomic<size_t> m_size = {0};
+};
+
+}
+
+#endif
@@ -2,6 +2,13 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
+#include <algorithm>
+#include <sstream>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <execinfo.h>
 
 namespace sylar 
 {
@@ -11,6 +18,90 @@ static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 static thread_local Scheduler* t_scheduler = nullptr;
 //本协程的主函数
 static thread_local Fiber* t_fiber = nullptr;
+//本线程在调度器里的下标（对应 m_threadIds / m_workers），不在 run 里面就是 -1
+static thread_local int t_worker_index = -1;
+//正在攒批的调度器，跟攒下来要叫醒的数量
+static thread_local Scheduler* t_batch_scheduler = nullptr;
+static thread_local size_t t_batch_count = 0;
+//当前线程正在跑的任务的优先级
+static thread_local Scheduler::Priority t_priority = Scheduler::NORMAL;
+//正在主协程上直接跑 scheduleInline 的回调
+static thread_local bool t_inline_task = false;
+//排队延迟抽样用的计数
+static thread_local uint32_t t_sample_tick = 0;
+//本线程的让出标记（WorkerContext::yieldRequested），不在 run 里是空
+static thread_local std::atomic<bool>* t_yield_flag = nullptr;
+//drain 自己放弃事件、定时器的时候叫醒的任务不能被拒掉
+static thread_local bool t_drain_bypass = false;
+
+//默认一轮里 critical 取 8 个、normal 4 个、background 1 个
+static ConfigVar<std::vector<int> >::ptr g_priority_weights =
+    Config::Lookup("scheduler.priority_weights", std::vector<int>{8, 4, 1}
+            , "scheduler priority weights: critical, normal, background");
+
+//工作线程绑核：
+//  空的或者 none 不绑，交给内核
+//  core    第 i 个线程绑到第 i 个可用的 cpu 上（多了就绕回来）
+//  numa    线程轮流分到各个 NUMA 节点，绑在节点的 cpu 上，内存也优先从这个节点分
+//  numa:N  全部绑到节点 N 上，一个 socket 一个进程的部署用
+static ConfigVar<std::string>::ptr g_scheduler_affinity =
+    Config::Lookup("scheduler.affinity", std::string("")
+            , "scheduler thread affinity: none, core, numa, numa:N");
+
+//回调跑完的协程每个线程每种栈档位留几个，下一个回调直接 reset 复用，不用再 new 协程、拿栈
+//0 就是不留，每个回调都新建
+static ConfigVar<uint32_t>::ptr g_fiber_pool_size =
+    Config::Lookup<uint32_t>("scheduler.fiber_pool_size", 16
+            , "finished fibers cached per worker per stack class");
+
+//每多少个任务抽一个量排队延迟（schedule 到开始跑），0 不量，1 全量
+//要读两次时钟，全量的话任务很短的时候看得出来
+static ConfigVar<uint32_t>::ptr g_latency_sample =
+    Config::Lookup<uint32_t>("scheduler.latency_sample", 16
+            , "sample 1 of N tasks for schedule-to-run latency, 0 to disable");
+
+//看门狗：一个任务连续跑了这么久（毫秒）还没让出，就把那个线程的栈打出来，0 不开（默认）
+//开了的话每个调度器多一个看门狗线程，抓栈要往工作线程发 SIGURG，进程里的 SIGURG 处理函数会被换掉（带外数据、F_SETOWN 就别开了）
+static ConfigVar<uint32_t>::ptr g_watchdog_ms =
+    Config::Lookup<uint32_t>("scheduler.watchdog_ms", 0
+            , "log backtrace of tasks running longer than this without yielding, 0 to disable;"
+              " installs a process-wide SIGURG handler to capture the stack");
+
+//一个任务连续跑了这么久（毫秒），Fiber::ShouldYield 就开始返回 true，0 不设置（默认）。开了也要起看门狗线程，不过不用信号
+static ConfigVar<uint32_t>::ptr g_yield_slice_ms =
+    Config::Lookup<uint32_t>("scheduler.yield_slice_ms", 0
+            , "Fiber::ShouldYield turns true after a task runs this long, 0 to disable; runs a watchdog thread");
+
+static uint32_t s_latency_sample = 0;
+
+struct _SchedulerIniter
+{
+    _SchedulerIniter()
+    {
+        s_latency_sample = g_latency_sample->getValue();
+        g_latency_sample->addListener([](const uint32_t& old_value, const uint32_t& new_value)
+        {
+            s_latency_sample = new_value;
+        });
+    }
+};
+
+static _SchedulerIniter s_scheduler_initer;
+
+//只有本线程写的计数，不用带 lock 前缀的原子加，别的线程读到的稍微旧一点没关系
+template<class T, class N>
+static inline void OwnerAdd(std::atomic<T>& v, N n)
+{
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+//gettimeofday 会被改系统时间影响，量时长用单调时钟
+static uint64_t MonotonicUS()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
 
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
     :m_name(name) {
@@ -45,6 +136,83 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
 
     //数量
     m_threadCount = threads;
+
+    //权重至少是 1，不然那个优先级就永远轮不到了
+    std::vector<int> weights = g_priority_weights->getValue();
+    for(int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        m_weights[i] = (i < (int)weights.size() && weights[i] > 0) ? weights[i] : 1;
+    }
+    m_fiberPoolSize = g_fiber_pool_size->getValue();
+    m_watchdogMs = g_watchdog_ms->getValue();
+    m_yieldSliceMs = g_yield_slice_ms->getValue();
+
+    //use caller 的那个线程也算一个 worker，放在第一个，跟 m_threadIds 对齐
+    size_t workers = m_threadCount + (use_caller ? 1 : 0);
+    for(size_t i = 0; i < workers; ++i)
+    {
+        m_workers.push_back(new WorkerContext);
+        m_workers[i]->index = i;
+    }
+    if(use_caller)
+    {
+        m_workers[0]->thread = m_rootThread;
+    }
+    initAffinity();
+}
+
+void Scheduler::initAffinity()
+{
+    std::string mode = g_scheduler_affinity->getValue();
+    if(mode.empty() || mode == "none")
+    {
+        return;
+    }
+
+    if(mode == "core")
+    {
+        std::vector<int> cpus = GetAllowedCpus();
+        if(cpus.empty())
+        {
+            return;
+        }
+        for(auto i : m_workers)
+        {
+            i->cpus.push_back(cpus[i->index % cpus.size()]);
+        }
+        return;
+    }
+
+    if(mode == "numa")
+    {
+        int nodes = GetNumaNodeCount();
+        for(auto i : m_workers)
+        {
+            i->node = i->index % nodes;
+            i->cpus = GetNumaNodeCpus(i->node);
+        }
+        return;
+    }
+
+    if(mode.compare(0, 5, "numa:") == 0)
+    {
+        int node = atoi(mode.c_str() + 5);
+        std::vector<int> cpus = GetNumaNodeCpus(node);
+        if(cpus.empty())
+        {
+            SYLAR_LOG_ERROR(g_logger) << "scheduler.affinity=" << mode << " no such numa node";
+            return;
+        }
+        m_memoryNode = node;
+        for(auto i : m_workers)
+        {
+            i->node = node;
+            i->cpus = cpus;
+        }
+        return;
+    }
+
+    SYLAR_LOG_ERROR(g_logger) << "scheduler.affinity=" << mode << " unknown, ignored";
 }
 
 Scheduler::~Scheduler()
@@ -54,6 +222,11 @@ Scheduler::~Scheduler()
     {
         t_scheduler = nullptr;
     }
+
+    for(auto i : m_workers)
+    {
+        delete i;
+    }
 }
 
 //类似的，也有一个主调度器的概念
@@ -68,6 +241,121 @@ Fiber* Scheduler::GetMainFiber()
     return t_fiber;
 }
 
+Scheduler::Priority Scheduler::GetCurrentPriority()
+{
+    return t_priority;
+}
+
+bool Scheduler::InInlineTask()
+{
+    return t_inline_task;
+}
+
+bool Scheduler::ShouldYield()
+{
+    //inline 的回调本来就不能让出
+    return t_yield_flag && !t_inline_task && t_yield_flag->load(std::memory_order_relaxed);
+}
+
+//看门狗抓栈：别的线程的栈只能让它自己抓，所以给它发个 SIGURG（默认是忽略的，Go 也拿它做抢占）
+//处理函数只有开了 scheduler.watchdog_ms 才装，装了就是整个进程的，原来的处理函数会被换掉
+//信号处理函数里只调 ::backtrace，抓好放在这里，看门狗线程再去解析、打日志
+//多个调度器的看门狗共用，一次只抓一个
+struct StallCapture
+{
+    enum
+    {
+        IDLE = 0,
+        REQUESTED,
+        CAPTURING,
+        DONE
+    };
+    std::atomic<int> state = {IDLE};
+    pthread_t target;
+    void* frames[64];
+    int size = 0;
+};
+
+static StallCapture s_capture;
+static Mutex s_capture_mutex;
+static bool s_capture_installed = false;
+
+static void OnStallSignal(int sig)
+{
+    int expect = StallCapture::REQUESTED;
+    if(!pthread_equal(s_capture.target, pthread_self())
+            || !s_capture.state.compare_exchange_strong(expect, StallCapture::CAPTURING))
+    {
+        return;
+    }
+    int saved = errno;
+    s_capture.size = ::backtrace(s_capture.frames, 64);
+    s_capture.state.store(StallCapture::DONE);
+    errno = saved;
+}
+
+static void InstallStallSignal()
+{
+    Mutex::Lock lock(s_capture_mutex);
+    if(s_capture_installed)
+    {
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &OnStallSignal;
+    sigemptyset(&sa.sa_mask);
+    //被打断的系统调用能重来的就重来
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGURG, &sa, nullptr);
+    s_capture_installed = true;
+}
+
+//等信号处理函数抓完，最多 100ms
+static bool WaitCaptureDone()
+{
+    for(int i = 0; i < 100 && s_capture.state.load() != StallCapture::DONE; ++i)
+    {
+        usleep(1000);
+    }
+    return s_capture.state.load() == StallCapture::DONE;
+}
+
+//抓 thread 现在的栈，最多等 100ms，抓不到返回空
+static std::string CaptureStack(pthread_t thread)
+{
+    Mutex::Lock lock(s_capture_mutex);
+    //上次超时的时候处理函数还在抓（比如 backtrace 第一次调要加载 libgcc），它还会往 frames 里写
+    //没写完之前不能开始新的一次
+    if(s_capture.state.load() == StallCapture::CAPTURING && !WaitCaptureDone())
+    {
+        return "";
+    }
+    s_capture.target = thread;
+    s_capture.state.store(StallCapture::REQUESTED);
+    if(pthread_kill(thread, SIGURG))
+    {
+        s_capture.state.store(StallCapture::IDLE);
+        return "";
+    }
+    WaitCaptureDone();
+    int expect = StallCapture::REQUESTED;
+    if(s_capture.state.compare_exchange_strong(expect, StallCapture::IDLE))
+    {
+        //一直没进信号处理函数
+        return "";
+    }
+    //已经在抓了就再等它一会，还抓不完就先不要了，状态留着 CAPTURING，下次进来再看
+    if(!WaitCaptureDone())
+    {
+        return "";
+    }
+    //前两层是信号处理函数跟内核的信号跳板
+    std::string bt = BacktraceToString(s_capture.frames, s_capture.size, 2, "    ");
+    s_capture.state.store(StallCapture::IDLE);
+    return bt;
+}
+
 //真正开始，核心方法！
 void Scheduler::start()
 {
@@ -78,9 +366,12 @@ void Scheduler::start()
     }
 
     m_stopping = false;
+    m_draining = false;
     SYLAR_ASSERT(m_threads.empty());
 
     m_threads.resize(m_threadCount);
+    //use caller 的话 m_workers[0] 是调用线程，新开的排在后面
+    size_t first = m_workers.size() - m_threadCount;
     for(size_t i = 0; i < m_threadCount; ++i)
     {
         //开始跑
@@ -90,6 +381,18 @@ void Scheduler::start()
         //这里就对应上，为何 thread 的时候要放一个信号量（可以翻过去看一下）
         //因为能保证，构建返回的时候，同时 thread 已经开始跑起来之后，id是有了的
         m_threadIds.push_back(m_threads[i]->getId());
+        m_workers[first + i]->thread = m_threads[i]->getId();
+    }
+
+    if(m_watchdogMs || m_yieldSliceMs)
+    {
+        if(m_watchdogMs)
+        {
+            InstallStallSignal();
+        }
+        m_watchdogStop = false;
+        m_watchdog.reset(new Thread(std::bind(&Scheduler::watchdog, this)
+                            , m_name + "_watchdog"));
     }
     
     //不然的话，run 还会锁一次导致死锁。。
@@ -170,7 +473,9 @@ void Scheduler::stop()
         
         //放弃挣扎了，直接简单处理，居然是在这里才实现的主线程复用
         //哎，暂时不知道有甚么意义
-        if(!stopping())
+        //drain 切进去跑过的话，主协程停在 run 里面，活干完了也要 call 进去让它走完
+        if(!stopping() || m_rootFiber->getState() == Fiber::EXEC
+                || m_rootFiber->getState() == Fiber::HOLD)
         {
             m_rootFiber->call();
         }
@@ -186,6 +491,19 @@ void Scheduler::stop()
     {
         i->join();
     }
+    //线程都退了，id 可能被新线程复用，不能再认成自己的工作线程
+    for(size_t i = m_workers.size() - m_threadCount; i < m_workers.size(); ++i)
+    {
+        m_workers[i]->thread = -1;
+    }
+
+    if(m_watchdog)
+    {
+        m_watchdogStop = true;
+        m_watchdogSem.notify();
+        m_watchdog->join();
+        m_watchdog.reset();
+    }
     // if(exit_on_this_fiber)
     // {
 
@@ -193,6 +511,99 @@ void Scheduler::stop()
     SYLAR_LOG_INFO(g_logger) << "scheduler has stopped!";
 }
 
+Scheduler::DrainResult Scheduler::drain(uint64_t timeout_ms, Scheduler* redirect)
+{
+    //在自己的线程上等自己排空，永远等不到
+    SYLAR_ASSERT2(!getLocalWorker(), "drain on its own worker");
+    DrainResult result;
+    uint64_t start = GetCurrentMS();
+    m_drainRejected = 0;
+    m_drainRedirected = 0;
+    m_drainRedirect = redirect;
+    m_draining = true;
+    SYLAR_LOG_INFO(g_logger) << "name=" << getName() << " draining timeout=" << timeout_ms << "ms";
+
+    //不在协程里就是阻塞等，在别的 IOManager 的协程里 usleep 被 hook 了，只挂起协程
+    while(!quiescent())
+    {
+        if(GetCurrentMS() - start >= timeout_ms)
+        {
+            result.clean = false;
+            break;
+        }
+        //use_caller 的话本线程的 worker 只有切到主协程才跑得起来（平时是 stop 里跑），干等的话它的活永远排不空
+        //跟 stop 一样 call 进去，排空了或者到点了它会 back 回来
+        if(m_rootFiber && sylar::GetThreadId() == m_rootThread
+                && m_rootFiber->getState() != Fiber::TERM
+                && m_rootFiber->getState() != Fiber::EXCEPT)
+        {
+            m_callerDrainDeadline = start + timeout_ms;
+            m_rootFiber->call();
+            m_callerDrainDeadline = 0;
+            continue;
+        }
+        usleep(1000);
+    }
+
+    if(!result.clean)
+    {
+        result.abandoned_tasks = m_activeThreadCount;
+        for(int i = 0; i < PRIORITY_COUNT; ++i)
+        {
+            result.abandoned_tasks += getQueueDepth((Priority)i);
+        }
+        t_drain_bypass = true;
+        abandonWork(result);
+        t_drain_bypass = false;
+    }
+
+    stop();
+    result.rejected = m_drainRejected;
+    result.redirected = m_drainRedirected;
+    result.used_ms = GetCurrentMS() - start;
+    if(result.clean)
+    {
+        SYLAR_LOG_INFO(g_logger) << "name=" << getName() << " drained " << result.toString();
+    }
+    else
+    {
+        SYLAR_LOG_WARN(g_logger) << "name=" << getName() << " drain timeout " << result.toString();
+    }
+    return result;
+}
+
+bool Scheduler::callerDrainDone()
+{
+    if(!m_callerDrainDeadline || sylar::GetThreadId() != m_rootThread)
+    {
+        return false;
+    }
+    return GetCurrentMS() >= m_callerDrainDeadline || quiescent();
+}
+
+uint64_t Scheduler::clampCallerDrain(uint64_t timeout_ms)
+{
+    if(!m_callerDrainDeadline || sylar::GetThreadId() != m_rootThread)
+    {
+        return timeout_ms;
+    }
+    uint64_t now = GetCurrentMS();
+    return now >= m_callerDrainDeadline ? 0 : std::min(timeout_ms, m_callerDrainDeadline - now);
+}
+
+std::string Scheduler::DrainResult::toString() const
+{
+    std::stringstream ss;
+    ss << "clean=" << clean
+       << " used=" << used_ms << "ms"
+       << " rejected=" << rejected
+       << " redirected=" << redirected
+       << " abandoned_tasks=" << abandoned_tasks
+       << " cancelled_fds=" << cancelled_fds
+       << " flushed_timers=" << flushed_timers;
+    return ss.str();
+}
+
 void Scheduler::setThis()
 {
     t_scheduler = this;
@@ -212,56 +623,67 @@ void Scheduler::run()
         t_fiber = Fiber::GetThis().get();
     }
     
-    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
-    Fiber::ptr cb_fiber;
+    {
+        //start 的时候是拿着锁创建线程、填 m_threadIds 跟 thread 的，这里拿到锁就说明已经填好了
+        MutexType::Lock lock(m_mutex);
+        WorkerContext* worker = getWorker(sylar::GetThreadId());
+        SYLAR_ASSERT(worker);
+        t_worker_index = worker->index;
+    }
+    WorkerContext* self = m_workers[t_worker_index];
+
+    //先绑核、设好内存节点，下面的 idle 协程、回调协程的栈才会分在本地节点上
+    //use caller 的线程也一样会被绑住
+    if(!self->cpus.empty())
+    {
+        SetThreadAffinity(self->cpus);
+    }
+    if(self->node >= 0)
+    {
+        SetThreadMemoryNode(self->node);
+    }
+    SYLAR_LOG_INFO(g_logger) << "worker " << self->index << " cpus=" << self->cpus.size()
+        << " node=" << self->node;
+
+    //第一次 backtrace 会去加载 libgcc，信号处理函数里不能干这个，先在这里调一次
+    {
+        void* frames[1];
+        ::backtrace(frames, 1);
+    }
+    {
+        Mutex::Lock lock(m_watchdogMutex);
+        self->pthread = pthread_self();
+        self->running = true;
+    }
+    t_yield_flag = &self->yieldRequested;
 
-    FiberAndThread ft;
+    Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+    self->startUs.store(MonotonicUS(), std::memory_order_relaxed);
+    self->stopUs.store(0, std::memory_order_relaxed);
 
     //如果用 stopping 的话，会让 idle 没办法判定自己的 stopping 进而正确退出
     // while(!stopping())
     while(true)
     {
-        ft.reset();
-        bool tickle_me = false;
-        bool is_active = false;
+        //caller 线程是 drain 切进来的：排空了或者到点了就回 drain，stop 的时候再 call 进来接着跑
+        if(callerDrainDone())
         {
-            //在队列取出一个协程，要加锁
-            MutexType::Lock lock(m_mutex);
-            auto it = m_fibers.begin();
-
-            while(it != m_fibers.end())
-            {
-                //说明是指定线程的，而且现在也不在这个线程上
-                if(it->thread != -1 && it->thread != sylar::GetThreadId())
-                {
-                    ++it;
-                    //虽然不处理，但要留下信号，让后续的线程能唤醒拿到它
-                    //但比较无序，简单点处理就行
-                    tickle_me = true;
-                    continue;
-                }
-
-                SYLAR_ASSERT(it->fiber || it->cb);
-                //这种情况在。。
-                if(it->fiber && it->fiber->getState() == Fiber::EXEC)
-                {
-                    //正在执行的，也不需要处理
-                    ++it;
-                    continue;
-                }
-
-                ft = *it;
-                m_fibers.erase(it++);
-                //从下面挪到这里的原因，是有可能还没执行到下面+1的时候，另一个线程的 stopping 状态判断为成立
-                //导致 idle 函数提起那退出了
-                //原则上只要有一个任务在执行，schedule 的线程们都不应该退出去
-                ++m_activeThreadCount;
-
-                //active 是做的更绝，直接不让空闲的线程到 idle 去了
-                is_active = true;
+            m_rootFiber->back();
+        }
+        bool tickle_me = false;
+        flushPending();
 
-                break;
-            }
+        //从下面挪到这里的原因，是有可能还没执行到下面+1的时候，另一个线程的 stopping 状态判断为成立
+        //导致 idle 函数提起那退出了
+        //原则上只要有一个任务在执行，schedule 的线程们都不应该退出去
+        //本地队列是无锁的，没办法在锁里面 +1 了，所以先占住，没拿到再减回去
+        ++m_activeThreadCount;
+        FiberAndThread* ft = takeTask(tickle_me);
+        //active 是做的更绝，直接不让空闲的线程到 idle 去了
+        bool is_active = ft != nullptr;
+        if(!is_active)
+        {
+            --m_activeThreadCount;
         }
 
         if(tickle_me)
@@ -269,41 +691,68 @@ void Scheduler::run()
             tickle();
         }
 
-        if(ft.fiber && ft.fiber->getState() != Fiber::TERM
-                        && ft.fiber->getState() != Fiber::EXCEPT)
+        if(ft)
+        {
+            recordLatency(self, ft);
+            //新的任务重新计时
+            if(self->yieldRequested.load(std::memory_order_relaxed))
+            {
+                self->yieldRequested.store(false, std::memory_order_relaxed);
+            }
+        }
+
+        if(ft && ft->fiber && ft->fiber->getState() != Fiber::TERM
+                        && ft->fiber->getState() != Fiber::EXCEPT)
         {
+            //节点先还回去，本线程下一次 schedule 马上就能复用，还是热的
+            Fiber::ptr fiber;
+            fiber.swap(ft->fiber);
+            Priority prio = ft->prio;
+            FreeTask(ft);
+
             // ++m_activeThreadCount;
-            ft.fiber->swapIn();
+            t_priority = prio;
+            fiber->swapIn();
             --m_activeThreadCount;
 
-            if(ft.fiber->getState() == Fiber::READY)
+            if(fiber->getState() == Fiber::READY)
             {
-                //是yield to ready出去的，那就再次执行
-                schedule(ft.fiber);
+                //是yield to ready出去的，那就再次执行，优先级不变
+                schedule(&fiber, -1, prio);
             }
-            else if(ft.fiber->getState() != Fiber::TERM
-                    && ft.fiber->getState() != Fiber::EXCEPT)
+            else if(fiber->getState() != Fiber::TERM
+                    && fiber->getState() != Fiber::EXCEPT)
             {
                 //不等于两个结束的状态，说明是挂起？
-                ft.fiber->m_state = Fiber::HOLD;
-            }
-            ft.reset();
-        }
-        else if(ft.cb)
-        {
-            if(cb_fiber)
-            {
-                cb_fiber->reset(ft.cb);
+                //上下文到这里才算存完，release 出去，别的线程 acquire 看到 HOLD 才能 swapIn
+                fiber->m_state.store(Fiber::HOLD, std::memory_order_release);
             }
             else
             {
-                cb_fiber.reset(new Fiber(ft.cb));
-                ft.cb = nullptr;
+                //回调协程挂起过、后来又被唤醒跑完的，也回到缓存里
+                returnPooledFiber(self, fiber);
             }
-            ft.reset();
+        }
+        else if(ft && ft->cb && ft->run_inline)
+        {
+            Task cb(std::move(ft->cb));
+            Priority prio = ft->prio;
+            FreeTask(ft);
+
+            t_priority = prio;
+            runInline(cb);
+            --m_activeThreadCount;
+        }
+        else if(ft && ft->cb)
+        {
+            //回调直接 move 进协程，不再拷贝
+            Fiber::ptr cb_fiber = takePooledFiber(self, std::move(ft->cb), ft->stack);
+            Priority prio = ft->prio;
+            FreeTask(ft);
 
             // ++m_activeThreadCount;
             SYLAR_LOG_DEBUG(g_logger) << "Fiber swaping , fiber id=" << cb_fiber->getId();
+            t_priority = prio;
             cb_fiber->swapIn();
             --m_activeThreadCount;
 
@@ -311,27 +760,29 @@ void Scheduler::run()
             if(cb_fiber->getState() == Fiber::READY)
             {
                 // yield to ready
-                schedule(cb_fiber);
-                cb_fiber.reset();
+                schedule(&cb_fiber, -1, prio);
             }
             else if(cb_fiber->getState() == Fiber::EXCEPT
                     || cb_fiber->getState() == Fiber::TERM)
             {
                 // already done
                 SYLAR_LOG_DEBUG(g_logger) << "Schduler cb fiber FINISH! id=" << cb_fiber->getId() ;
-                cb_fiber->reset(nullptr);
+                returnPooledFiber(self, cb_fiber);
             }
             else
             {
-                SYLAR_LOG_DEBUG(g_logger) << "Schduler cb fiber FINISH! else !!!  id=" << cb_fiber->getId() << ", state:" << cb_fiber->m_state ;
+                SYLAR_LOG_DEBUG(g_logger) << "Schduler cb fiber FINISH! else !!!  id=" << cb_fiber->getId() << ", state:" << cb_fiber->getState() ;
 
-                //其他的状态没处理的话，统一为 HOLD
-                cb_fiber->m_state = Fiber::HOLD;
-                cb_fiber.reset();
+                //其他的状态没处理的话，统一为 HOLD，谁挂起的谁拿着
+                cb_fiber->m_state.store(Fiber::HOLD, std::memory_order_release);
             }
         }
         else
         {
+            if(ft)
+            {
+                FreeTask(ft);
+            }
             if(is_active)
             {
                 --m_activeThreadCount;
@@ -341,40 +792,901 @@ void Scheduler::run()
             if(idle_fiber->getState() == Fiber::TERM)
             {
                 SYLAR_LOG_INFO(g_logger) << "idle fiber term";
-                //说明已经退出
+                //说明已经退出，缓存的协程在本线程放掉，栈回到本线程的栈缓存
+                for(int i = 0; i < Fiber::STACK_CLASS_COUNT; ++i)
+                {
+                    self->fiberPool[i].clear();
+                }
+                self->poolCached.store(0, std::memory_order_relaxed);
+                self->stopUs.store(MonotonicUS(), std::memory_order_relaxed);
+                {
+                    Mutex::Lock lock(m_watchdogMutex);
+                    self->running = false;
+                }
+                t_yield_flag = nullptr;
+                t_worker_index = -1;
                 break;
             }
 
+            //先挂上空闲标记、空闲计数，再看一眼信箱跟全局队列，跟 submit 里先放再看标记（tickle 看的是空闲计数）对上
+            //不然可能刚看完是空的，别人就投进来了，又看到我没闲着不叫我，就一直睡过去了
+            //协程同步原语叫醒的协程要是还没切出去，会被放回全局队列，这时候最容易碰上
+            self->idle.store(true);
             //这个 ++ 是原子量
             ++m_idleThreadCount;
+            if(!self->inboxEmpty() || hasGlobalTasks())
+            {
+                --m_idleThreadCount;
+                self->idle.store(false);
+                continue;
+            }
+
+            uint64_t idle_start = MonotonicUS();
+            self->idleSinceUs.store(idle_start, std::memory_order_relaxed);
             idle_fiber->swapIn();
+            self->idleSinceUs.store(0, std::memory_order_relaxed);
+            OwnerAdd(self->idleUs, MonotonicUS() - idle_start);
             --m_idleThreadCount;
+            self->idle.store(false);
 
             if(idle_fiber->getState() != Fiber::TERM
                     && idle_fiber->getState() != Fiber::EXCEPT)
             {
-                idle_fiber->m_state = Fiber::HOLD;
+                idle_fiber->m_state.store(Fiber::HOLD, std::memory_order_release);
             }
         }
     }
 }
 
-void Scheduler::tickle()
+Scheduler::WorkerContext* Scheduler::getWorker(int thread)
 {
-    SYLAR_LOG_INFO(g_logger) << "tickle";
+    for(auto w : m_workers)
+    {
+        if(w->thread.load(std::memory_order_acquire) == thread)
+        {
+            return w;
+        }
+    }
+    return nullptr;
 }
 
-bool Scheduler::stopping()
+bool Scheduler::hasPendingTasks()
 {
-    // m_fibers 需要锁起来
-    MutexType::Lock lock(m_mutex);
+    WorkerContext* self = getLocalWorker();
+    if(self && !self->inboxEmpty())
+    {
+        return true;
+    }
+    if(hasGlobalTasks())
+    {
+        return true;
+    }
+    for(auto i : m_workers)
+    {
+        for(int j = 0; j < PRIORITY_COUNT; ++j)
+        {
+            if(!i->queue[j].empty())
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-    // SYLAR_LOG_INFO(g_logger) << "stopping ::" 
-    //         << m_autoStop << ", " 
-    //         << m_stopping << ", " 
-    //         << m_fibers.empty() << ", "
-    //         << m_activeThreadCount;
-    return m_autoStop && m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+bool Scheduler::hasLocalTasks()
+{
+    WorkerContext* self = getLocalWorker();
+    if(!self)
+    {
+        return false;
+    }
+    if(!self->inboxEmpty())
+    {
+        return true;
+    }
+    for(int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        if(!self->queue[i].empty())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::recordSpin(uint64_t spin_us, bool hit)
+{
+    WorkerContext* self = getLocalWorker();
+    if(!self)
+    {
+        return;
+    }
+    OwnerAdd(self->spinUs, spin_us);
+    if(hit)
+    {
+        OwnerAdd(self->spinHits, 1);
+    }
+    else
+    {
+        OwnerAdd(self->spinMisses, 1);
+    }
+}
+
+bool Scheduler::hasGlobalTasks()
+{
+    for(int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        if(m_fibers[i].size.load())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+Scheduler::WorkerContext* Scheduler::getLocalWorker()
+{
+    if(t_scheduler != this || t_worker_index < 0)
+    {
+        return nullptr;
+    }
+    return m_workers[t_worker_index];
+}
+
+Scheduler::FiberAndThread* Scheduler::takeTask(bool& tickle_me)
+{
+    WorkerContext* self = m_workers[t_worker_index];
+    //一轮里每个优先级有固定的额度，高的先取，额度用完了就轮到低的
+    //有额度的都没活干了（或者额度全用完了）就开新的一轮，这样谁都不会被饿死，也不会有活不干
+    bool exhausted = false;
+    for(int round = 0; round < 2; ++round)
+    {
+        for(int i = 0; i < PRIORITY_COUNT; ++i)
+        {
+            if(self->credit[i] <= 0)
+            {
+                exhausted = true;
+                continue;
+            }
+
+            FiberAndThread* task = takeTask(i, tickle_me);
+            if(task)
+            {
+                --self->credit[i];
+                return task;
+            }
+            if(tickle_me)
+            {
+                return nullptr;
+            }
+        }
+
+        //额度都还有，就是真没活了，不用再来一遍
+        if(!exhausted)
+        {
+            break;
+        }
+        for(int i = 0; i < PRIORITY_COUNT; ++i)
+        {
+            self->credit[i] = m_weights[i];
+        }
+    }
+    return nullptr;
+}
+
+Scheduler::FiberAndThread* Scheduler::takeTask(int prio, bool& tickle_me)
+{
+    WorkerContext* self = m_workers[t_worker_index];
+    //先看信箱，指定给我的只有我能跑
+    FiberAndThread* task = self->inbox[prio].pop();
+    if(task && task->fiber && task->fiber->getState() == Fiber::EXEC)
+    {
+        //还没切出去就被唤醒了，塞回信箱，信箱不空 run 就不会去 idle，转一圈再来
+        self->inbox[prio].push(task);
+        return nullptr;
+    }
+
+    if(!task && !self->queue[prio].empty())
+    {
+        task = self->queue[prio].pop();
+    }
+
+    //锁外面先看一眼，空的就不去抢锁了
+    if(!task && m_fibers[prio].size.load(std::memory_order_relaxed))
+    {
+        //在全局队列取出一个协程，要加锁
+        MutexType::Lock lock(m_mutex);
+        TaskList& list = m_fibers[prio];
+        FiberAndThread* prev = nullptr;
+        FiberAndThread* it = list.head;
+
+        while(it)
+        {
+            //说明是指定线程的，而且现在也不在这个线程上
+            //正常指定线程的都进信箱了，还在这里的只有 start 之前投进来、那时还不知道线程 id 的
+            //目标线程自己醒来会扫到，不用再到处 tickle 了
+            //还有一种是正在执行的，也不需要处理
+            if((it->thread != -1 && it->thread != sylar::GetThreadId())
+                    || (it->fiber && it->fiber->getState() == Fiber::EXEC))
+            {
+                prev = it;
+                it = it->next.load(std::memory_order_relaxed);
+                continue;
+            }
+
+            SYLAR_ASSERT(it->fiber || it->cb);
+            list.erase(prev, it);
+            return it;
+        }
+    }
+
+    if(!task)
+    {
+        //全局也没有，去别人那里偷。从下一个开始轮，不要大家都挤着偷第一个
+        size_t n = m_workers.size();
+        for(size_t i = 1; i < n && !task; ++i)
+        {
+            WorkStealQueue<FiberAndThread*>& queue = m_workers[(t_worker_index + i) % n]->queue[prio];
+            if(!queue.empty())
+            {
+                task = queue.steal();
+            }
+        }
+    }
+
+    if(task && task->fiber && task->fiber->getState() == Fiber::EXEC)
+    {
+        //还没切出去就被唤醒了，放回全局队列，跟上面一样等它切出去再说
+        MutexType::Lock lock(m_mutex);
+        m_fibers[prio].push_back(task);
+        tickle_me = true;
+        return nullptr;
+    }
+
+    return task;
+}
+
+//每个线程一条空闲节点链表，只有本线程碰，不用锁
+//在 A 线程分配、B 线程跑完的节点会还到 B 的链表里，所以要有上限，多了直接还给系统
+static const size_t s_task_cache_max = 4096;
+
+struct TaskCache
+{
+    void* head = nullptr;
+    size_t count = 0;
+
+    ~TaskCache()
+    {
+        while(head)
+        {
+            void* next = *(void**)head;
+            ::operator delete(head);
+            head = next;
+        }
+    }
+};
+
+static thread_local TaskCache t_task_cache;
+
+void* Scheduler::AllocTask()
+{
+    TaskCache& cache = t_task_cache;
+    if(cache.head)
+    {
+        void* p = cache.head;
+        cache.head = *(void**)p;
+        --cache.count;
+        return p;
+    }
+    return ::operator new(sizeof(FiberAndThread));
+}
+
+void Scheduler::FreeTask(FiberAndThread* ft)
+{
+    ft->~FiberAndThread();
+    TaskCache& cache = t_task_cache;
+    if(cache.count >= s_task_cache_max)
+    {
+        ::operator delete(ft);
+        return;
+    }
+    *(void**)ft = cache.head;
+    cache.head = ft;
+    ++cache.count;
+}
+
+bool Scheduler::rejecting()
+{
+    return m_draining && !t_drain_bypass && !getLocalWorker();
+}
+
+void Scheduler::rejectTask(FiberAndThread* ft)
+{
+    Scheduler* redirect = m_drainRedirect;
+    bool ok = false;
+    if(redirect && redirect != this)
+    {
+        ok = ft->run_inline ? redirect->scheduleInline(std::move(ft->cb), -1, ft->prio)
+                : redirect->schedule(std::move(ft->cb), -1, ft->prio, ft->stack);
+    }
+    ++(ok ? m_drainRedirected : m_drainRejected);
+    FreeTask(ft);
+}
+
+bool Scheduler::submit(FiberAndThread* ft)
+{
+    //排空的时候只拒外面来的新回调，协程是已经在跑的活被叫醒了，照收
+    if(ft->cb && rejecting())
+    {
+        rejectTask(ft);
+        return false;
+    }
+    stampTask(ft);
+    bool batching = t_batch_scheduler == this;
+    if(ft->thread != -1)
+    {
+        //指定了线程的，直接投到那个线程的信箱，那个线程闲着才叫醒它，也只叫醒它
+        WorkerContext* target = getWorker(ft->thread);
+        if(target)
+        {
+            target->inbox[ft->prio].push(ft);
+            //先放再看标记，run 里面是先挂标记再看信箱，两边总有一边能看到对方
+            if(target->idle.load())
+            {
+                tickleWorker(target->index);
+            }
+            return true;
+        }
+    }
+    else
+    {
+        //在自己的工作线程上提交的（任务里面再派生任务），直接放本地队列，不碰全局锁
+        WorkerContext* worker = getLocalWorker();
+        if(worker)
+        {
+            //本地队列原来是空的，又有人闲着，才叫人来偷。不然每次都 tickle 就太浪费了
+            //攒批的时候每个都算，最后一起叫
+            WorkStealQueue<FiberAndThread*>& queue = worker->queue[ft->prio];
+            bool need_tickle = batching || (queue.empty() && hasIdleThreads());
+            queue.push(ft);
+            if(need_tickle)
+            {
+                wakeup(1);
+            }
+            return true;
+        }
+    }
+
+    bool need_tickle = false;
+    {
+        MutexType::Lock lock(m_mutex);
+        //以前是没有任务的。放进去之后，就要唤醒线程了意味着
+        need_tickle = batching || m_fibers[ft->prio].empty();
+        m_fibers[ft->prio].push_back(ft);
+    }
+    if(need_tickle)
+    {
+        wakeup(1);
+    }
+    return true;
+}
+
+void Scheduler::submitBatch(FiberAndThread* head)
+{
+    if(rejecting())
+    {
+        //回调拒掉，协程留下来重新串起来
+        FiberAndThread* kept = nullptr;
+        FiberAndThread* tail = nullptr;
+        while(head)
+        {
+            FiberAndThread* next = head->next.load(std::memory_order_relaxed);
+            head->next.store(nullptr, std::memory_order_relaxed);
+            if(head->cb)
+            {
+                rejectTask(head);
+            }
+            else
+            {
+                if(tail)
+                {
+                    tail->next.store(head, std::memory_order_relaxed);
+                }
+                else
+                {
+                    kept = head;
+                }
+                tail = head;
+            }
+            head = next;
+        }
+        head = kept;
+        if(!head)
+        {
+            return;
+        }
+    }
+
+    size_t count = 0;
+    WorkerContext* worker = getLocalWorker();
+    if(worker)
+    {
+        while(head)
+        {
+            FiberAndThread* next = head->next.load(std::memory_order_relaxed);
+            stampTask(head);
+            worker->queue[head->prio].push(head);
+            head = next;
+            ++count;
+        }
+        //自己也会回来干活，少叫一个
+        if(t_batch_scheduler != this)
+        {
+            --count;
+        }
+    }
+    else
+    {
+        MutexType::Lock lock(m_mutex);
+        while(head)
+        {
+            FiberAndThread* next = head->next.load(std::memory_order_relaxed);
+            stampTask(head);
+            m_fibers[head->prio].push_back(head);
+            head = next;
+            ++count;
+        }
+    }
+    wakeup(count);
+}
+
+void Scheduler::wakeup(size_t count)
+{
+    if(t_batch_scheduler == this)
+    {
+        t_batch_count += count;
+        return;
+    }
+    if(count)
+    {
+        tickleIdle(count);
+    }
+}
+
+void Scheduler::beginBatch()
+{
+    SYLAR_ASSERT(t_batch_scheduler == nullptr);
+    t_batch_scheduler = this;
+    t_batch_count = 0;
+}
+
+void Scheduler::endBatch()
+{
+    SYLAR_ASSERT(t_batch_scheduler == this);
+    size_t count = t_batch_count;
+    t_batch_scheduler = nullptr;
+    t_batch_count = 0;
+
+    //在工作线程上攒的都进了本地队列，自己待会儿也会去拿，少叫一个
+    if(count && getLocalWorker())
+    {
+        --count;
+    }
+    if(count)
+    {
+        tickleIdle(count);
+    }
+}
+
+void Scheduler::tickle()
+{
+    SYLAR_LOG_INFO(g_logger) << "tickle";
+    recordTickle();
+}
+
+void Scheduler::recordTickle()
+{
+    WorkerContext* self = getLocalWorker();
+    if(self)
+    {
+        OwnerAdd(self->tickles, 1);
+    }
+    else
+    {
+        ++m_externalTickles;
+    }
+}
+
+void Scheduler::recordTickleSaved()
+{
+    WorkerContext* self = getLocalWorker();
+    if(self)
+    {
+        OwnerAdd(self->ticklesSaved, 1);
+    }
+    else
+    {
+        ++m_externalTicklesSaved;
+    }
+}
+
+int Scheduler::getWorkerIndex()
+{
+    WorkerContext* self = getLocalWorker();
+    return self ? (int)self->index : -1;
+}
+
+void Scheduler::watchdog()
+{
+    //每个工作线程上一次看到的任务数、从什么时候开始没变的、这个任务报过没有
+    struct WatchState
+    {
+        uint64_t tasks = 0;
+        uint64_t since = 0;
+        bool reported = false;
+    };
+    std::vector<WatchState> states(m_workers.size());
+
+    //检查的间隔是阈值的一半，误差不超过一个间隔
+    uint64_t tick = ~0ull;
+    if(m_watchdogMs)
+    {
+        tick = m_watchdogMs;
+    }
+    if(m_yieldSliceMs && m_yieldSliceMs < tick)
+    {
+        tick = m_yieldSliceMs;
+    }
+    tick = std::max<uint64_t>(tick / 2, 1);
+
+    while(!m_watchdogStop)
+    {
+        m_watchdogSem.waitFor(tick);
+        if(m_watchdogStop)
+        {
+            break;
+        }
+
+        uint64_t now = MonotonicUS();
+        Mutex::Lock lock(m_watchdogMutex);
+        for(size_t i = 0; i < m_workers.size(); ++i)
+        {
+            WorkerContext* w = m_workers[i];
+            WatchState& st = states[i];
+            //取到了新任务，或者闲着，或者根本没在跑，都重新计时
+            uint64_t tasks = w->tasks.load(std::memory_order_relaxed);
+            if(!w->running || w->idle.load(std::memory_order_relaxed)
+                    || tasks != st.tasks || !st.since)
+            {
+                st.tasks = tasks;
+                st.since = now;
+                st.reported = false;
+                continue;
+            }
+
+            uint64_t ms = (now - st.since) / 1000;
+            if(m_yieldSliceMs && ms >= m_yieldSliceMs)
+            {
+                w->yieldRequested.store(true, std::memory_order_relaxed);
+            }
+            if(m_watchdogMs && ms >= m_watchdogMs && !st.reported)
+            {
+                st.reported = true;
+                OwnerAdd(w->stalls, 1);
+                std::string bt = CaptureStack(w->pthread);
+                SYLAR_LOG_WARN(g_logger) << "scheduler " << m_name << " worker " << w->index
+                    << " thread=" << m_threadIds[w->index]
+                    << " task running " << ms << "ms without yielding"
+                    << (bt.empty() ? " (no backtrace)" : ", backtrace:\n") << bt;
+            }
+        }
+    }
+}
+
+void Scheduler::stampTask(FiberAndThread* ft)
+{
+    uint32_t rate = s_latency_sample;
+    if(rate && ++t_sample_tick >= rate)
+    {
+        t_sample_tick = 0;
+        ft->enqueue_us = MonotonicUS();
+    }
+    else
+    {
+        //节点是复用的，上一次的不能留着
+        ft->enqueue_us = 0;
+    }
+}
+
+void Scheduler::recordLatency(WorkerContext* self, FiberAndThread* ft)
+{
+    OwnerAdd(self->tasks, 1);
+    if(!ft->enqueue_us)
+    {
+        return;
+    }
+    uint64_t now = MonotonicUS();
+    uint64_t used = now > ft->enqueue_us ? now - ft->enqueue_us : 0;
+    int bucket = used ? 64 - __builtin_clzll(used) : 0;
+    if(bucket >= Metrics::LATENCY_BUCKETS)
+    {
+        bucket = Metrics::LATENCY_BUCKETS - 1;
+    }
+    OwnerAdd(self->latency[bucket], 1);
+}
+
+void Scheduler::tickleWorker(size_t index)
+{
+    tickle();
+}
+
+void Scheduler::tickleIdle(size_t count)
+{
+    size_t idle = m_idleThreadCount;
+    //自己在 idle 里派发任务的时候也算在闲着的里面，但自己不用叫
+    WorkerContext* self = getLocalWorker();
+    if(self && self->idle.load() && idle > 0)
+    {
+        --idle;
+    }
+    //闲着的数量只是个大概，可能有线程正要去 idle 还没 +1，所以至少叫一次，跟以前一样
+    size_t n = std::min(count, idle);
+    if(n == 0)
+    {
+        n = 1;
+    }
+    for(size_t i = 0; i < n; ++i)
+    {
+        tickle();
+    }
+}
+
+bool Scheduler::stopping()
+{
+    // SYLAR_LOG_INFO(g_logger) << "stopping ::" 
+    //         << m_autoStop << ", " 
+    //         << m_stopping << ", " 
+    //         << m_fibers.empty() << ", "
+    //         << m_activeThreadCount;
+    if(!(m_autoStop && m_stopping))
+    {
+        return false;
+    }
+    return Scheduler::quiescent();
+}
+
+bool Scheduler::quiescent()
+{
+    // m_fibers 需要锁起来
+    MutexType::Lock lock(m_mutex);
+    for(int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        if(!m_fibers[i].empty())
+        {
+            return false;
+        }
+    }
+
+    //本地队列是无锁的，只能看个大概。但拿任务之前 active 已经 +1 了
+    //所以先看队列再看 active，不会漏掉正在被拿走的任务
+    for(auto i : m_workers)
+    {
+        for(int j = 0; j < PRIORITY_COUNT; ++j)
+        {
+            if(!i->queue[j].empty() || !i->inbox[j].empty())
+            {
+                return false;
+            }
+        }
+    }
+    return m_activeThreadCount == 0;
+}
+
+size_t Scheduler::getQueueDepth(Priority prio)
+{
+    SYLAR_ASSERT(prio >= 0 && prio < PRIORITY_COUNT);
+    size_t depth = m_fibers[prio].size.load(std::memory_order_relaxed);
+    for(auto i : m_workers)
+    {
+        depth += i->queue[prio].size() + i->inbox[prio].size();
+    }
+    return depth;
+}
+
+Scheduler::Metrics Scheduler::getMetrics()
+{
+    Metrics m;
+    uint64_t now = MonotonicUS();
+    for(int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        size_t global = m_fibers[i].size.load(std::memory_order_relaxed);
+        m.global_depth += global;
+        m.queue_depth[i] = global;
+    }
+    m.tickles = m_externalTickles.load(std::memory_order_relaxed);
+    m.tickles_saved = m_externalTicklesSaved.load(std::memory_order_relaxed);
+
+    for(auto i : m_workers)
+    {
+        Metrics::Worker w;
+        w.index = i->index;
+        w.idle = i->idle.load(std::memory_order_relaxed);
+        w.tasks = i->tasks.load(std::memory_order_relaxed);
+        w.tickles = i->tickles.load(std::memory_order_relaxed);
+        w.tickles_saved = i->ticklesSaved.load(std::memory_order_relaxed);
+        w.stalls = i->stalls.load(std::memory_order_relaxed);
+        w.spin_us = i->spinUs.load(std::memory_order_relaxed);
+        w.spin_hits = i->spinHits.load(std::memory_order_relaxed);
+        w.spin_misses = i->spinMisses.load(std::memory_order_relaxed);
+        w.idle_us = i->idleUs.load(std::memory_order_relaxed);
+        uint64_t idle_since = i->idleSinceUs.load(std::memory_order_relaxed);
+        if(idle_since && now > idle_since)
+        {
+            w.idle_us += now - idle_since;
+        }
+        uint64_t start = i->startUs.load(std::memory_order_relaxed);
+        uint64_t stop = i->stopUs.load(std::memory_order_relaxed);
+        if(start)
+        {
+            uint64_t wall = (stop ? stop : now) - start;
+            w.busy_us = wall > w.idle_us ? wall - w.idle_us : 0;
+        }
+        for(int j = 0; j < PRIORITY_COUNT; ++j)
+        {
+            size_t n = i->queue[j].size() + i->inbox[j].size();
+            w.queued += n;
+            m.queue_depth[j] += n;
+        }
+        for(int j = 0; j < Metrics::LATENCY_BUCKETS; ++j)
+        {
+            m.latency[j] += i->latency[j].load(std::memory_order_relaxed);
+        }
+        m.tasks += w.tasks;
+        m.tickles += w.tickles;
+        m.tickles_saved += w.tickles_saved;
+        m.workers.push_back(w);
+    }
+    return m;
+}
+
+uint64_t Scheduler::Metrics::latencySamples() const
+{
+    uint64_t n = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        n += latency[i];
+    }
+    return n;
+}
+
+uint64_t Scheduler::Metrics::latencyPercentile(double p) const
+{
+    uint64_t total = latencySamples();
+    if(!total)
+    {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(total * p);
+    if(want >= total)
+    {
+        want = total - 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        seen += latency[i];
+        if(seen > want)
+        {
+            return 1ull << i;
+        }
+    }
+    return 1ull << (LATENCY_BUCKETS - 1);
+}
+
+std::string Scheduler::Metrics::toString() const
+{
+    std::stringstream ss;
+    ss << "tasks=" << tasks
+       << " tickles=" << tickles
+       << " saved=" << tickles_saved
+       << " depth=" << queue_depth[CRITICAL] << "/" << queue_depth[NORMAL] << "/" << queue_depth[BACKGROUND]
+       << " global=" << global_depth
+       << " latency_us p50<=" << latencyPercentile(0.5)
+       << " p99<=" << latencyPercentile(0.99)
+       << " samples=" << latencySamples();
+    for(auto& i : workers)
+    {
+        ss << std::endl << "    worker " << i.index
+           << (i.idle ? " idle" : " busy")
+           << " tasks=" << i.tasks
+           << " busy_us=" << i.busy_us
+           << " idle_us=" << i.idle_us
+           << " tickles=" << i.tickles
+           << " saved=" << i.tickles_saved
+           << " stalls=" << i.stalls
+           << " spin_us=" << i.spin_us
+           << " spin_hits=" << i.spin_hits
+           << " spin_misses=" << i.spin_misses
+           << " queued=" << i.queued;
+    }
+    return ss.str();
+}
+
+void Scheduler::runInline(Task& cb)
+{
+    //hook 关掉，里面万一有 IO、sleep 就阻塞线程，不会拿主协程去挂起
+    t_inline_task = true;
+    set_hook_enable(false);
+    try
+    {
+        cb();
+    }
+    catch(const std::exception& e)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "Inline task except: " << e.what()
+            << std::endl
+            << sylar::BacktraceToString();
+    }
+    catch(...)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "Inline task except";
+    }
+    //捕获的东西在这里放掉，还在 hook 关着的时候
+    cb = nullptr;
+    set_hook_enable(true);
+    t_inline_task = false;
+}
+
+Scheduler::FiberPoolStats Scheduler::getFiberPoolStats()
+{
+    FiberPoolStats stats;
+    for(auto i : m_workers)
+    {
+        stats.hits += i->poolHits.load(std::memory_order_relaxed);
+        stats.misses += i->poolMisses.load(std::memory_order_relaxed);
+        stats.cached += i->poolCached.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+Fiber::ptr Scheduler::takePooledFiber(WorkerContext* self, Task&& cb, Fiber::StackClass stack)
+{
+    std::vector<Fiber::ptr>& pool = self->fiberPool[stack];
+    if(!pool.empty())
+    {
+        Fiber::ptr fiber;
+        fiber.swap(pool.back());
+        pool.pop_back();
+        OwnerAdd(self->poolCached, -1);
+        OwnerAdd(self->poolHits, 1);
+        fiber->reset(std::move(cb));
+        return fiber;
+    }
+    OwnerAdd(self->poolMisses, 1);
+    return Fiber::ptr(new Fiber(std::move(cb), stack));
+}
+
+void Scheduler::returnPooledFiber(WorkerContext* self, Fiber::ptr& fiber)
+{
+    //还有别人拿着的（比如用户自己 new 的协程）不能拿来复用
+    Fiber::StackClass stack = fiber->getStackClass();
+    if(stack >= Fiber::STACK_CLASS_COUNT || fiber.use_count() != 1)
+    {
+        fiber.reset();
+        return;
+    }
+    std::vector<Fiber::ptr>& pool = self->fiberPool[stack];
+    if(pool.size() >= m_fiberPoolSize)
+    {
+        fiber.reset();
+        return;
+    }
+    //回调、协程局部变量先放掉，它们抓着的东西不要跟着协程在缓存里待着；上下文等拿出来 reset 的时候再初始化
+    fiber->m_cb = nullptr;
+    fiber->clearLocals();
+    pool.push_back(std::move(fiber));
+    OwnerAdd(self->poolCached, 1);
 }
 
 void Scheduler::idle()
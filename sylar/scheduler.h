@@ -3,9 +3,9 @@
 
 #include <memory>
 #include <vector>
-#include <list>
 #include "fiber.h"
 #include "thread.h"
+#include "lockfree_queue.h"
 #include <iostream>
 
 namespace sylar
@@ -15,6 +15,16 @@ public:
     typedef std::shared_ptr<Scheduler> ptr;
     typedef Mutex MutexType;
 
+    //任务的优先级，数字越小越优先
+    //不是绝对优先，按 scheduler.priority_weights 的权重轮着取，后台任务再多也饿不死前面的，反过来也一样
+    enum Priority
+    {
+        CRITICAL = 0,   //探活、控制类，要尽快跑的
+        NORMAL,         //默认
+        BACKGROUND,     //批处理之类的后台任务
+        PRIORITY_COUNT
+    };
+
     //use_caller 的意思是，如果是true，那么使用了 scheduler 的这条线程就会同时也被纳入这个调度器来
     Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "");
     //只是个基类
@@ -30,72 +40,198 @@ public:
     void start();
     void stop();
 
+    //当前线程正在跑的任务的优先级，不在任务里就是 NORMAL
+    static Priority GetCurrentPriority();
+
+    //fc 可以是 Fiber::ptr、Fiber::ptr*、std::function*（会被 swap 走）、Task，或者任意的可调用对象
+    //右值直接 move 进任务节点，48 字节以内的回调连同节点本身都不会走堆分配
+    //stack 是回调要用的栈档位，简单的回调用小栈就够了；直接给协程的话没用，协程自己有栈
+    //排空（drain）的时候外面提交的回调不收，返回 false（转给 redirect 的也是 false）
     template<class FiberOrCb>
-    void schedule(FiberOrCb fc, int thread = -1)
+    bool schedule(FiberOrCb&& fc, int thread = -1, Priority prio = NORMAL
+                    , Fiber::StackClass stack = Fiber::STACK_DEFAULT)
     {
-        bool need_tickle = false;
+        FiberAndThread* ft = NewTask(std::forward<FiberOrCb>(fc), thread, prio);
+        if(!ft)
         {
-            MutexType::Lock lock(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+            return false;
         }
+        ft->stack = stack;
+        return submit(ft);
+    }
 
-        if(need_tickle)
+    //不会让出去的短回调（定时器回调、计个数之类的），直接在调度器的主协程上跑，省掉切进切出协程
+    //回调里面不能 yield，debug 版让出去会断言；hook 在跑的时候是关掉的，IO、sleep 会直接阻塞线程
+    //同步原语在主协程上也会退回阻塞线程，所以也别在里面等锁。给的是协程的话照常切进去跑
+    template<class Cb>
+    bool scheduleInline(Cb&& cb, int thread = -1, Priority prio = NORMAL)
+    {
+        FiberAndThread* ft = NewTask(std::forward<Cb>(cb), thread, prio);
+        if(!ft)
         {
-            tickle();
+            return false;
         }
+        ft->run_inline = !ft->fiber;
+        return submit(ft);
     }
 
     //也支持批量放进去，锁一次，就能把要放进去的全放进去
+    //放了几个就按几个去叫闲着的线程，不会一堆任务只叫醒一个
     template<class InputIterator>
-    void schedule(InputIterator begin, InputIterator end)
+    void schedule(InputIterator begin, InputIterator end, Priority prio = NORMAL)
     {
-        bool need_tickle = false;
-        {
-            MutexType::Lock lock(m_mutex);
-            while(begin != end)
-            {
-                need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-                ++begin;
-            }
-        }
-        if(need_tickle)
-        {
-            tickle();
-        }
+        scheduleBatch(begin, end, prio, false);
     }
+
+    template<class InputIterator>
+    void scheduleInline(InputIterator begin, InputIterator end, Priority prio = NORMAL)
+    {
+        scheduleBatch(begin, end, prio, true);
+    }
+
+    //优雅退出的结果：排空期间拒了多少、转走多少，到 deadline 还有什么没做完被放弃了
+    struct DrainResult
+    {
+        bool clean = true;              //deadline 之前就都做完了
+        uint64_t used_ms = 0;
+        uint64_t rejected = 0;          //拒掉的新任务
+        uint64_t redirected = 0;        //转给别的调度器的新任务
+        size_t abandoned_tasks = 0;     //到 deadline 还排着、还在跑的任务，stop 里面会接着跑完
+        size_t cancelled_fds = 0;       //IOManager：到 deadline 还有人在等事件的 fd，cancelAll 掉了
+        size_t flushed_timers = 0;      //IOManager：到 deadline 还挂着的定时器，一次性的提前触发，循环的丢掉
+
+        std::string toString() const;
+    };
+
+    //代替 stop 的优雅退出，不能在本调度器自己的线程上调
+    //先不收外面新提交的回调（给了 redirect 就转过去），被叫醒接着跑的协程、工作线程自己派生的照收
+    //排着的、在跑的、在等事件和定时器的都做完了就 stop；到了 deadline 还没完，就放弃等事件和定时器再 stop
+    //use_caller 的话要在 caller 线程上调，等的时候本线程的那个 worker 也在跑，排空了或者到点了再回来
+    DrainResult drain(uint64_t timeout_ms, Scheduler* redirect = nullptr);
+    bool isDraining() const { return m_draining; }
+
+    //当前线程是不是正在跑 scheduleInline 的回调
+    static bool InInlineTask();
+    //看门狗觉得当前任务跑太久了，见 Fiber::ShouldYield
+    static bool ShouldYield();
+
+    //某个优先级还在排队的任务数（全局队列 + 各线程的本地队列、信箱），近似值，监控用
+    size_t getQueueDepth(Priority prio);
+
+    //跑完的回调协程缓存：拿到的算命中，只能新建的算没命中，cached 是现在各线程缓存着的总数
+    struct FiberPoolStats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t cached = 0;
+    };
+    //各线程加起来，近似值，调 scheduler.fiber_pool_size 用
+    FiberPoolStats getFiberPoolStats();
+
+    //运行时指标的快照。计数都是各线程自己记的，取快照只是把各线程的加起来，不拿锁，一直开着也没关系
+    struct Metrics
+    {
+        //排队延迟（schedule 到真正开始跑）的直方图，第 i 个桶是 [2^(i-1), 2^i) 微秒，第 0 个是不到 1 微秒
+        static const int LATENCY_BUCKETS = 32;
+
+        struct Worker
+        {
+            size_t index = 0;
+            bool idle = false;      //现在是不是在 idle 里
+            uint64_t tasks = 0;     //跑了多少个任务
+            uint64_t busy_us = 0;   //run 里面不在 idle 的时间
+            uint64_t idle_us = 0;   //在 idle 里的时间
+            uint64_t tickles = 0;   //这个线程发出去的 tickle
+            uint64_t tickles_saved = 0; //要叫的人已经有一次叫醒还没处理，这次就不用再发了
+            uint64_t stalls = 0;    //被看门狗抓到一个任务跑太久的次数
+            uint64_t spin_us = 0;   //去睡之前空转等活花掉的时间
+            uint64_t spin_hits = 0; //空转等到了活，省掉一次睡下去再被叫醒
+            uint64_t spin_misses = 0; //空转白转了，最后还是睡了
+            size_t queued = 0;      //本地队列 + 信箱里排着的
+        };
+
+        std::vector<Worker> workers;
+        //各优先级排着的，全局队列 + 各线程的
+        size_t queue_depth[PRIORITY_COUNT] = {0};
+        //其中全局队列里的
+        size_t global_depth = 0;
+        uint64_t tasks = 0;
+        //所有的 tickle，包括不在工作线程上发的
+        uint64_t tickles = 0;
+        uint64_t tickles_saved = 0;
+        uint64_t latency[LATENCY_BUCKETS] = {0};
+
+        uint64_t latencySamples() const;
+        //排队延迟第 p（0~1）分位落在的那个桶的上界，微秒，没有采样返回 0
+        uint64_t latencyPercentile(double p) const;
+        std::string toString() const;
+    };
+    Metrics getMetrics();
 protected:
     virtual void tickle();
+    //按任务数叫人：最多叫 count 个，也不超过现在闲着的线程数
+    virtual void tickleIdle(size_t count);
+    //只叫醒某一个工作线程（下标同 m_threadIds），默认做不到，就随便叫一个
+    virtual void tickleWorker(size_t index);
     void run();
     virtual bool stopping();
+    //没有排着的、在跑的任务了。子类还要算上在等的事件、定时器
+    virtual bool quiescent();
+    //drain 到了 deadline 还没排空：子类把等着的事件、定时器放弃掉，记进 result
+    virtual void abandonWork(DrainResult& result) {}
+    //use_caller 的线程正在 drain 里跑：排空了或者到了 deadline，该回 drain 去了
+    bool callerDrainDone();
+    //同上，正在 drain 里跑的话，睡觉不能睡过 deadline
+    uint64_t clampCallerDrain(uint64_t timeout_ms);
     virtual void idle(); //没任务做
+    //每轮调度（跑完一个任务、从 idle 回来）开头调一次：子类攒着还没交出去的东西（io_uring 的提交）在这里看要不要交
+    virtual void flushPending() {}
+    //真的发出去一次 tickle 的时候记一下，子类的 tickle 也要调
+    void recordTickle();
+    //要叫的人已经有一次没处理的叫醒，省掉了一次 tickle
+    void recordTickleSaved();
+    //当前线程在本调度器里的下标（同 m_threadIds），不是本调度器的工作线程返回 -1
+    int getWorkerIndex();
+    size_t getWorkerCount() const { return m_workers.size(); }
+    //看门狗线程：哪个工作线程一个任务跑了太久，先让它 ShouldYield，再久就把它的栈打出来
+    void watchdog();
+    //有没有本线程能拿去跑的：自己的信箱、全局队列、能偷的别人的本地队列。不拿锁，idle 里空转的时候看
+    bool hasPendingTasks();
+    //本线程自己的信箱、本地队列里还有没有活，不看别人的
+    bool hasLocalTasks();
+    //记一次空转：转了多久，转到活了没有
+    void recordSpin(uint64_t spin_us, bool hit);
 
     void setThis();
 
+    //攒批：begin 到 end 之间本线程往本调度器 schedule 的任务先不叫人，只记个数
+    //end 的时候按数量一次叫醒，idle 里一口气派发一堆 epoll 事件、定时器的时候用
+    //不能嵌套，只对当前线程有效
+    void beginBatch();
+    void endBatch();
+
     bool hasIdleThreads() { return m_idleThreadCount > 0; }
-private:
-    //无锁，模板类实现构造重载，妙
-    template<class FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, int thread)
-    {
-        bool need_tickle = m_fibers.empty();
-        FiberAndThread ft(fc, thread);
-        if(ft.fiber || ft.cb)
-        {
-            m_fibers.push_back(ft);
-        }
 
-        //以前是没有任务的。放进去之后，就要唤醒线程了意味着
-        return need_tickle;
-    }
+    //scheduler.affinity 是 numa:N 的时候，整个调度器的内存都应该放在 N 上，否则 -1
+    int getMemoryNode() const { return m_memoryNode; }
 private:
+    //任务节点，同时也是队列的侵入式节点
     struct FiberAndThread
     {
         Fiber::ptr fiber;
-        std::function<void()> cb;
+        Task cb;
         int thread; // 线程id，指定在这个线程上跑
+        Priority prio = NORMAL;
+        Fiber::StackClass stack = Fiber::STACK_DEFAULT;
+        //回调不进协程，直接在调度器的主协程上跑
+        bool run_inline = false;
+        //被抽中量排队延迟的，记下放进来的时间（单调时钟，微秒），没抽中是 0
+        uint64_t enqueue_us = 0;
+        //挂在全局链表、线程信箱里的时候用
+        std::atomic<FiberAndThread*> next = {nullptr};
 
         FiberAndThread(Fiber::ptr f, int thr)
-            :fiber(f), thread(thr)
+            :fiber(std::move(f)), thread(thr)
         {
 
         }
@@ -107,40 +243,252 @@ private:
             fiber.swap(*f);
         }
 
-        FiberAndThread(std::function<void()> f, int thr)
-            :cb(f), thread(thr)
+        FiberAndThread(std::function<void()>* f, int thr)
+            :thread(thr)
+        {
+            //给的如果是指针，也swap（std::function 本身能放进 Task 的内联空间里）
+            if(*f)
+            {
+                cb = Task(std::move(*f));
+                *f = nullptr;
+            }
+        }
+
+        FiberAndThread(Task* f, int thr)
+            :cb(std::move(*f)), thread(thr)
         {
 
         }
 
-        FiberAndThread(std::function<void()>* f, int thr)
-            :thread(thr)
+        //其他的可调用对象，包括 Task 的右值
+        template<class F>
+        FiberAndThread(F&& f, int thr)
+            :cb(std::forward<F>(f)), thread(thr)
         {
-            //给的如果是指针，也swap
-            cb.swap(*f);
+
         }
 
-        //stl 的容器一定要有默认构造函数。否则预分配出来的对象是无法初始化的
+        //信箱的 stub 节点要用
         FiberAndThread()
             :thread(-1)
         {
 
         }
+    private:
+        FiberAndThread(const FiberAndThread&) = delete;
+        FiberAndThread& operator=(const FiberAndThread&) = delete;
+    };
+
+    //全局队列，锁里面用的，侵入式单链表，不用每次分配 list 节点
+    struct TaskList
+    {
+        FiberAndThread* head = nullptr;
+        FiberAndThread* tail = nullptr;
+        //锁外面也会读一下，看看有没有必要去拿锁
+        std::atomic<size_t> size = {0};
+
+        bool empty() const { return head == nullptr; }
+
+        void push_back(FiberAndThread* ft)
+        {
+            ft->next.store(nullptr, std::memory_order_relaxed);
+            if(tail)
+            {
+                tail->next.store(ft, std::memory_order_relaxed);
+            }
+            else
+            {
+                head = ft;
+            }
+            tail = ft;
+            ++size;
+        }
+
+        //prev 是 ft 的前一个，ft 是头的话传空
+        void erase(FiberAndThread* prev, FiberAndThread* ft)
+        {
+            FiberAndThread* next = ft->next.load(std::memory_order_relaxed);
+            if(prev)
+            {
+                prev->next.store(next, std::memory_order_relaxed);
+            }
+            else
+            {
+                head = next;
+            }
+            if(tail == ft)
+            {
+                tail = prev;
+            }
+            --size;
+        }
+    };
 
-        void reset()
+    //每个工作线程一份，下标跟 m_threadIds 一一对应
+    //队列都按优先级分开放
+    struct WorkerContext
+    {
+        size_t index = 0;
+        //跑在哪个线程上（线程 id，没在跑是 -1）。start 里拿着 m_mutex 填，stop 等线程退出以后清掉，getWorker 不拿锁读
+        std::atomic<int> thread = {-1};
+        //本线程派生的任务，自己从尾巴拿，别人从头偷
+        WorkStealQueue<FiberAndThread*> queue[PRIORITY_COUNT];
+        //指定在本线程跑的任务，谁都能投，只有本线程取，别人不用再扫一遍
+        MpscQueue<FiberAndThread> inbox[PRIORITY_COUNT];
+        //这一轮每个优先级还能取几个，只有本线程碰
+        int credit[PRIORITY_COUNT] = {0};
+        //准备去 idle 了，投信的人看到才需要叫醒它
+        std::atomic<bool> idle = {false};
+        //要绑的 cpu（空的就不绑）跟内存优先放的 NUMA 节点（-1 不管），run 一进来就设置
+        std::vector<int> cpus;
+        int node = -1;
+        //跑完的协程按栈档位缓存着，下一个回调 reset 一下接着用，只有本线程碰
+        std::vector<Fiber::ptr> fiberPool[Fiber::STACK_CLASS_COUNT];
+        //统计只有本线程写，别的线程读个大概
+        std::atomic<uint64_t> poolHits = {0};
+        std::atomic<uint64_t> poolMisses = {0};
+        std::atomic<size_t> poolCached = {0};
+        //运行时指标，同样只有本线程写
+        std::atomic<uint64_t> tasks = {0};
+        std::atomic<uint64_t> tickles = {0};
+        std::atomic<uint64_t> ticklesSaved = {0};
+        std::atomic<uint64_t> latency[Metrics::LATENCY_BUCKETS];
+        //进 run 的时间、退出 run 的时间（还在跑是 0）、累计 idle 时间、这次进 idle 的时间（不在 idle 是 0）
+        std::atomic<uint64_t> startUs = {0};
+        std::atomic<uint64_t> stopUs = {0};
+        std::atomic<uint64_t> idleUs = {0};
+        std::atomic<uint64_t> idleSinceUs = {0};
+        //看门狗用的：线程句柄、是不是还在 run 里（退出的时候拿着 m_watchdogMutex 清掉）
+        pthread_t pthread = 0;
+        bool running = false;
+        //看门狗写，本线程取下一个任务的时候清掉
+        std::atomic<bool> yieldRequested = {false};
+        //看门狗写
+        std::atomic<uint64_t> stalls = {0};
+        //空转的统计，本线程写
+        std::atomic<uint64_t> spinUs = {0};
+        std::atomic<uint64_t> spinHits = {0};
+        std::atomic<uint64_t> spinMisses = {0};
+
+        WorkerContext()
         {
-            fiber = nullptr;
-            cb = nullptr;
-            thread = -1;
+            for(int i = 0; i < Metrics::LATENCY_BUCKETS; ++i)
+            {
+                latency[i] = 0;
+            }
+        }
+
+        bool inboxEmpty() const
+        {
+            for(int i = 0; i < PRIORITY_COUNT; ++i)
+            {
+                if(!inbox[i].empty())
+                {
+                    return false;
+                }
+            }
+            return true;
         }
     };
-    
+
+    template<class InputIterator>
+    void scheduleBatch(InputIterator begin, InputIterator end, Priority prio, bool run_inline)
+    {
+        //先串成一条链，再一次交出去
+        FiberAndThread* head = nullptr;
+        FiberAndThread* tail = nullptr;
+        while(begin != end)
+        {
+            FiberAndThread* ft = NewTask(&*begin, -1, prio);
+            ++begin;
+            if(!ft)
+            {
+                continue;
+            }
+            ft->run_inline = run_inline && !ft->fiber;
+            if(tail)
+            {
+                tail->next.store(ft, std::memory_order_relaxed);
+            }
+            else
+            {
+                head = ft;
+            }
+            tail = ft;
+        }
+
+        if(head)
+        {
+            submitBatch(head);
+        }
+    }
+
+    //在当前（主协程）上直接把回调跑完
+    void runInline(Task& cb);
+    //按 scheduler.latency_sample 抽一部分任务记下放进来的时间
+    void stampTask(FiberAndThread* ft);
+    //取出来要跑了，抽中的记一下排队延迟
+    void recordLatency(WorkerContext* self, FiberAndThread* ft);
+
+    //节点内存从本线程的空闲链表拿，拿不到才去 new；用完还回当前线程的空闲链表
+    static void* AllocTask();
+    static void FreeTask(FiberAndThread* ft);
+
+    template<class FiberOrCb>
+    static FiberAndThread* NewTask(FiberOrCb&& fc, int thread, Priority prio)
+    {
+        FiberAndThread* ft = new (AllocTask()) FiberAndThread(std::forward<FiberOrCb>(fc), thread);
+        if(!ft->fiber && !ft->cb)
+        {
+            FreeTask(ft);
+            return nullptr;
+        }
+        ft->prio = prio;
+        return ft;
+    }
+
+    //把任务交出去：指定线程的进信箱，工作线程自己派生的进本地队列，其他的进全局队列
+    //要叫人的话里面顺便就叫了。排空的时候拒掉的返回 false
+    bool submit(FiberAndThread* ft);
+    //排空中，当前线程提交的回调要不要拒（转）掉
+    bool rejecting();
+    //拒掉一个回调任务：有 redirect 就转过去，节点放掉
+    void rejectTask(FiberAndThread* ft);
+    //一串没指定线程的任务（用 next 串起来）
+    void submitBatch(FiberAndThread* head);
+    //要叫醒 count 个线程，攒批的时候先记下来
+    void wakeup(size_t count);
+
+    //按 scheduler.affinity 给每个工作线程分好 cpu 跟 NUMA 节点
+    void initAffinity();
+
+    //当前线程是本调度器的工作线程（在 run 里面），才有本地队列
+    WorkerContext* getLocalWorker();
+    //线程 id 对应的工作线程，不是本调度器的线程返回空。工作线程就那么几个，直接扫 m_workers
+    WorkerContext* getWorker(int thread);
+    //从本线程的缓存里拿一个协程跑 cb，没有就新建
+    Fiber::ptr takePooledFiber(WorkerContext* self, Task&& cb, Fiber::StackClass stack);
+    //跑完的协程放回缓存，满了或者不是按档位分的栈就直接放掉
+    void returnPooledFiber(WorkerContext* self, Fiber::ptr& fiber);
+    //全局队列里还有没有东西，去 idle 之前最后看一眼，不用拿锁
+    bool hasGlobalTasks();
+    //按权重挑一个优先级，再从这个优先级里取
+    FiberAndThread* takeTask(bool& tickle_me);
+    //取某个优先级的任务：信箱 -> 本地队列 -> 全局队列 -> 偷别人的
+    FiberAndThread* takeTask(int prio, bool& tickle_me);
 private:
     MutexType m_mutex;
     //线程池
     std::vector<Thread::ptr> m_threads;
     //正在执行的协程，未必是 fiber 对象哦。比如functional
-    std::list<FiberAndThread> m_fibers;
+    //现在只放外部线程提交的和指定了线程的，工作线程自己派生的走 m_workers 的本地队列
+    TaskList m_fibers[PRIORITY_COUNT];
+    std::vector<WorkerContext*> m_workers;
+    //每一轮各优先级能取几个，构造的时候从配置读
+    int m_weights[PRIORITY_COUNT];
+    int m_memoryNode = -1;
+    //每个线程每种栈档位最多缓存几个跑完的协程，构造的时候从配置读
+    size_t m_fiberPoolSize = 0;
     Fiber::ptr m_rootFiber; //主协程
     std::string m_name;
 
@@ -149,6 +497,24 @@ protected:
     size_t m_threadCount = 0;
     std::atomic<size_t> m_activeThreadCount = {0}; //原子量，保证线程安全
     std::atomic<size_t> m_idleThreadCount = {0};
+    //不在工作线程上发的 tickle，工作线程上的记在各自的 WorkerContext 里
+    std::atomic<uint64_t> m_externalTickles = {0};
+    std::atomic<uint64_t> m_externalTicklesSaved = {0};
+    //看门狗，scheduler.watchdog_ms、scheduler.yield_slice_ms 都是 0（默认）的时候不开
+    Thread::ptr m_watchdog;
+    Semaphore m_watchdogSem;
+    std::atomic<bool> m_watchdogStop = {false};
+    //看门狗给工作线程发信号的时候拿着，工作线程退出的时候也要拿，保证不会发给已经没了的线程
+    Mutex m_watchdogMutex;
+    uint64_t m_watchdogMs = 0;
+    uint64_t m_yieldSliceMs = 0;
+    //drain 开始之后就是 true，外面新提交的回调拒掉或者转到 m_drainRedirect
+    std::atomic<bool> m_draining = {false};
+    Scheduler* m_drainRedirect = nullptr;
+    //use_caller 的 drain 在驱动主协程跑的时候是 deadline，平时是 0。只有 caller 线程读写
+    uint64_t m_callerDrainDeadline = 0;
+    std::atomic<uint64_t> m_drainRejected = {0};
+    std::atomic<uint64_t> m_drainRedirected = {0};
     bool m_stopping = true;
     bool m_autoStop = false; //是否主动停止
     int m_rootThread = 0; //use_caller 的thread
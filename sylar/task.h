@@ -0,0 +1,192 @@
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+//调度器里跑的回调
+//std::function 只有 16 个字节的内联空间，lambda 多抓两个变量就要去堆上分配
+//schedule 又是最热的路径，所以自己搞一个只能 move 的版本，48 字节以内的都直接放在对象里面
+
+#include <new>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include <typeinfo>
+#include <stddef.h>
+
+namespace sylar
+{
+
+class Task
+{
+public:
+    //内联空间，够放 std::function（32）或者抓了 6 个指针的 lambda
+    static const size_t INLINE_SIZE = 48;
+
+    Task() {}
+    Task(std::nullptr_t) {}
+
+    template<class F, class = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f)
+    {
+        if(IsNull(f))
+        {
+            return;
+        }
+        init<typename std::decay<F>::type>(std::forward<F>(f)
+                , std::integral_constant<bool, IsInline<typename std::decay<F>::type>()>());
+    }
+
+    Task(Task&& o)
+    {
+        moveFrom(o);
+    }
+
+    Task& operator=(Task&& o)
+    {
+        if(this != &o)
+        {
+            reset();
+            moveFrom(o);
+        }
+        return *this;
+    }
+
+    Task& operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    ~Task()
+    {
+        reset();
+    }
+
+    void operator()()
+    {
+        m_ops->invoke(m_buf);
+    }
+
+    explicit operator bool() const { return m_ops != nullptr; }
+
+    void swap(Task& o)
+    {
+        Task tmp(std::move(o));
+        o = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    void reset()
+    {
+        if(m_ops)
+        {
+            m_ops->destroy(m_buf);
+            m_ops = nullptr;
+        }
+    }
+
+    //有没有放在对象里，测试用
+    bool isInline() const { return m_ops && m_ops->inlined; }
+
+    //回调的类型名（没 demangle 过），统计用来区分是哪个地方丢进来的回调
+    //std::function 包着的取里面真正的类型
+    const char* name() const { return m_ops ? m_ops->name(m_buf) : ""; }
+private:
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    struct Ops
+    {
+        void (*invoke)(void*);
+        //把 src 挪到 dst 并析构 src
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void*);
+        const char* (*name)(const void*);
+        bool inlined;
+    };
+
+    template<class F>
+    static constexpr bool IsInline()
+    {
+        return sizeof(F) <= INLINE_SIZE
+            && alignof(F) <= alignof(max_align_t)
+            && std::is_nothrow_move_constructible<F>::value;
+    }
+
+    template<class F>
+    static bool IsNull(const F&) { return false; }
+    static bool IsNull(const std::function<void()>& f) { return !f; }
+    static bool IsNull(void (*f)()) { return !f; }
+
+    template<class F>
+    static const char* SiteName(const F&) { return typeid(F).name(); }
+    static const char* SiteName(const std::function<void()>& f) { return f.target_type().name(); }
+
+    //放在对象里的
+    template<class F>
+    struct InlineOps
+    {
+        static void Invoke(void* p) { (*(F*)p)(); }
+        static void Move(void* dst, void* src)
+        {
+            new (dst) F(std::move(*(F*)src));
+            ((F*)src)->~F();
+        }
+        static void Destroy(void* p) { ((F*)p)->~F(); }
+        static const char* Name(const void* p) { return SiteName(*(const F*)p); }
+        static const Ops* Get()
+        {
+            static const Ops s_ops = {&Invoke, &Move, &Destroy, &Name, true};
+            return &s_ops;
+        }
+    };
+
+    //太大了，只能放堆上，buffer 里面存指针
+    template<class F>
+    struct HeapOps
+    {
+        static void Invoke(void* p) { (**(F**)p)(); }
+        static void Move(void* dst, void* src)
+        {
+            *(F**)dst = *(F**)src;
+        }
+        static void Destroy(void* p) { delete *(F**)p; }
+        static const char* Name(const void* p) { return SiteName(**(F* const*)p); }
+        static const Ops* Get()
+        {
+            static const Ops s_ops = {&Invoke, &Move, &Destroy, &Name, false};
+            return &s_ops;
+        }
+    };
+
+    template<class F, class U>
+    void init(U&& f, std::true_type)
+    {
+        new (m_buf) F(std::forward<U>(f));
+        m_ops = InlineOps<F>::Get();
+    }
+
+    template<class F, class U>
+    void init(U&& f, std::false_type)
+    {
+        *(F**)m_buf = new F(std::forward<U>(f));
+        m_ops = HeapOps<F>::Get();
+    }
+
+    void moveFrom(Task& o)
+    {
+        m_ops = o.m_ops;
+        if(m_ops)
+        {
+            m_ops->move(m_buf, o.m_buf);
+            o.m_ops = nullptr;
+        }
+    }
+private:
+    const Ops* m_ops = nullptr;
+    alignas(max_align_t) unsigned char m_buf[INLINE_SIZE];
+};
+
+}
+
+#endif
@@ -2,6 +2,8 @@
 #include "log.h"
 #include "util.h"
 #include "iostream"
+#include <errno.h>
+#include <time.h>
 
 namespace sylar {
 
@@ -37,6 +39,34 @@ void Semaphore::wait()
     }
 }
 
+bool Semaphore::waitFor(uint64_t timeout_ms)
+{
+    //sem_timedwait 要的是绝对时间
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000)
+    {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    while(sem_timedwait(&m_semaphore, &ts))
+    {
+        if(errno == EINTR)
+        {
+            continue;
+        }
+        if(errno == ETIMEDOUT)
+        {
+            return false;
+        }
+        throw std::logic_error("sem_timedwait error");
+    }
+    return true;
+}
+
 void Semaphore::notify()
 {
     if(sem_post(&m_semaphore))
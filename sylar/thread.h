@@ -29,6 +29,8 @@ public:
 
     //常用比如消息队列，工作线程去wait
     void wait(); // -1
+    //最多等 timeout_ms，超时返回 false
+    bool waitFor(uint64_t timeout_ms);
     void notify(); // +1
 
 private:
@@ -1,8 +1,151 @@
 #include "timer.h"
 #include "util.h"
+#include "config.h"
+#include <string.h>
+#include <algorithm>
 
 namespace sylar {
 
+//socket 超时这种加了基本都会被取消的，有序 set 每次都要分配节点、O(log n)；时间轮加、删都是 O(1)
+static ConfigVar<bool>::ptr g_timer_wheel =
+    Config::Lookup<bool>("timer.wheel", true, "keep timers in a hierarchical timing wheel instead of an ordered set");
+
+//每级 1024 个桶，毫秒轮一个桶 1ms，秒轮一个桶 1024ms
+static const uint32_t s_wheelBits = 10;
+static const uint64_t s_wheelSlots = 1ull << s_wheelBits;
+static const uint64_t s_wheelMask = s_wheelSlots - 1;
+//秒轮转一圈的毫秒数，再远的放溢出桶，每转一圈重新挂一次
+static const uint64_t s_wheelSpan = s_wheelSlots << s_wheelBits;
+static const int s_overflowBucket = 2 * s_wheelSlots;
+static const int s_dueBucket = s_overflowBucket + 1;
+
+//bits 是一级轮的 16 个字，从 from 号桶开始绕一圈找第一个不空的，返回往后数了几个桶，全空的返回 -1
+static int FindSlot(const uint64_t* bits, uint32_t from)
+{
+    uint32_t first = from >> 6;
+    for(uint32_t i = 0; i <= 16; ++i)
+    {
+        uint32_t w = (first + i) & 15;
+        uint64_t word = bits[w];
+        if(i == 0)
+        {
+            word &= ~0ull << (from & 63);
+        }
+        else if(i == 16)
+        {
+            //绕回来了，只剩 from 前面那几个
+            word &= (1ull << (from & 63)) - 1;
+        }
+        if(word)
+        {
+            uint32_t slot = w * 64 + __builtin_ctzll(word);
+            return (slot - from) & s_wheelMask;
+        }
+    }
+    return -1;
+}
+
+//定时器连同 shared_ptr 的控制块一次分配，放掉的块留在本线程的空闲链表上，下次加的时候直接拿
+//读超时这种加了马上又取消的，new/delete 两次比挂上、摘下来还贵
+template<class T>
+class TimerAllocator
+{
+public:
+    typedef T value_type;
+    template<class U>
+    struct rebind
+    {
+        typedef TimerAllocator<U> other;
+    };
+
+    TimerAllocator() {}
+    template<class U>
+    TimerAllocator(const TimerAllocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        FreeList* list = GetFreeList();
+        if(n == 1 && list && list->head)
+        {
+            Block* b = list->head;
+            list->head = b->next;
+            --list->count;
+            return (T*)b;
+        }
+        return (T*)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        FreeList* list = GetFreeList();
+        if(n == 1 && list && list->count < s_maxCached)
+        {
+            Block* b = (Block*)p;
+            b->next = list->head;
+            list->head = b;
+            ++list->count;
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    template<class U, class... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new((void*)p) U(std::forward<Args>(args)...);
+    }
+
+    template<class U>
+    void destroy(U* p)
+    {
+        p->~U();
+    }
+private:
+    static const size_t s_maxCached = 4096;
+
+    struct Block
+    {
+        Block* next;
+    };
+
+    //线程退出的时候链表先放掉了，之后再来释放的直接 delete
+    struct FreeList
+    {
+        Block* head = nullptr;
+        size_t count = 0;
+        bool destroyed = false;
+
+        ~FreeList()
+        {
+            while(head)
+            {
+                Block* b = head;
+                head = b->next;
+                ::operator delete(b);
+            }
+            destroyed = true;
+        }
+    };
+
+    static FreeList* GetFreeList()
+    {
+        static thread_local FreeList s_list;
+        return s_list.destroyed ? nullptr : &s_list;
+    }
+};
+
+template<class T, class U>
+bool operator==(const TimerAllocator<T>&, const TimerAllocator<U>&)
+{
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const TimerAllocator<T>&, const TimerAllocator<U>&)
+{
+    return false;
+}
+
 bool Timer::Comparator::operator()(const Timer::ptr& lhs
                             , const Timer::ptr& rhs) const 
 {
@@ -37,10 +180,11 @@ bool Timer::Comparator::operator()(const Timer::ptr& lhs
 }
 
 Timer::Timer(uint64_t ms, std::function<void()> cb,
-                bool recurring, TimerManager* manager)
+                bool recurring, TimerManager* manager, bool run_inline)
         :m_recurring(recurring)
+        ,m_inline(run_inline)
         ,m_ms(ms)
-        ,m_cb(cb)
+        ,m_cb(std::move(cb))
         ,m_manager(manager)
 {
     //执行时间
@@ -56,12 +200,11 @@ Timer::Timer(uint64_t next)
 
 bool Timer::cancel()
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
     if(m_cb)
     {
         m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
+        m_manager->eraseTimer(this);
 
         return true;
     }
@@ -71,18 +214,15 @@ bool Timer::cancel()
 
 bool Timer::refresh()
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
     if(m_cb)
     {
-        m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if(it == m_manager->m_timers.end())
+        if(!m_manager->eraseTimer(this))
             //这种情况？cb 应该是空的？
             return false;
-        
-        m_manager->m_timers.erase(it);
+
         m_next = sylar::GetCurrentMS() + m_ms;
-        m_manager->m_timers.insert(shared_from_this());
+        m_manager->insertTimer(shared_from_this());
 
         return true;
     }
@@ -92,7 +232,7 @@ bool Timer::refresh()
 
 bool Timer::reset(uint64_t ms, bool from_now)
 {
-    TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
+    TimerManager::MutexType::Lock lock(m_manager->m_mutex);
     if(m_cb)
     {
         if(ms == m_ms && !from_now)
@@ -100,13 +240,10 @@ bool Timer::reset(uint64_t ms, bool from_now)
             return true;
         }
 
-        m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if(it == m_manager->m_timers.end())
+        if(!m_manager->eraseTimer(this))
             //这种情况？cb 应该是空的？
             return false;
-        
-        m_manager->m_timers.erase(it);
+
         uint64_t start = 0;
         if(from_now)
         {
@@ -129,18 +266,35 @@ bool Timer::reset(uint64_t ms, bool from_now)
 TimerManager::TimerManager()
 {
     m_previouseTime = sylar::GetCurrentMS();
+    m_wheel = g_timer_wheel->getValue();
+    if(m_wheel)
+    {
+        m_buckets.resize(s_dueBucket + 1, nullptr);
+        m_wheelTime = m_previouseTime;
+    }
+    memset(m_bits, 0, sizeof(m_bits));
 }
 
 TimerManager::~TimerManager()
 {
-
+    //轮上挂着的自己拿着自己的引用，摘下来才放得掉
+    if(m_wheel)
+    {
+        std::vector<Timer::ptr> timers;
+        for(int i = 0; i <= s_dueBucket; ++i)
+        {
+            wheelTake(i, timers);
+        }
+    }
 }
 
 Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb
-                        ,bool recurring)
+                        ,bool recurring
+                        ,bool run_inline)
 {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
-    RWMutexType::WriteLock lock(m_mutex);
+    Timer::ptr timer = std::allocate_shared<Timer>(TimerAllocator<Timer>()
+            , ms, std::move(cb), recurring, this, run_inline);
+    MutexType::Lock lock(m_mutex);
 
     addTimer(timer, lock);
 
@@ -160,14 +314,32 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
     //比较特殊的、条件定时器。用弱指针来做条件有效。比如定时清理某个对象，而当这个对象已经在外界释放时，就没必要继续了。
 Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
                         ,std::weak_ptr<void> weak_cond
-                        ,bool recurring)
+                        ,bool recurring
+                        ,bool run_inline)
 {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring, run_inline);
 }
 
 uint64_t TimerManager::getNextTimer()
 {
-    RWMutexType::ReadLock lock(m_mutex);
+    if(m_wheel)
+    {
+        //不拿锁：这边先把 m_frontTime 放到最大、清 m_tickled，再读 m_nextTick；
+        //addTimer 反过来先改 m_nextTick，再看 m_frontTime、m_tickled。新加的要么这里读得到，要么那边会去叫醒
+        m_frontTime.store(~0ull, std::memory_order_relaxed);
+        m_tickled.store(false, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t next = m_nextTick;
+        m_frontTime.store(next, std::memory_order_relaxed);
+        if(next == ~0ull)
+        {
+            return ~0ull;
+        }
+        uint64_t now_ms = sylar::GetCurrentMS();
+        return now_ms >= next ? 0 : next - now_ms;
+    }
+
+    MutexType::Lock lock(m_mutex);
     m_tickled = false;
     if(m_timers.empty())
     {
@@ -187,61 +359,136 @@ uint64_t TimerManager::getNextTimer()
 }
 
 void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs)
+{
+    listExpiredCb(cbs, cbs);
+}
+
+void TimerManager::listExpiredCb(std::vector<std::function<void()>>& cbs
+                        ,std::vector<std::function<void()>>& inline_cbs)
 {
     uint64_t now_ms = sylar::GetCurrentMS();
     std::vector<Timer::ptr> expired;
+    //没到点就不抢锁了（时间往回拨了的话要进去处理）
+    if(m_wheel && m_nextTick > now_ms && now_ms >= m_previouseTime)
     {
-        RWMutexType::ReadLock lock(m_mutex);
-        if(m_timers.empty())
-        {
-            return;
-        }
+        return;
     }
-    RWMutexType::WriteLock lock(m_mutex);
-
-    //时间前置
-    bool rollover = detectClockRollover(now_ms);
-    if(!rollover && (*m_timers.begin())->m_next > now_ms)
+    MutexType::Lock lock(m_mutex);
+    if(m_wheel ? !m_wheelCount : m_timers.empty())
     {
         return;
     }
 
-    Timer::ptr now_timer(new Timer(now_ms));
-    //下面是粗暴处理，如果往前调了，全部直接超时
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
-    while(it != m_timers.end() && (*it)->m_next == now_ms)
+    //时间前置
+    bool rollover = detectClockRollover(now_ms);
+    if(m_wheel)
     {
-        ++it;
+        if(rollover)
+        {
+            //跟 set 一样粗暴，全部当到期
+            for(int i = 0; i <= s_dueBucket; ++i)
+            {
+                wheelTake(i, expired);
+            }
+            m_wheelTime = now_ms + 1;
+        }
+        else
+        {
+            wheelAdvance(now_ms, expired);
+        }
+        wheelUpdateNext();
     }
+    else
+    {
+        if(!rollover && (*m_timers.begin())->m_next > now_ms)
+        {
+            return;
+        }
 
-    //插入
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    m_timers.erase(m_timers.begin(), it);
+        Timer::ptr now_timer(new Timer(now_ms));
+        //下面是粗暴处理，如果往前调了，全部直接超时
+        auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer);
+        while(it != m_timers.end() && (*it)->m_next == now_ms)
+        {
+            ++it;
+        }
+
+        //插入
+        expired.insert(expired.begin(), m_timers.begin(), it);
+        m_timers.erase(m_timers.begin(), it);
+    }
 
     //预开辟
     cbs.reserve(expired.size());
 
     for(auto& timer : expired)
     {
-        cbs.push_back(timer->m_cb);
         if(timer->m_recurring)
         {
+            (timer->m_inline ? inline_cbs : cbs).push_back(timer->m_cb);
             timer->m_next = now_ms + timer->m_ms;
-            m_timers.insert(timer);
+            insertTimer(timer);
         }
         else
         {
-            timer->m_cb = nullptr; //为了防止回调用了智能指针之类的东西，不置空的话引用计数不会  -1
+            //一次性的直接把回调挪走，置空也是为了防止回调用了智能指针之类的东西，不置空的话引用计数不会  -1
+            (timer->m_inline ? inline_cbs : cbs).push_back(std::move(timer->m_cb));
+            timer->m_cb = nullptr;
         }
     }
 }
 
-void TimerManager::addTimer(Timer::ptr val, RWMutexType::WriteLock& lock)
+size_t TimerManager::flushTimers(std::vector<std::function<void()>>& cbs
+                        ,std::vector<std::function<void()>>& inline_cbs)
 {
-    //pair, <是否成功, pos>
-    auto it = m_timers.insert(val).first;
-    //如果在最前，那就是最小的。需要通知唤醒，比如 epoll
-    bool at_front = (it == m_timers.begin()) && !m_tickled;
+    MutexType::Lock lock(m_mutex);
+    if(m_wheel ? !m_wheelCount : m_timers.empty())
+    {
+        return 0;
+    }
+    std::vector<Timer::ptr> timers;
+    if(m_wheel)
+    {
+        for(int i = 0; i <= s_dueBucket; ++i)
+        {
+            wheelTake(i, timers);
+        }
+        wheelUpdateNext();
+    }
+    else
+    {
+        timers.assign(m_timers.begin(), m_timers.end());
+        m_timers.clear();
+    }
+    size_t count = timers.size();
+    for(auto& timer : timers)
+    {
+        if(!timer->m_recurring)
+        {
+            (timer->m_inline ? inline_cbs : cbs).push_back(timer->m_cb);
+        }
+        //置空之后 cancel、reset 都会失败
+        timer->m_cb = nullptr;
+    }
+    return count;
+}
+
+void TimerManager::addTimer(Timer::ptr val, MutexType::Lock& lock)
+{
+    bool at_front = false;
+    if(m_wheel)
+    {
+        insertTimer(val);
+        //比 epoll 正在等的那个点还早，要叫醒
+        at_front = val->m_next < m_frontTime && !m_tickled;
+    }
+    else
+    {
+        //pair, <是否成功, pos>
+        auto it = m_timers.insert(val).first;
+        //如果在最前，那就是最小的。需要通知唤醒，比如 epoll
+        at_front = (it == m_timers.begin()) && !m_tickled;
+    }
     if(at_front)
     {
         m_tickled = true;
@@ -272,8 +519,211 @@ bool TimerManager::detectClockRollover(uint64_t now_ms)
 //判断非空
 bool TimerManager::hasTimer()
 {
-    RWMutexType::ReadLock lock(m_mutex);
-    return !m_timers.empty();
+    MutexType::Lock lock(m_mutex);
+    return m_wheel ? m_wheelCount > 0 : !m_timers.empty();
+}
+
+void TimerManager::insertTimer(const Timer::ptr& timer)
+{
+    if(m_wheel)
+    {
+        //空了一阵子的话轮停在那了，直接拨到现在，不然新的都挂到秒轮上去
+        if(!m_wheelCount)
+        {
+            m_wheelTime = std::max(m_wheelTime, sylar::GetCurrentMS());
+        }
+        wheelLink(timer);
+    }
+    else
+    {
+        m_timers.insert(timer);
+    }
+}
+
+bool TimerManager::eraseTimer(Timer* timer)
+{
+    if(m_wheel)
+    {
+        if(timer->m_bucket < 0)
+        {
+            return false;
+        }
+        int bucket = timer->m_bucket;
+        wheelUnlink(timer);
+        //m_nextTick 在这里改而不是 wheelUnlink 里：wheelAdvance 一路摘下来，最后算一次就够了
+        if(!m_wheelCount)
+        {
+            m_nextTick = ~0ull;
+        }
+        else if(!m_buckets[bucket] && wheelBucketTick(bucket) == m_nextTick)
+        {
+            wheelUpdateNext();
+        }
+        return true;
+    }
+
+    auto it = m_timers.find(timer->shared_from_this());
+    if(it == m_timers.end())
+    {
+        return false;
+    }
+    m_timers.erase(it);
+    return true;
+}
+
+void TimerManager::wheelLink(const Timer::ptr& timer)
+{
+    uint64_t next = timer->m_next;
+    int bucket = s_dueBucket;
+    if(next >= m_wheelTime)
+    {
+        uint64_t delta = next - m_wheelTime;
+        if(delta < s_wheelSlots)
+        {
+            bucket = next & s_wheelMask;
+        }
+        else if(delta < s_wheelSpan)
+        {
+            //到了这个桶那一秒的开头，再挂到毫秒轮上
+            bucket = s_wheelSlots + ((next >> s_wheelBits) & s_wheelMask);
+        }
+        else
+        {
+            bucket = s_overflowBucket;
+        }
+        if(bucket < s_overflowBucket)
+        {
+            m_bits[bucket >> 6] |= 1ull << (bucket & 63);
+        }
+    }
+    uint64_t tick = wheelBucketTick(bucket);
+    if(tick < m_nextTick)
+    {
+        m_nextTick = tick;
+    }
+
+    Timer* head = m_buckets[bucket];
+    timer->m_prev = nullptr;
+    timer->m_after = head;
+    if(head)
+    {
+        head->m_prev = timer.get();
+    }
+    m_buckets[bucket] = timer.get();
+    timer->m_bucket = bucket;
+    timer->m_self = timer;
+    ++m_wheelCount;
+}
+
+Timer::ptr TimerManager::wheelUnlink(Timer* timer)
+{
+    int bucket = timer->m_bucket;
+    if(timer->m_prev)
+    {
+        timer->m_prev->m_after = timer->m_after;
+    }
+    else
+    {
+        m_buckets[bucket] = timer->m_after;
+        if(!timer->m_after && bucket < s_overflowBucket)
+        {
+            m_bits[bucket >> 6] &= ~(1ull << (bucket & 63));
+        }
+    }
+    if(timer->m_after)
+    {
+        timer->m_after->m_prev = timer->m_prev;
+    }
+    timer->m_prev = timer->m_after = nullptr;
+    timer->m_bucket = -1;
+    --m_wheelCount;
+    return std::move(timer->m_self);
+}
+
+void TimerManager::wheelTake(int bucket, std::vector<Timer::ptr>& timers)
+{
+    while(m_buckets[bucket])
+    {
+        timers.push_back(wheelUnlink(m_buckets[bucket]));
+    }
+}
+
+uint64_t TimerManager::wheelNextTick() const
+{
+    uint64_t next = ~0ull;
+    int dist = FindSlot(m_bits, m_wheelTime & s_wheelMask);
+    if(dist >= 0)
+    {
+        next = m_wheelTime + dist;
+    }
+    //秒轮上的在它那一秒开头挪下来，从还没挪过的那一秒开始找
+    uint64_t sec = (m_wheelTime + s_wheelMask) >> s_wheelBits;
+    dist = FindSlot(m_bits + 16, sec & s_wheelMask);
+    if(dist >= 0)
+    {
+        next = std::min(next, (sec + dist) << s_wheelBits);
+    }
+    if(m_buckets[s_overflowBucket])
+    {
+        next = std::min(next, (m_wheelTime + s_wheelSpan - 1) / s_wheelSpan * s_wheelSpan);
+    }
+    return next;
+}
+
+uint64_t TimerManager::wheelBucketTick(int bucket) const
+{
+    if(bucket < (int)s_wheelSlots)
+    {
+        return m_wheelTime + ((bucket - m_wheelTime) & s_wheelMask);
+    }
+    if(bucket < s_overflowBucket)
+    {
+        uint64_t sec = (m_wheelTime + s_wheelMask) >> s_wheelBits;
+        return (sec + ((bucket - s_wheelSlots - sec) & s_wheelMask)) << s_wheelBits;
+    }
+    if(bucket == s_overflowBucket)
+    {
+        return (m_wheelTime + s_wheelSpan - 1) / s_wheelSpan * s_wheelSpan;
+    }
+    return 0;
+}
+
+void TimerManager::wheelUpdateNext()
+{
+    m_nextTick = m_buckets[s_dueBucket] ? 0 : wheelNextTick();
+}
+
+void TimerManager::wheelAdvance(uint64_t now_ms, std::vector<Timer::ptr>& expired)
+{
+    wheelTake(s_dueBucket, expired);
+    std::vector<Timer::ptr> cascade;
+    while(m_wheelTime <= now_ms)
+    {
+        //中间空着的毫秒直接跳过去
+        uint64_t tick = wheelNextTick();
+        if(tick > now_ms)
+        {
+            m_wheelTime = now_ms + 1;
+            break;
+        }
+        m_wheelTime = tick;
+        if((tick & s_wheelMask) == 0)
+        {
+            //一秒的开头，秒轮上这一秒的挪到毫秒轮；秒轮转完一圈，溢出的也重新挂一次
+            wheelTake(s_wheelSlots + ((tick >> s_wheelBits) & s_wheelMask), cascade);
+            if(tick % s_wheelSpan == 0)
+            {
+                wheelTake(s_overflowBucket, cascade);
+            }
+            for(auto& timer : cascade)
+            {
+                wheelLink(timer);
+            }
+            cascade.clear();
+        }
+        wheelTake(tick & s_wheelMask, expired);
+        m_wheelTime = tick + 1;
+    }
 }
 
 }
@@ -4,14 +4,18 @@
 #include <memory>
 #include <vector>
 #include <set>
+#include <atomic>
 #include "thread.h"
 
 namespace sylar {
 
 class TimerManager;
+template<class T> class TimerAllocator;
 class Timer : public std::enable_shared_from_this<Timer>
 {
 friend class TimerManager;
+//addTimer 用 allocate_shared 一次分配，要能调到私有的构造函数
+template<class T> friend class TimerAllocator;
 public:
     typedef std::shared_ptr<Timer> ptr;
     bool cancel();
@@ -19,14 +23,21 @@ public:
     bool reset(uint64_t ms, bool from_now);
 private:
     Timer(uint64_t ms, std::function<void()> cb,
-            bool recurring, TimerManager* manager);
+            bool recurring, TimerManager* manager, bool run_inline = false);
     Timer(uint64_t next);
 private:
     bool m_recurring = false;   //run every
+    bool m_inline = false;      //回调不会让出，到期了直接在调度器主协程上跑
     uint64_t m_ms = 0;          //interval
     uint64_t m_next = 0;        //next time active
     std::function<void()> m_cb;
     TimerManager* m_manager = nullptr;
+    //时间轮用：挂在哪个桶的双向链表上（-1 是没挂），取消直接摘，不用找
+    //挂着的时候自己拿一份自己的引用，摘下来就放掉
+    int m_bucket = -1;
+    Timer* m_prev = nullptr;
+    Timer* m_after = nullptr;
+    Timer::ptr m_self;
 private:
     struct Comparator
     {
@@ -39,34 +50,76 @@ class TimerManager
 {
 friend class Timer;
 public:
-    typedef RWMutex RWMutexType;
+    //加、取消、到期都要改轮子，读写锁的读那边只剩 hasTimer 了，换成普通的锁；
+    //getNextTimer 和 listExpiredCb 没到点的时候都不拿锁
+    typedef Mutex MutexType;
 
     TimerManager();
     //因为可能是被比如 iomanager 继承过去的
     virtual ~TimerManager();
 
+    //run_inline：回调保证不会让出（只是叫醒协程、取消事件之类的），到期了不用为它切协程
+    //见 Scheduler::scheduleInline
     Timer::ptr addTimer(uint64_t ms, std::function<void()> cb
-                        ,bool recurring = false);
+                        ,bool recurring = false
+                        ,bool run_inline = false);
     
     //比较特殊的、条件定时器。用弱指针来做条件有效。比如定时清理某个对象，而当这个对象已经在外界释放时，就没必要继续了。
     Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb
                         ,std::weak_ptr<void> weak_cond
-                        ,bool recurring = false);
+                        ,bool recurring = false
+                        ,bool run_inline = false);
     
     uint64_t getNextTimer();
     void listExpiredCb(std::vector<std::function<void()>>& cbs);
+    //run_inline 的定时器单独放到 inline_cbs 里
+    void listExpiredCb(std::vector<std::function<void()>>& cbs
+                        ,std::vector<std::function<void()>>& inline_cbs);
+    //不管到没到期，全部取出来：一次性的回调放进 cbs/inline_cbs 提前触发，循环的直接丢掉
+    //返回取出来的定时器个数，排空到了 deadline 的时候用
+    size_t flushTimers(std::vector<std::function<void()>>& cbs
+                        ,std::vector<std::function<void()>>& inline_cbs);
 protected:
     virtual void onTimerInsertedAtFront() = 0;
-    void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
+    void addTimer(Timer::ptr val, MutexType::Lock& lock);
     bool hasTimer();
 private:
     bool detectClockRollover(uint64_t now_ms);
+    //按用的哪种放进去、拿出来，都要拿着锁
+    void insertTimer(const Timer::ptr& timer);
+    bool eraseTimer(Timer* timer);
+
+    //时间轮：按 m_next 离 m_wheelTime 多远挂到毫秒轮、秒轮或者溢出的桶上
+    void wheelLink(const Timer::ptr& timer);
+    Timer::ptr wheelUnlink(Timer* timer);
+    //整个桶摘下来
+    void wheelTake(int bucket, std::vector<Timer::ptr>& timers);
+    //最早可能到期的那一毫秒，毫秒轮上是准的，秒轮、溢出的是个下界（到时候往下挪一级）。空的是 ~0ull
+    //要扫位图，平时用缓存的 m_nextTick
+    uint64_t wheelNextTick() const;
+    //这个桶要在哪一毫秒处理（跟 wheelNextTick 的算法一样）
+    uint64_t wheelBucketTick(int bucket) const;
+    //重新算 m_nextTick
+    void wheelUpdateNext();
+    //走到 now_ms，到期的放进 expired
+    void wheelAdvance(uint64_t now_ms, std::vector<Timer::ptr>& expired);
 private:
-    RWMutexType m_mutex;
+    MutexType m_mutex;
+    bool m_wheel = true;    //timer.wheel，false 是原来的有序 set
     //有序 set
     std::set<Timer::ptr, Timer::Comparator> m_timers;
-    bool m_tickled = false; //用来提升效率，多次添加比较短的定时器事，不用重复触发
-    uint64_t m_previouseTime = 0;
+    //两级时间轮，各 1024 个桶：毫秒轮一个桶 1ms，秒轮一个桶 1024ms（约 17 分钟一圈），再远的先放溢出桶
+    //最后一个桶放加进来的时候就已经过了点的
+    std::vector<Timer*> m_buckets;
+    uint64_t m_bits[32];        //哪些桶不空，前 16 个字是毫秒轮，后 16 个是秒轮
+    uint64_t m_wheelTime = 0;   //下一个要走的毫秒，之前的都处理过了
+    size_t m_wheelCount = 0;
+    //wheelNextTick 的缓存，到期桶不空的时候是 0。拿着锁在挂上、摘掉、往前走的时候更新，getNextTimer 直接读
+    std::atomic<uint64_t> m_nextTick = {~0ull};
+    //上次 getNextTimer 算出来的最早到期时间，比它早的新定时器才要叫醒 epoll。空闲的线程都会写
+    std::atomic<uint64_t> m_frontTime = {~0ull};
+    std::atomic<bool> m_tickled = {false}; //用来提升效率，多次添加比较短的定时器事，不用重复触发
+    std::atomic<uint64_t> m_previouseTime = {0};
 };
 }
 
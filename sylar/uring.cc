@@ -0,0 +1,226 @@
+#include "uring.h"
+
+#if SYLAR_HAVE_URING
+
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+namespace sylar
+{
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+static int UringSetup(unsigned entries, io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int UringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int UringRegister(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::Uring()
+{
+}
+
+Uring::~Uring()
+{
+    if(m_sqes)
+    {
+        munmap(m_sqes, m_sqesSize);
+    }
+    if(m_cqRing && m_cqRing != m_sqRing)
+    {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    if(m_sqRing)
+    {
+        munmap(m_sqRing, m_sqRingSize);
+    }
+    if(m_fd >= 0)
+    {
+        ::close(m_fd);
+    }
+}
+
+bool Uring::init(unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_fd = UringSetup(entries, &p);
+    if(m_fd < 0)
+    {
+        return false;
+    }
+    //CQ 满了不丢（5.5）；老内核里 SQ、CQ 是分开 mmap 的，两种都认
+    if(!(p.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    //要用的操作都得有：收发、accept、超时、取消
+    {
+        size_t len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        io_uring_probe* probe = (io_uring_probe*)calloc(1, len);
+        int rt = UringRegister(m_fd, IORING_REGISTER_PROBE, probe, 256);
+        static const int s_ops[] = {IORING_OP_RECV, IORING_OP_SEND, IORING_OP_RECVMSG
+            , IORING_OP_SENDMSG, IORING_OP_ACCEPT, IORING_OP_LINK_TIMEOUT};
+        bool ok = rt == 0;
+        for(int op : s_ops)
+        {
+            if(!ok)
+            {
+                break;
+            }
+            ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+        free(probe);
+        if(!ok)
+        {
+            errno = ENOTSUP;
+            return false;
+        }
+    }
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single)
+    {
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sqRing == MAP_FAILED)
+    {
+        m_sqRing = nullptr;
+        return false;
+    }
+    if(single)
+    {
+        m_cqRing = m_sqRing;
+    }
+    else
+    {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if(m_cqRing == MAP_FAILED)
+        {
+            m_cqRing = nullptr;
+            return false;
+        }
+    }
+    m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE
+            , MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(m_sqes == MAP_FAILED)
+    {
+        m_sqes = nullptr;
+        return false;
+    }
+
+    char* sq = (char*)m_sqRing;
+    m_sqHead = (unsigned*)(sq + p.sq_off.head);
+    m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+    m_sqFlags = (unsigned*)(sq + p.sq_off.flags);
+    m_sqArray = (unsigned*)(sq + p.sq_off.array);
+    m_sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    m_sqEntries = *(unsigned*)(sq + p.sq_off.ring_entries);
+    m_sqeTail = m_sqeSubmitted = *m_sqTail;
+
+    char* cq = (char*)m_cqRing;
+    m_cqHead = (unsigned*)(cq + p.cq_off.head);
+    m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+    m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    m_cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+
+    //同步取消是 6.0 才有的，close 的时候要靠它把还在做的请求撤掉。没有的话是 EINVAL
+    int rt = cancelFd(-1);
+    if(rt != -EBADF && rt != -ENOENT)
+    {
+        SYLAR_LOG_INFO(g_logger) << "io_uring sync cancel not supported: " << rt;
+        errno = ENOTSUP;
+        return false;
+    }
+    return true;
+}
+
+io_uring_sqe* Uring::getSqe()
+{
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if(m_sqeTail - head >= m_sqEntries)
+    {
+        return nullptr;
+    }
+    unsigned idx = m_sqeTail & m_sqMask;
+    io_uring_sqe* sqe = &m_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sqArray[idx] = idx;
+    ++m_sqeTail;
+    return sqe;
+}
+
+unsigned Uring::space() const
+{
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    return m_sqEntries - (m_sqeTail - head);
+}
+
+int Uring::submit()
+{
+    unsigned count = queued();
+    if(!count)
+    {
+        return 0;
+    }
+    //内核是从共享的 tail 看到新填的 SQE 的
+    __atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+    int rt = UringEnter(m_fd, count, 0, 0);
+    if(rt < 0)
+    {
+        return -errno;
+    }
+    m_sqeSubmitted += rt;
+    return rt;
+}
+
+bool Uring::hasCompletions() const
+{
+    return *m_cqHead != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)
+        || (__atomic_load_n(m_sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW);
+}
+
+void Uring::flushOverflow()
+{
+    UringEnter(m_fd, 0, 0, IORING_ENTER_GETEVENTS);
+}
+
+int Uring::cancelFd(int fd)
+{
+    io_uring_sync_cancel_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.fd = fd;
+    reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    //-1 是不限时，等到撤掉为止
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    int rt = UringRegister(m_fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+    return rt < 0 ? -errno : rt;
+}
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+//io_uring 的一个环。不依赖 liburing，直接系统调用 + mmap 出来的 SQ/CQ
+//头文件太老（没有同步取消，6.0 之前）的话整个不编进来，IOManager 只能用 epoll
+
+#include <stdint.h>
+#include <stddef.h>
+#include "noncopyable.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_ASYNC_CANCEL_FD_FIXED)
+#define SYLAR_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#ifndef SYLAR_HAVE_URING
+#define SYLAR_HAVE_URING 0
+#endif
+
+namespace sylar
+{
+
+#if SYLAR_HAVE_URING
+
+//SQ 只能一个线程往里填、提交；CQ 同一时间只能一个线程收，谁来收由外面管
+class Uring : Noncopyable
+{
+public:
+    Uring();
+    ~Uring();
+
+    //entries 是 SQ 的大小，CQ 内核给两倍。内核不支持（太老、被禁了）、要用的操作不全，返回 false，errno 是原因
+    bool init(unsigned entries);
+    int getFd() const { return m_fd; }
+
+    //拿一个清零的 SQE，填好了就算攒着了，submit 的时候一起交。满了返回 nullptr
+    io_uring_sqe* getSqe();
+    //SQ 还能放几个
+    unsigned space() const;
+    //攒着还没交给内核的
+    unsigned queued() const { return m_sqeTail - m_sqeSubmitted; }
+    //攒着的一次交给内核，返回交了几个，失败返回 -errno
+    int submit();
+
+    //CQ 里有没有做完的
+    bool hasCompletions() const;
+    //把做完的一个个拿出来 cb(user_data, res)，返回拿了几个
+    template<class CB>
+    size_t reap(CB cb)
+    {
+        size_t n = 0;
+        while(true)
+        {
+            //head 只有收的人写，tail 是内核写的
+            unsigned head = *m_cqHead;
+            unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            for(; head != tail; ++head, ++n)
+            {
+                io_uring_cqe* cqe = &m_cqes[head & m_cqMask];
+                cb(cqe->user_data, cqe->res);
+            }
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+            //CQ 满过，多出来的内核先挂着，要进一次内核才会搬过来
+            if(!(__atomic_load_n(m_sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+            {
+                break;
+            }
+            flushOverflow();
+        }
+        return n;
+    }
+
+    //同步取消这个环上对 fd 的所有请求，哪个线程都能调。返回取消了几个，一个都没有 -ENOENT
+    int cancelFd(int fd);
+private:
+    void flushOverflow();
+private:
+    int m_fd = -1;
+    void* m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    void* m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+
+    unsigned* m_sqHead = nullptr;
+    unsigned* m_sqTail = nullptr;
+    unsigned* m_sqFlags = nullptr;
+    unsigned* m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    //填到哪了、交到哪了，都是本地的，交的时候才写到共享的 tail 上
+    unsigned m_sqeTail = 0;
+    unsigned m_sqeSubmitted = 0;
+
+    unsigned* m_cqHead = nullptr;
+    unsigned* m_cqTail = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_cqMask = 0;
+};
+
+#endif
+
+}
+
+#endif
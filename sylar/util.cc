@@ -9,6 +9,8 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
 
 namespace sylar {
 
@@ -66,6 +68,23 @@ std::string BacktraceToString(int size, int skip, const std::string& prefix)
     return ss.str();
 }
 
+std::string BacktraceToString(void* const* frames, int size, int skip, const std::string& prefix)
+{
+    std::stringstream ss;
+    char** strings = backtrace_symbols(frames, size);
+    if(strings == NULL)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "backtrace_symbols error";
+        return ss.str();
+    }
+    for(int i = skip; i < size; ++i)
+    {
+        ss << prefix << strings[i] << std::endl;
+    }
+    free(strings);
+    return ss.str();
+}
+
 //毫秒
 uint64_t GetCurrentMS()
 {
@@ -92,6 +111,152 @@ std::string Time2Str(time_t ts, const std::string& format)
     return buf;
 }
 
+//"0-3,8,10-11" 这种格式
+static std::vector<int> ParseCpuList(const std::string& str)
+{
+    std::vector<int> rt;
+    size_t pos = 0;
+    while(pos < str.size())
+    {
+        size_t end = str.find(',', pos);
+        if(end == std::string::npos)
+        {
+            end = str.size();
+        }
+        std::string item = str.substr(pos, end - pos);
+        pos = end + 1;
+        if(item.empty() || !isdigit(item[0]))
+        {
+            continue;
+        }
+
+        int first = atoi(item.c_str());
+        int last = first;
+        size_t dash = item.find('-');
+        if(dash != std::string::npos)
+        {
+            last = atoi(item.c_str() + dash + 1);
+        }
+        for(int i = first; i <= last; ++i)
+        {
+            rt.push_back(i);
+        }
+    }
+    return rt;
+}
+
+static std::string ReadFirstLine(const std::string& path)
+{
+    std::ifstream ifs(path);
+    std::string line;
+    if(ifs)
+    {
+        std::getline(ifs, line);
+    }
+    return line;
+}
+
+int GetNumaNodeCount()
+{
+    std::vector<int> nodes = ParseCpuList(ReadFirstLine("/sys/devices/system/node/online"));
+    return nodes.empty() ? 1 : nodes.back() + 1;
+}
+
+std::vector<int> GetNumaNodeCpus(int node)
+{
+    return ParseCpuList(ReadFirstLine("/sys/devices/system/node/node"
+                        + std::to_string(node) + "/cpulist"));
+}
+
+std::vector<int> GetAllowedCpus()
+{
+    std::vector<int> rt;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set))
+    {
+        return rt;
+    }
+    for(int i = 0; i < CPU_SETSIZE; ++i)
+    {
+        if(CPU_ISSET(i, &set))
+        {
+            rt.push_back(i);
+        }
+    }
+    return rt;
+}
+
+bool SetThreadAffinity(const std::vector<int>& cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(auto i : cpus)
+    {
+        if(i >= 0 && i < CPU_SETSIZE)
+        {
+            CPU_SET(i, &set);
+        }
+    }
+    int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(rt)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "pthread_setaffinity_np rt=" << rt
+            << " (" << strerror(rt) << ")";
+        return false;
+    }
+    return true;
+}
+
+bool SetThreadMemoryNode(int node)
+{
+    //glibc 没有包装，libnuma 里的 set_mempolicy 也就是这么调的
+    int rt = 0;
+    if(node < 0)
+    {
+        rt = syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+    }
+    else
+    {
+        unsigned long mask[16] = {0};
+        if(node >= (int)(sizeof(mask) * 8))
+        {
+            return false;
+        }
+        mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+        rt = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+    }
+    if(rt)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "set_mempolicy node=" << node << " errno=" << errno
+            << " (" << strerror(errno) << ")";
+        return false;
+    }
+    return true;
+}
+
+int GetThreadMemoryNode()
+{
+    int mode = 0;
+    unsigned long mask[16] = {0};
+    if(syscall(SYS_get_mempolicy, &mode, mask, sizeof(mask) * 8, nullptr, 0))
+    {
+        return -1;
+    }
+    if(mode != MPOL_PREFERRED && mode != MPOL_BIND)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < sizeof(mask) * 8; ++i)
+    {
+        if(mask[i / (sizeof(unsigned long) * 8)] & (1ul << (i % (sizeof(unsigned long) * 8))))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
 void FSUtil::ListAllFile(std::vector<std::string>& files
                                 , const std::string& path
                                 , const std::string& subfix)
@@ -22,6 +22,8 @@ void Backtrace(std::vector<std::string>& bt, int size = 64, int skip = 1);
 
 //下面的 skip 是2，是因为它调用了 Backtrace ，所以有两层
 std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "");
+//已经抓好的栈（比如信号处理函数里 ::backtrace 抓的，那里面不能做别的）转成字符串
+std::string BacktraceToString(void* const* frames, int size, int skip, const std::string& prefix);
 
 //时间ms
 uint64_t GetCurrentMS();
@@ -29,6 +31,20 @@ uint64_t GetCurrentUS();
 
 std::string Time2Str(time_t ts = time(0), const std::string& format = "%Y-%m-%d %H:%M:%S");
 
+//cpu 亲和性、NUMA 相关的，直接走系统调用和 /sys，不依赖 libnuma
+//NUMA 节点数，拿不到就当只有 1 个
+int GetNumaNodeCount();
+//某个 NUMA 节点上的 cpu，没有这个节点返回空
+std::vector<int> GetNumaNodeCpus(int node);
+//当前线程允许跑的 cpu
+std::vector<int> GetAllowedCpus();
+//把当前线程绑到这些 cpu 上
+bool SetThreadAffinity(const std::vector<int>& cpus);
+//当前线程之后缺页分配的内存优先放到 node 上（不是强制的，满了还能去别的节点），-1 恢复默认
+bool SetThreadMemoryNode(int node);
+//当前线程内存优先放的节点，没设置过返回 -1
+int GetThreadMemoryNode();
+
 //跟文件有关的util
 class FSUtil
 {
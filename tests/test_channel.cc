@@ -0,0 +1,105 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/channel.h"
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+//线程 -> 协程：几个普通线程往里灌，IOManager 里的协程收，满了线程等，空了协程挂起
+void test_pipeline(int threads, int producers, int count)
+{
+    sylar::Channel<int>::ptr chan(new sylar::Channel<int>(64));
+    std::atomic<uint64_t> sum = {0};
+    std::atomic<uint64_t> recved = {0};
+
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "pipeline");
+        for(int i = 0; i < threads; ++i)
+        {
+            iom.schedule([chan, &sum, &recved](){
+                int v = 0;
+                while(chan->recv(v))
+                {
+                    sum += v;
+                    ++recved;
+                }
+            });
+        }
+
+        std::vector<sylar::Thread::ptr> thrs;
+        for(int i = 0; i < producers; ++i)
+        {
+            thrs.push_back(sylar::Thread::ptr(new sylar::Thread([chan, count](){
+                for(int j = 0; j < count; ++j)
+                {
+                    chan->send(j);
+                }
+            }, "ingest_" + std::to_string(i))));
+        }
+        for(auto& i : thrs)
+        {
+            i->join();
+        }
+        //发完了关掉，收的协程收完就退出
+        chan->close();
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "pipeline recved=" << recved
+        << " sum=" << sum
+        << " expect=" << (uint64_t)producers * count * (count - 1) / 2
+        << " used=" << used << "us";
+    SYLAR_ASSERT(recved == (uint64_t)producers * count);
+    SYLAR_ASSERT(sum == (uint64_t)producers * count * (count - 1) / 2);
+}
+
+//扇入：几个协程各往自己的 channel 发，发完关掉，一个协程 Select 着收，全关了就是 -1
+void test_select(int threads, int count)
+{
+    const int n = 3;
+    std::vector<sylar::Channel<int>::ptr> chans;
+    for(int i = 0; i < n; ++i)
+    {
+        chans.push_back(sylar::Channel<int>::ptr(new sylar::Channel<int>(8)));
+    }
+    std::vector<int> got(n, 0);
+
+    {
+        sylar::IOManager iom(threads, false, "select");
+        iom.schedule([&chans, &got](){
+            int v = 0;
+            int idx = 0;
+            while((idx = sylar::Channel<int>::Select(chans, v)) >= 0)
+            {
+                ++got[idx];
+            }
+        });
+        for(int i = 0; i < n; ++i)
+        {
+            sylar::Channel<int>::ptr chan = chans[i];
+            iom.schedule([chan, count](){
+                for(int j = 0; j < count; ++j)
+                {
+                    chan->send(j);
+                }
+                chan->close();
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "select got=" << got[0] << "," << got[1] << "," << got[2]
+        << " expect=" << count << " each";
+    for(int i = 0; i < n; ++i)
+    {
+        SYLAR_ASSERT(got[i] == count);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+
+    test_pipeline(threads, 2, 100000);
+    test_select(threads, 10000);
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include "sylar/sylar.h"
+#include "sylar/fiber_local.h"
+#include <atomic>
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -34,9 +36,226 @@ void test_fiber()
     SYLAR_LOG_INFO(g_logger) << "main end 1";
 }
 
+//切换耗时：协程里一直 YieldToHold，外面一直 swapIn，一轮是切进去加切出来两次
+static uint64_t s_switch_count = 0;
+
+static void switch_loop()
+{
+    for(uint64_t i = 0; i < s_switch_count; ++i)
+    {
+        sylar::Fiber::YieldToHold();
+    }
+}
+
+void test_switch(uint64_t count)
+{
+    s_switch_count = count;
+    sylar::Fiber::GetThis();
+    sylar::Fiber::ptr fiber(new sylar::Fiber(&switch_loop));
+
+    uint64_t start = sylar::GetCurrentUS();
+    for(uint64_t i = 0; i < count; ++i)
+    {
+        fiber->swapIn();
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    //最后一次让它跑完，切了这么多次回来状态还得对
+    fiber->swapIn();
+    SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+
+    SYLAR_LOG_INFO(g_logger) << "switches=" << count * 2
+        << " used=" << used << "us"
+        << " per_switch=" << (double)used * 1000 / (count * 2) << "ns";
+}
+
+//协程创建销毁的开销：每个都跑一下，栈也摸一下，跟真的连接协程差不多
+static void touch_stack()
+{
+    volatile char buf[4096];
+    buf[0] = 1;
+    buf[sizeof(buf) - 1] = buf[0];
+}
+
+void test_create(uint64_t count)
+{
+    sylar::Fiber::GetThis();
+    uint64_t fibers = sylar::Fiber::TotalFibers();
+    uint64_t start = sylar::GetCurrentUS();
+    for(uint64_t i = 0; i < count; ++i)
+    {
+        sylar::Fiber::ptr fiber(new sylar::Fiber(&touch_stack));
+        fiber->swapIn();
+        SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+
+    SYLAR_LOG_INFO(g_logger) << "fibers=" << count
+        << " used=" << used << "us"
+        << " per_fiber=" << (double)used * 1000 / count << "ns";
+    //栈还回池子里了，协程本身不能漏
+    SYLAR_ASSERT(sylar::Fiber::TotalFibers() == fibers);
+}
+
+//栈溢出：应该直接撞到保护页上段错误，而不是悄悄踩坏别的内存
+static volatile int s_overflow_depth = 1 << 20;
+
+static void overflow(int depth)
+{
+    volatile char buf[1024];
+    buf[0] = depth;
+    if(depth < s_overflow_depth)
+    {
+        overflow(depth + 1);
+    }
+    buf[1] = buf[0];
+}
+
+//栈用量：打开 fiber.stack_watermark，不同的回调用不同深度的栈，看统计出来的对不对
+template<size_t N>
+static void use_stack()
+{
+    volatile char buf[N];
+    for(size_t i = 0; i < N; i += 512)
+    {
+        buf[i] = i;
+    }
+    buf[N - 1] = buf[0];
+}
+
+void test_stack_usage()
+{
+    sylar::Config::Lookup<bool>("fiber.stack_watermark")->setValue(true);
+    sylar::Fiber::GetThis();
+
+    sylar::Fiber::ptr fiber(new sylar::Fiber([](){ use_stack<1024>(); }));
+    fiber->swapIn();
+    SYLAR_LOG_INFO(g_logger) << "1K lambda peak=" << fiber->getStackPeak();
+    //水位至少是用到的那么多，又不能离谱（每次 reset 要重新量）
+    SYLAR_ASSERT(fiber->getStackPeak() >= 1024 && fiber->getStackPeak() < 16 * 1024);
+    fiber->reset(&use_stack<16 * 1024>);
+    fiber->swapIn();
+    SYLAR_LOG_INFO(g_logger) << "16K function peak=" << fiber->getStackPeak();
+    SYLAR_ASSERT(fiber->getStackPeak() >= 16 * 1024);
+    fiber->reset(std::bind(&use_stack<4 * 1024>));
+    fiber->swapIn();
+    SYLAR_LOG_INFO(g_logger) << "4K bind peak=" << fiber->getStackPeak();
+    SYLAR_ASSERT(fiber->getStackPeak() >= 4 * 1024 && fiber->getStackPeak() < 16 * 1024);
+    fiber->reset(nullptr);
+
+    //小栈的回调放到调度器里跑
+    {
+        sylar::Scheduler sc(1, false, "stack");
+        sc.start();
+        for(int i = 0; i < 10; ++i)
+        {
+            sc.schedule([](){
+                use_stack<8 * 1024>();
+                uint32_t size = sylar::Fiber::GetThis()->getStackSize();
+                SYLAR_LOG_INFO(g_logger) << "small stack size=" << size;
+                SYLAR_ASSERT(size == sylar::Fiber::GetStackSize(sylar::Fiber::STACK_SMALL));
+            }, -1, sylar::Scheduler::NORMAL, sylar::Fiber::STACK_SMALL);
+        }
+        sc.stop();
+    }
+
+    SYLAR_LOG_INFO(g_logger) << "stack usage:" << std::endl << sylar::Fiber::DumpStackUsage();
+}
+
+//协程局部变量：每个协程存自己的 trace id，来回让出、被别的线程偷走，回来看还是不是自己的
+//协程回到缓存再拿出来跑下一个回调，应该是空的
+struct TraceContext
+{
+    uint64_t trace_id = 0;
+    std::string tenant;
+};
+
+static sylar::FiberLocal<TraceContext> s_trace;
+static std::atomic<uint64_t> s_local_wrong = {0};
+static std::atomic<uint64_t> s_local_leaked = {0};
+
+static void local_task(uint64_t id)
+{
+    if(s_trace.get())
+    {
+        ++s_local_leaked;
+    }
+    s_trace->trace_id = id;
+    s_trace->tenant = "tenant_" + std::to_string(id % 7);
+    for(int i = 0; i < 10; ++i)
+    {
+        sylar::Fiber::YieldToReady();
+        if(s_trace->trace_id != id || s_trace->tenant != "tenant_" + std::to_string(id % 7))
+        {
+            ++s_local_wrong;
+        }
+    }
+}
+
+void test_local(int threads)
+{
+    {
+        sylar::Scheduler sc(threads, false, "local");
+        sc.start();
+        for(uint64_t i = 1; i <= 10000; ++i)
+        {
+            sc.schedule(std::bind(&local_task, i));
+        }
+        sc.stop();
+    }
+    //不在协程里，就是线程自己的一份
+    TraceContext main_ctx;
+    main_ctx.trace_id = 42;
+    s_trace.set(main_ctx);
+    SYLAR_LOG_INFO(g_logger) << "fiber local wrong=" << s_local_wrong
+        << " leaked=" << s_local_leaked
+        << " main trace_id=" << s_trace->trace_id;
+    SYLAR_ASSERT(s_local_wrong == 0);
+    SYLAR_ASSERT(s_local_leaked == 0);
+    SYLAR_ASSERT(s_trace->trace_id == 42);
+}
+
 int main(int argc, char** argv)
 {
+    if(argc > 1 && std::string(argv[1]) == "local")
+    {
+        //./test_fiber local [线程数]
+        SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+        test_local(argc > 2 ? atoi(argv[2]) : 4);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "stack")
+    {
+        SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+        test_stack_usage();
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "create")
+    {
+        //./test_fiber create [个数]
+        SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+        test_create(argc > 2 ? atoll(argv[2]) : 1000000);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "overflow")
+    {
+        sylar::Fiber::GetThis();
+        sylar::Fiber::ptr fiber(new sylar::Fiber(std::bind(&overflow, 0), 64 * 1024));
+        fiber->swapIn();
+        return 0;
+    }
+
     sylar::Thread::SetName("main");
+
+    if(argc > 1 && std::string(argv[1]) == "bench")
+    {
+        //./test_fiber bench [轮数]
+        SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+        test_switch(argc > 2 ? atoll(argv[2]) : 10000000);
+        return 0;
+    }
     
     std::vector<sylar::Thread::ptr> thrs;
     for(int i = 0; i < 3; ++i)
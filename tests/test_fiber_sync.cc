@@ -0,0 +1,218 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/fiber_sync.h"
+#include <atomic>
+#include <deque>
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+//互斥锁：一堆协程抢一把锁，锁里面故意让出去，逼着别人走慢路径排队
+//再加一个普通线程一起抢，它会退回信号量阻塞
+static sylar::FiberMutex s_mutex;
+static uint64_t s_counter = 0;
+static std::atomic<int> s_fiber_done = {0};
+
+static void mutex_worker(int loops)
+{
+    for(int i = 0; i < loops; ++i)
+    {
+        sylar::FiberMutex::Lock lock(s_mutex);
+        uint64_t v = s_counter;
+        if(i % 16 == 0)
+        {
+            sylar::Fiber::YieldToReady();
+        }
+        s_counter = v + 1;
+    }
+    ++s_fiber_done;
+}
+
+void test_mutex(int threads, int fibers, int loops)
+{
+    s_counter = 0;
+    s_fiber_done = 0;
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "mutex");
+        for(int i = 0; i < fibers; ++i)
+        {
+            iom.schedule(std::bind(&mutex_worker, loops));
+        }
+        sylar::Thread thr([loops](){
+            for(int i = 0; i < loops; ++i)
+            {
+                sylar::FiberMutex::Lock lock(s_mutex);
+                ++s_counter;
+            }
+        }, "plain");
+        thr.join();
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    SYLAR_LOG_INFO(g_logger) << "mutex counter=" << s_counter
+        << " expect=" << (uint64_t)(fibers + 1) * loops
+        << " used=" << used << "us";
+    SYLAR_ASSERT(s_counter == (uint64_t)(fibers + 1) * loops);
+    SYLAR_ASSERT(s_fiber_done == fibers);
+}
+
+//信号量 + 条件变量：有界队列，生产者等空位，消费者等数据
+static sylar::FiberMutex s_queue_mutex;
+static sylar::FiberCondition s_queue_cond;
+static std::deque<int> s_queue;
+static sylar::FiberSemaphore s_slots(8);
+static std::atomic<uint64_t> s_consumed_sum = {0};
+
+static void producer(int begin, int count)
+{
+    for(int i = begin; i < begin + count; ++i)
+    {
+        s_slots.wait();
+        sylar::FiberMutex::Lock lock(s_queue_mutex);
+        s_queue.push_back(i);
+        s_queue_cond.notify();
+    }
+}
+
+static void consumer(int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        sylar::FiberMutex::Lock lock(s_queue_mutex);
+        while(s_queue.empty())
+        {
+            s_queue_cond.wait(s_queue_mutex);
+        }
+        s_consumed_sum += s_queue.front();
+        s_queue.pop_front();
+        lock.unlock();
+        s_slots.notify();
+    }
+}
+
+void test_queue(int threads)
+{
+    const int producers = 4;
+    const int per = 10000;
+    s_consumed_sum = 0;
+    {
+        sylar::IOManager iom(threads, false, "queue");
+        for(int i = 0; i < producers; ++i)
+        {
+            iom.schedule(std::bind(&consumer, per));
+        }
+        for(int i = 0; i < producers; ++i)
+        {
+            iom.schedule(std::bind(&producer, i * per, per));
+        }
+    }
+    uint64_t n = producers * per;
+    SYLAR_LOG_INFO(g_logger) << "queue sum=" << s_consumed_sum
+        << " expect=" << n * (n - 1) / 2
+        << " left=" << s_queue.size();
+    SYLAR_ASSERT(s_consumed_sum == n * (n - 1) / 2);
+    SYLAR_ASSERT(s_queue.empty());
+}
+
+//读写锁：写的时候两个数一前一后改，中间让出去；读的人看到不相等就是锁坏了
+static sylar::FiberRWMutex s_rwmutex;
+static uint64_t s_a = 0;
+static uint64_t s_b = 0;
+static std::atomic<uint64_t> s_broken = {0};
+static std::atomic<uint64_t> s_reads = {0};
+
+static void rw_reader(int loops)
+{
+    for(int i = 0; i < loops; ++i)
+    {
+        sylar::FiberRWMutex::ReadLock lock(s_rwmutex);
+        uint64_t a = s_a;
+        if(i % 8 == 0)
+        {
+            sylar::Fiber::YieldToReady();
+        }
+        if(a != s_b)
+        {
+            ++s_broken;
+        }
+        ++s_reads;
+    }
+}
+
+static void rw_writer(int loops)
+{
+    for(int i = 0; i < loops; ++i)
+    {
+        sylar::FiberRWMutex::WriteLock lock(s_rwmutex);
+        ++s_a;
+        sylar::Fiber::YieldToReady();
+        ++s_b;
+    }
+}
+
+void test_rwmutex(int threads)
+{
+    s_a = s_b = 0;
+    s_broken = s_reads = 0;
+    {
+        sylar::IOManager iom(threads, false, "rw");
+        for(int i = 0; i < 16; ++i)
+        {
+            iom.schedule(std::bind(&rw_reader, 2000));
+        }
+        for(int i = 0; i < 4; ++i)
+        {
+            iom.schedule(std::bind(&rw_writer, 500));
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "rwmutex writes=" << s_a
+        << " reads=" << s_reads
+        << " broken=" << s_broken;
+    SYLAR_ASSERT(s_broken == 0);
+    SYLAR_ASSERT(s_a == 4 * 500 && s_b == s_a);
+    SYLAR_ASSERT(s_reads == 16 * 2000);
+}
+
+//WaitGroup：派一堆出去，等齐；再试一下等不齐的时候超时
+void test_waitgroup(int threads)
+{
+    std::atomic<int> finished = {0};
+    sylar::IOManager iom(threads, false, "wg");
+    iom.schedule([&iom, &finished](){
+        sylar::WaitGroup wg;
+        for(int i = 0; i < 100; ++i)
+        {
+            wg.add();
+            iom.schedule([&wg, &finished](){
+                sylar::Fiber::YieldToReady();
+                ++finished;
+                wg.done();
+            });
+        }
+        wg.wait();
+        SYLAR_LOG_INFO(g_logger) << "waitgroup finished=" << finished << " expect=100";
+        SYLAR_ASSERT(finished == 100);
+        SYLAR_ASSERT(wg.getCount() == 0);
+
+        sylar::WaitGroup never;
+        never.add();
+        uint64_t start = sylar::GetCurrentMS();
+        bool ok = never.waitFor(100);
+        uint64_t used = sylar::GetCurrentMS() - start;
+        SYLAR_LOG_INFO(g_logger) << "waitgroup timeout ok=" << ok
+            << " used=" << used << "ms";
+        SYLAR_ASSERT(!ok);
+        SYLAR_ASSERT(used >= 100);
+    });
+}
+
+int main(int argc, char** argv)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+
+    test_mutex(threads, 100, 2000);
+    test_queue(threads);
+    test_rwmutex(threads);
+    test_waitgroup(threads);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/future.h"
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+//假装是一次后端调用，sleep 被 hook 了，只挂起协程
+static int backend_call(int i, int ms)
+{
+    usleep(ms * 1000);
+    return i * i;
+}
+
+//并行扇出：10 个各 50ms 的调用，串着要 500ms，并行应该 50ms 出头
+void test_fanout()
+{
+    std::vector<sylar::Future<int> > futures;
+    uint64_t start = sylar::GetCurrentMS();
+    for(int i = 0; i < 10; ++i)
+    {
+        futures.push_back(sylar::Async(std::bind(&backend_call, i, 50)));
+    }
+    bool all = sylar::WhenAll(futures);
+    int sum = 0;
+    for(auto& i : futures)
+    {
+        sum += i.get();
+    }
+    SYLAR_LOG_INFO(g_logger) << "fanout all=" << all << " sum=" << sum << " expect=285"
+        << " used=" << sylar::GetCurrentMS() - start << "ms";
+    SYLAR_ASSERT(all);
+    SYLAR_ASSERT(sum == 285);
+}
+
+//异常原样从 get 里抛出来
+void test_exception()
+{
+    sylar::Future<int> f = sylar::Async([]() -> int {
+        throw std::runtime_error("backend down");
+    });
+    bool thrown = false;
+    try
+    {
+        f.get();
+        SYLAR_LOG_ERROR(g_logger) << "exception not propagated";
+    }
+    catch(std::exception& e)
+    {
+        SYLAR_LOG_INFO(g_logger) << "exception propagated: " << e.what();
+        thrown = true;
+    }
+    SYLAR_ASSERT(thrown);
+
+    sylar::Future<void> v = sylar::Async([](){});
+    v.get();
+    SYLAR_LOG_INFO(g_logger) << "void future ready=" << v.isReady();
+    SYLAR_ASSERT(v.isReady());
+}
+
+//deadline：一个快的一个慢的，WhenAll 等不齐超时，WhenAny 拿到快的那个
+void test_deadline()
+{
+    std::vector<sylar::Future<int> > futures;
+    futures.push_back(sylar::Async(std::bind(&backend_call, 1, 500)));
+    futures.push_back(sylar::Async(std::bind(&backend_call, 2, 20)));
+
+    uint64_t start = sylar::GetCurrentMS();
+    int any = sylar::WhenAny(futures, 200);
+    SYLAR_LOG_INFO(g_logger) << "when_any index=" << any << " expect=1"
+        << " used=" << sylar::GetCurrentMS() - start << "ms";
+    SYLAR_ASSERT(any == 1);
+
+    start = sylar::GetCurrentMS();
+    bool all = sylar::WhenAll(futures, 100);
+    SYLAR_LOG_INFO(g_logger) << "when_all timeout all=" << all << " expect=0"
+        << " used=" << sylar::GetCurrentMS() - start << "ms";
+    SYLAR_ASSERT(!all);
+
+    //对着一直没结果的 future 反复 WhenAny（等下一个做完的那种循环），回调不能越挂越多
+    sylar::Promise<int> never;
+    std::vector<sylar::Future<int> > pending;
+    pending.push_back(never.getFuture());
+    pending.push_back(futures[0]);
+    for(int i = 0; i < 100; ++i)
+    {
+        sylar::WhenAny(pending, 0);
+    }
+    size_t leftover = never.getFuture().pendingCallbacks();
+    SYLAR_LOG_INFO(g_logger) << "when_any leftover callbacks=" << leftover << " expect=0";
+    SYLAR_ASSERT(leftover == 0);
+    never.setValue(0);
+
+    //不在协程里也能等
+    sylar::Promise<std::string> p;
+    sylar::Thread thr([p](){
+        usleep(10 * 1000);
+        p.setValue("from thread");
+    }, "setter");
+    std::string from = p.getFuture().get();
+    SYLAR_LOG_INFO(g_logger) << "promise from thread: " << from;
+    SYLAR_ASSERT(from == "from thread");
+    thr.join();
+}
+
+//普通 Scheduler（不是 IOManager）的协程里带超时等，没有 IOManager 的定时器，走共用的后台定时器
+void test_plain_scheduler()
+{
+    sylar::Scheduler sc(2, false, "plain");
+    sc.start();
+    std::atomic<int> finished = {0};
+    //普通 Scheduler 的 stop 不知道有挂起的协程，等它做完再 stop
+    sylar::WaitGroup wg;
+    wg.add(1);
+    sc.schedule([&finished, &wg](){
+        sylar::Promise<int> never;
+        uint64_t start = sylar::GetCurrentMS();
+        bool ready = never.getFuture().waitFor(50);
+        uint64_t used = sylar::GetCurrentMS() - start;
+        SYLAR_LOG_INFO(g_logger) << "plain scheduler wait_for ready=" << ready
+            << " used=" << used << "ms";
+        SYLAR_ASSERT(!ready);
+        SYLAR_ASSERT(used >= 50);
+
+        std::vector<sylar::Future<int> > futures;
+        futures.push_back(never.getFuture());
+        int any = sylar::WhenAny(futures, 20);
+        SYLAR_ASSERT(any == -1);
+        bool all = sylar::WhenAll(futures, 20);
+        SYLAR_ASSERT(!all);
+        SYLAR_ASSERT(never.getFuture().pendingCallbacks() == 0);
+
+        //超时之前有结果
+        sylar::Promise<int> later;
+        sylar::Thread thr([later](){
+            usleep(10 * 1000);
+            later.setValue(7);
+        }, "setter");
+        futures[0] = later.getFuture();
+        all = sylar::WhenAll(futures, 1000);
+        SYLAR_ASSERT(all);
+        SYLAR_ASSERT(futures[0].get() == 7);
+        thr.join();
+        ++finished;
+        wg.done();
+    });
+    wg.wait();
+    sc.stop();
+    SYLAR_LOG_INFO(g_logger) << "plain scheduler finished=" << finished;
+    SYLAR_ASSERT(finished == 1);
+}
+
+int main(int argc, char** argv)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    {
+        sylar::IOManager iom(argc > 1 ? atoi(argv[1]) : 2, false, "future");
+        iom.schedule([](){
+            test_fanout();
+            test_exception();
+            test_deadline();
+        });
+    }
+    test_plain_scheduler();
+    return 0;
+}
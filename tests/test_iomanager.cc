@@ -5,6 +5,11 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -54,8 +59,949 @@ void test_timer()
     },true);
 }
 
+//突发测试：一堆 fd 同时可读，一次 epoll_wait 就拿到几十个事件
+//看每个回调从写入到开始执行等了多久，闲着的线程都被叫起来分担的话 p99 会低很多
+static const int s_burst_fds = 64;
+static int s_burst_socks[s_burst_fds][2];
+static std::atomic<int> s_burst_registered = {0};
+static std::atomic<int> s_burst_done = {0};
+static uint64_t s_burst_start = 0;
+static uint64_t s_burst_latency[s_burst_fds];
+
+static void burst_callback(int i)
+{
+    s_burst_latency[i] = sylar::GetCurrentUS() - s_burst_start;
+    char c;
+    int n = read(s_burst_socks[i][0], &c, 1);
+    //每个事件都是真有数据才触发的
+    SYLAR_ASSERT(n == 1);
+
+    //模拟一点点业务耗时
+    uint64_t until = sylar::GetCurrentUS() + 200;
+    while(sylar::GetCurrentUS() < until);
+    ++s_burst_done;
+}
+
+static void burst_register()
+{
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    for(int i = 0; i < s_burst_fds; ++i)
+    {
+        iom->addEvent(s_burst_socks[i][0], sylar::IOManager::READ, std::bind(&burst_callback, i));
+    }
+    s_burst_registered = s_burst_fds;
+}
+
+void test_burst(int threads, int rounds)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    for(int i = 0; i < s_burst_fds; ++i)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, s_burst_socks[i]);
+        fcntl(s_burst_socks[i][0], F_SETFL, O_NONBLOCK);
+    }
+
+    std::vector<uint64_t> latency;
+    {
+        sylar::IOManager iom(threads, false, "burst");
+        for(int r = 0; r < rounds; ++r)
+        {
+            s_burst_registered = 0;
+            s_burst_done = 0;
+            iom.schedule(&burst_register);
+            while(s_burst_registered != s_burst_fds)
+            {
+                usleep(100);
+            }
+            //等大家都睡回 epoll_wait 里
+            usleep(10 * 1000);
+
+            s_burst_start = sylar::GetCurrentUS();
+            for(int i = 0; i < s_burst_fds; ++i)
+            {
+                write(s_burst_socks[i][1], "B", 1);
+            }
+            while(s_burst_done != s_burst_fds)
+            {
+                usleep(100);
+            }
+            latency.insert(latency.end(), s_burst_latency, s_burst_latency + s_burst_fds);
+        }
+        iom.stop();
+    }
+
+    for(int i = 0; i < s_burst_fds; ++i)
+    {
+        close(s_burst_socks[i][0]);
+        close(s_burst_socks[i][1]);
+    }
+
+    SYLAR_ASSERT(latency.size() == (size_t)s_burst_fds * rounds);
+    std::sort(latency.begin(), latency.end());
+    SYLAR_LOG_INFO(g_logger) << "threads=" << threads
+        << " events=" << latency.size()
+        << " p50=" << latency[latency.size() / 2] << "us"
+        << " p99=" << latency[latency.size() * 99 / 100] << "us"
+        << " max=" << latency.back() << "us";
+}
+
+//来回测试：外面一个线程隔 gap_us 发一个字节，iomanager 里收到马上回，量来回一趟要多久
+//请求一个接一个、间隔很短的时候，空转能省掉每次睡下去再被叫醒的开销
+static int s_pp_socks[2];
+static std::atomic<bool> s_pp_stop = {false};
+
+static void pingpong_echo()
+{
+    char c;
+    while(read(s_pp_socks[0], &c, 1) == 1)
+    {
+        write(s_pp_socks[0], &c, 1);
+    }
+    if(!s_pp_stop)
+    {
+        sylar::IOManager::GetThis()->addEvent(s_pp_socks[0], sylar::IOManager::READ, &pingpong_echo);
+    }
+}
+
+void test_pingpong(int threads, int rounds, int gap_us, int spin_us, int max_spinners)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    sylar::Config::Lookup<uint32_t>("iomanager.spin_us")->setValue(spin_us);
+    sylar::Config::Lookup<uint32_t>("iomanager.max_spinners")->setValue(max_spinners);
+    s_pp_stop = false;
+    socketpair(AF_UNIX, SOCK_STREAM, 0, s_pp_socks);
+    fcntl(s_pp_socks[0], F_SETFL, O_NONBLOCK);
+
+    std::vector<uint64_t> rtt;
+    sylar::IOManager iom(threads, false, "pingpong");
+    //跟 burst 一样，要在 iomanager 的线程里注册
+    std::atomic<bool> registered = {false};
+    iom.schedule([&registered](){
+        sylar::IOManager::GetThis()->addEvent(s_pp_socks[0], sylar::IOManager::READ, &pingpong_echo);
+        registered = true;
+    });
+    while(!registered)
+    {
+        usleep(100);
+    }
+    for(int i = 0; i < rounds; ++i)
+    {
+        uint64_t until = sylar::GetCurrentUS() + gap_us;
+        while(sylar::GetCurrentUS() < until);
+
+        char c = 'P';
+        uint64_t start = sylar::GetCurrentUS();
+        write(s_pp_socks[1], &c, 1);
+        c = 0;
+        int n = read(s_pp_socks[1], &c, 1);
+        rtt.push_back(sylar::GetCurrentUS() - start);
+        SYLAR_ASSERT(n == 1 && c == 'P');
+    }
+    s_pp_stop = true;
+    iom.schedule([](){
+        sylar::IOManager::GetThis()->cancelAll(s_pp_socks[0]);
+    });
+    sylar::Scheduler::Metrics m = iom.getMetrics();
+    iom.stop();
+    close(s_pp_socks[0]);
+    close(s_pp_socks[1]);
+
+    uint64_t spin_cpu = 0, hits = 0, misses = 0;
+    for(auto& i : m.workers)
+    {
+        spin_cpu += i.spin_us;
+        hits += i.spin_hits;
+        misses += i.spin_misses;
+    }
+    std::sort(rtt.begin(), rtt.end());
+    SYLAR_LOG_INFO(g_logger) << "spin_us=" << spin_us
+        << " threads=" << threads
+        << " gap=" << gap_us << "us"
+        << " rtt p50=" << rtt[rtt.size() / 2] << "us"
+        << " p99=" << rtt[rtt.size() * 99 / 100] << "us"
+        << " tickles=" << m.tickles
+        << " spin_hits=" << hits
+        << " spin_misses=" << misses
+        << " spin_cpu=" << spin_cpu << "us";
+    SYLAR_ASSERT(rtt.size() == (size_t)rounds);
+    if(spin_us == 0)
+    {
+        //不空转就不该有空转的账
+        SYLAR_ASSERT(spin_cpu == 0 && hits == 0 && misses == 0);
+    }
+}
+
+//优雅退出：20 个 50ms 的请求 deadline 之前做得完；一直在 accept 的、循环定时器做不完，到点放弃
+//旁边一个普通线程一直往里塞，开始排空之后塞的都应该被拒掉，或者转给 backup
+static std::atomic<int> s_drain_finished = {0};
+static std::atomic<int> s_drain_accept_rt = {0};
+static std::atomic<int> s_drain_accept_errno = {0};
+static std::atomic<int> s_drain_fed = {0};
+static std::atomic<int> s_drain_fed_refused = {0};
+static std::atomic<int> s_drain_backup_ran = {0};
+
+static void drain_request()
+{
+    usleep(50 * 1000);
+    ++s_drain_finished;
+}
+
+static void drain_accept()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sock, (sockaddr*)&addr, sizeof(addr));
+    listen(sock, 8);
+    int rt = accept(sock, nullptr, nullptr);
+    s_drain_accept_errno = errno;
+    s_drain_accept_rt = rt;
+    close(sock);
+}
+
+void test_drain(int threads, uint64_t timeout_ms, bool stuck)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    s_drain_finished = 0;
+    s_drain_accept_rt = 0;
+    s_drain_accept_errno = 0;
+    s_drain_fed = 0;
+    s_drain_fed_refused = 0;
+    s_drain_backup_ran = 0;
+
+    sylar::IOManager backup(1, false, "backup");
+    sylar::IOManager iom(threads, false, "drain");
+    for(int i = 0; i < 20; ++i)
+    {
+        iom.schedule(&drain_request);
+    }
+    if(stuck)
+    {
+        iom.schedule(&drain_accept);
+        iom.addTimer(10, [](){}, true);
+    }
+
+    std::atomic<bool> feeding = {true};
+    sylar::Thread feeder([&iom, &feeding](){
+        while(feeding)
+        {
+            ++s_drain_fed;
+            if(!iom.schedule([](){ ++s_drain_backup_ran; }))
+            {
+                ++s_drain_fed_refused;
+            }
+            usleep(1000);
+        }
+    }, "feeder");
+    //让请求先跑起来
+    usleep(10 * 1000);
+
+    sylar::Scheduler::DrainResult result = iom.drain(timeout_ms, stuck ? &backup : nullptr);
+    feeding = false;
+    feeder.join();
+    backup.stop();
+
+    SYLAR_LOG_INFO(g_logger) << "drain stuck=" << stuck << " " << result.toString();
+    SYLAR_LOG_INFO(g_logger) << "    finished=" << s_drain_finished << " expect=20"
+        << " fed=" << s_drain_fed
+        << " fed_refused=" << s_drain_fed_refused
+        << " accept_rt=" << s_drain_accept_rt
+        << " accept_errno=" << s_drain_accept_errno
+        << (stuck ? " expect accept_rt=-1 accept_errno=" + std::to_string(ECANCELED) : std::string());
+    SYLAR_ASSERT(s_drain_finished == 20);
+    SYLAR_ASSERT(result.clean == !stuck);
+    if(stuck)
+    {
+        //卡住的 accept 到点被取消，循环定时器被丢掉，新来的都转给 backup
+        SYLAR_ASSERT(s_drain_accept_rt == -1 && s_drain_accept_errno == ECANCELED);
+        SYLAR_ASSERT(result.cancelled_fds == 1 && result.flushed_timers == 1);
+        SYLAR_ASSERT(result.redirected > 0 && result.rejected == 0);
+    }
+    //drain 返回之后 feeder 可能还塞了一两个，那些被拒了但不算在 drain 里
+    SYLAR_ASSERT(result.rejected + result.redirected <= (uint64_t)s_drain_fed_refused);
+}
+
+//use_caller 的（默认的 IOManager 就是）：本线程的 worker 平时要到 stop 才跑，drain 要自己把它跑起来
+//排得空的话用时应该是一个请求的 50ms 左右，而不是等到 deadline
+void test_drain_caller(uint64_t timeout_ms, bool stuck)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    s_drain_finished = 0;
+    s_drain_accept_rt = 0;
+    s_drain_accept_errno = 0;
+
+    sylar::IOManager iom(1, true, "drain_caller");
+    for(int i = 0; i < 20; ++i)
+    {
+        iom.schedule(&drain_request);
+    }
+    if(stuck)
+    {
+        iom.schedule(&drain_accept);
+    }
+
+    sylar::Scheduler::DrainResult result = iom.drain(timeout_ms);
+    SYLAR_LOG_INFO(g_logger) << "drain use_caller stuck=" << stuck << " " << result.toString();
+    SYLAR_LOG_INFO(g_logger) << "    finished=" << s_drain_finished << " expect=20"
+        << " accept_rt=" << s_drain_accept_rt
+        << " accept_errno=" << s_drain_accept_errno
+        << (stuck ? " expect accept_rt=-1 accept_errno=" + std::to_string(ECANCELED) : std::string());
+    SYLAR_ASSERT(s_drain_finished == 20);
+    SYLAR_ASSERT(result.clean == !stuck);
+    if(stuck)
+    {
+        SYLAR_ASSERT(s_drain_accept_rt == -1 && s_drain_accept_errno == ECANCELED);
+        SYLAR_ASSERT(result.cancelled_fds == 1);
+    }
+    else
+    {
+        //本线程的 worker 也在跑，不用等到 deadline
+        SYLAR_ASSERT(result.used_ms < timeout_ms);
+    }
+}
+
+//fd 表：一堆协程各自在自己的 fd 上反复 addEvent/delEvent，看每秒能做多少次
+//再把一个 fd dup2 到后面的块上，看用到了才分配的块能不能正常收到事件
+static std::atomic<uint64_t> s_fdtable_ops = {0};
+static std::atomic<bool> s_fdtable_fired = {false};
+
+static void fdtable_worker(int fd, int loops)
+{
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    for(int i = 0; i < loops; ++i)
+    {
+        int rt = iom->addEvent(fd, sylar::IOManager::READ, [](){});
+        SYLAR_ASSERT(rt == 0);
+        bool del = iom->delEvent(fd, sylar::IOManager::READ);
+        SYLAR_ASSERT(del);
+    }
+    s_fdtable_ops += loops * 2;
+}
+
+void test_fdtable(int threads, int fibers, int loops, int high_fd)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    std::vector<int> socks(fibers * 2);
+    for(int i = 0; i < fibers; ++i)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, &socks[i * 2]);
+    }
+
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+    if(dup2(pair[0], high_fd) < 0)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "dup2 to " << high_fd << " failed, errno=" << errno;
+        high_fd = -1;
+    }
+
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "fdtable");
+        for(int i = 0; i < fibers; ++i)
+        {
+            iom.schedule(std::bind(&fdtable_worker, socks[i * 2], loops));
+        }
+        if(high_fd >= 0)
+        {
+            iom.schedule([high_fd, &pair](){
+                sylar::IOManager::GetThis()->addEvent(high_fd, sylar::IOManager::READ, [](){
+                    s_fdtable_fired = true;
+                });
+                char c = 'x';
+                write(pair[1], &c, 1);
+            });
+        }
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+
+    SYLAR_LOG_INFO(g_logger) << "fdtable threads=" << threads
+        << " fibers=" << fibers
+        << " ops=" << s_fdtable_ops
+        << " used=" << used << "us"
+        << " ops/s=" << (used ? s_fdtable_ops * 1000000 / used : 0)
+        << " high_fd=" << high_fd
+        << " fired=" << s_fdtable_fired;
+    SYLAR_ASSERT(s_fdtable_ops == (uint64_t)fibers * loops * 2);
+    //用到了才分配的块上的 fd 也要能收到事件
+    SYLAR_ASSERT(high_fd < 0 || s_fdtable_fired);
+
+    for(int i : socks)
+    {
+        close(i);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    if(high_fd >= 0)
+    {
+        close(high_fd);
+    }
+}
+
+//叫醒：每一轮给每个工作线程各派一个指定了线程的任务，只该叫醒那一个
+//看有没有跑错线程、每轮发了几次 tickle；最后外面一口气塞一堆任务，看合并省掉了多少次
+static std::atomic<int> s_wake_done = {0};
+static std::atomic<int> s_wake_wrong = {0};
+static sylar::Mutex s_wake_mutex;
+static std::set<int> s_wake_tids;
+
+void test_wake(int threads, int rounds)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    s_wake_done = 0;
+    s_wake_wrong = 0;
+    s_wake_tids.clear();
+
+    sylar::IOManager iom(threads, false, "wake");
+    //先把工作线程的 id 都认出来
+    while(true)
+    {
+        {
+            sylar::Mutex::Lock lock(s_wake_mutex);
+            if((int)s_wake_tids.size() >= threads)
+            {
+                break;
+            }
+        }
+        for(int i = 0; i < threads; ++i)
+        {
+            iom.schedule([](){
+                usleep(1000);
+                sylar::Mutex::Lock lock(s_wake_mutex);
+                s_wake_tids.insert(sylar::GetThreadId());
+            });
+        }
+        usleep(5000);
+    }
+    usleep(10000);
+
+    uint64_t before = iom.getMetrics().tickles;
+    std::vector<uint64_t> used;
+    for(int r = 0; r < rounds; ++r)
+    {
+        uint64_t start = sylar::GetCurrentUS();
+        int expect = s_wake_done + threads;
+        for(int tid : s_wake_tids)
+        {
+            iom.schedule([tid](){
+                if(sylar::GetThreadId() != tid)
+                {
+                    ++s_wake_wrong;
+                }
+                ++s_wake_done;
+            }, tid);
+        }
+        while(s_wake_done < expect);
+        used.push_back(sylar::GetCurrentUS() - start);
+        //让它们都睡下去
+        usleep(2000);
+    }
+    sylar::Scheduler::Metrics m = iom.getMetrics();
+    std::sort(used.begin(), used.end());
+    SYLAR_LOG_INFO(g_logger) << "wake pinned threads=" << threads
+        << " rounds=" << rounds
+        << " wrong=" << s_wake_wrong
+        << " tickles/round=" << (double)(m.tickles - before) / rounds
+        << " p50=" << used[used.size() / 2] << "us"
+        << " p99=" << used[used.size() * 99 / 100] << "us";
+    SYLAR_ASSERT(s_wake_wrong == 0);
+    //指定了线程的只叫那一个，一轮最多每个线程一次
+    SYLAR_ASSERT(m.tickles - before <= (uint64_t)threads * rounds);
+
+    //一口气塞，闲着的线程还没醒来处理上一次叫醒的，再叫就省掉了
+    before = m.tickles;
+    uint64_t saved_before = m.tickles_saved;
+    for(int i = 0; i < 10000; ++i)
+    {
+        iom.schedule([](){ ++s_wake_done; });
+    }
+    iom.stop();
+    m = iom.getMetrics();
+    SYLAR_LOG_INFO(g_logger) << "wake burst tasks=10000"
+        << " tickles=" << m.tickles - before
+        << " saved=" << m.tickles_saved - saved_before;
+    SYLAR_ASSERT(s_wake_done == threads * rounds + 10000);
+    //合并以后远用不了一个任务一次
+    SYLAR_ASSERT(m.tickles - before < 10000);
+}
+
+//分片模式：fd 定在注册它的分片上，事件只在那个分片上等；挪走之后原来的分片就不再派发它的事件
+static const int s_shard_max_fds = 256;
+static int s_shard_socks[s_shard_max_fds][2];
+static std::atomic<bool> s_shard_stop = {false};
+
+static void shard_echo(int i)
+{
+    char buf[64];
+    int n = 0;
+    while((n = read(s_shard_socks[i][0], buf, sizeof(buf))) > 0)
+    {
+        write(s_shard_socks[i][0], buf, n);
+    }
+    if(!s_shard_stop)
+    {
+        sylar::IOManager::GetThis()->addEvent(s_shard_socks[i][0], sylar::IOManager::READ
+                , std::bind(&shard_echo, i));
+    }
+}
+
+static uint64_t shard_rounds(int fds, int rounds)
+{
+    uint64_t start = sylar::GetCurrentUS();
+    for(int r = 0; r < rounds; ++r)
+    {
+        char c = 'S';
+        for(int i = 0; i < fds; ++i)
+        {
+            write(s_shard_socks[i][1], &c, 1);
+        }
+        for(int i = 0; i < fds; ++i)
+        {
+            c = 0;
+            int n = read(s_shard_socks[i][1], &c, 1);
+            SYLAR_ASSERT(n == 1 && c == 'S');
+        }
+    }
+    return sylar::GetCurrentUS() - start;
+}
+
+static std::string shard_stats(sylar::IOManager& iom)
+{
+    std::stringstream ss;
+    for(auto& i : iom.getShardStats())
+    {
+        ss << " [" << i.index << " fds=" << i.fds << " events=" << i.events << "]";
+    }
+    return ss.str();
+}
+
+void test_sharded(int threads, int fds, int rounds, bool sharded)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    sylar::Config::Lookup<bool>("iomanager.sharded")->setValue(sharded);
+    fds = std::min(fds, s_shard_max_fds);
+    s_shard_stop = false;
+    for(int i = 0; i < fds; ++i)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, s_shard_socks[i]);
+        fcntl(s_shard_socks[i][0], F_SETFL, O_NONBLOCK);
+    }
+
+    sylar::IOManager iom(threads, false, "sharded");
+    //默认定在注册它的线程上，这里都是随便哪个线程注册的，按 fd 号摊开（socketpair 两头的号是挨着的）
+    iom.setShardPicker([threads](int fd, int worker){
+        return fd / 2 % threads;
+    });
+    std::atomic<int> registered = {0};
+    for(int i = 0; i < fds; ++i)
+    {
+        iom.schedule([i, &registered](){
+            sylar::IOManager::GetThis()->addEvent(s_shard_socks[i][0], sylar::IOManager::READ
+                    , std::bind(&shard_echo, i));
+            ++registered;
+        });
+    }
+    while(registered < fds)
+    {
+        usleep(100);
+    }
+    uint64_t used = shard_rounds(fds, rounds);
+    SYLAR_LOG_INFO(g_logger) << "sharded=" << sharded << " threads=" << threads
+        << " fds=" << fds << " rounds=" << rounds
+        << " used=" << used << "us tickles=" << iom.getMetrics().tickles
+        << shard_stats(iom);
+
+    if(sharded)
+    {
+        //全挪到 0 号上，别的分片的事件数就不该再涨了
+        std::vector<sylar::IOManager::ShardStats> before = iom.getShardStats();
+        int moved = 0;
+        for(int i = 0; i < fds; ++i)
+        {
+            moved += iom.migrateFd(s_shard_socks[i][0], 0);
+        }
+        shard_rounds(fds, rounds);
+        std::vector<sylar::IOManager::ShardStats> after = iom.getShardStats();
+        uint64_t leaked = 0;
+        for(size_t i = 1; i < after.size(); ++i)
+        {
+            leaked += after[i].events - before[i].events;
+        }
+        SYLAR_LOG_INFO(g_logger) << "migrate moved=" << moved
+            << " shard0_fds=" << after[0].fds
+            << " other_shard_events=" << leaked
+            << shard_stats(iom);
+        SYLAR_ASSERT(moved == fds);
+        SYLAR_ASSERT(after[0].fds == (size_t)fds);
+        //挪走之后，别的分片一个事件都不该再派发
+        for(size_t i = 1; i < after.size(); ++i)
+        {
+            SYLAR_ASSERT(after[i].events == before[i].events);
+        }
+
+        //换个分法：新注册的都放到最后一个分片上。cancelAll 放掉分片，触发的回调重新注册就定到新的上了
+        int last = threads - 1;
+        iom.setShardPicker([last](int fd, int worker){
+            return last;
+        });
+        int fd = s_shard_socks[0][0];
+        iom.schedule([fd](){
+            sylar::IOManager::GetThis()->cancelAll(fd);
+        });
+        while(iom.getShardStats()[last].fds == 0)
+        {
+            usleep(100);
+        }
+        SYLAR_LOG_INFO(g_logger) << "picker" << shard_stats(iom);
+    }
+
+    s_shard_stop = true;
+    for(int i = 0; i < fds; ++i)
+    {
+        int fd = s_shard_socks[i][0];
+        iom.schedule([fd](){
+            sylar::IOManager::GetThis()->cancelAll(fd);
+        });
+    }
+    iom.stop();
+    for(int i = 0; i < fds; ++i)
+    {
+        close(s_shard_socks[i][0]);
+        close(s_shard_socks[i][1]);
+    }
+}
+
+//回环上的请求/应答：epoll 是读一次 EAGAIN、挂 epoll、醒了再读，uring 是直接交给内核读，比一下每个请求的内核态时间
+//顺带看一下读超时、close 把 accept 撤掉这两条路
+static std::atomic<int> s_lb_done = {0};
+static int s_lb_listen = -1;
+
+static void loopback_echo(int c)
+{
+    char buf[64];
+    while(true)
+    {
+        ssize_t n = read(c, buf, sizeof(buf));
+        if(n <= 0)
+        {
+            break;
+        }
+        write(c, buf, n);
+    }
+    close(c);
+}
+
+static void loopback_client(sockaddr_in addr, int requests)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int rt = connect(sock, (const sockaddr*)&addr, sizeof(addr));
+    if(rt)
+    {
+        SYLAR_LOG_ERROR(g_logger) << "connect errno=" << errno;
+    }
+    SYLAR_ASSERT(rt == 0);
+    char buf[64] = {'L'};
+    for(int i = 0; i < requests; ++i)
+    {
+        write(sock, buf, sizeof(buf));
+        size_t got = 0;
+        memset(buf, 0, sizeof(buf));
+        while(got < sizeof(buf))
+        {
+            ssize_t n = read(sock, buf + got, sizeof(buf) - got);
+            if(n <= 0)
+            {
+                SYLAR_LOG_ERROR(g_logger) << "read rt=" << n << " errno=" << errno;
+            }
+            SYLAR_ASSERT(n > 0);
+            got += n;
+        }
+        //回来的得是发出去的那些
+        SYLAR_ASSERT(buf[0] == 'L' && buf[1] == 0);
+        ++s_lb_done;
+    }
+    close(sock);
+}
+
+void test_loopback(int threads, int conns, int requests, const std::string& backend)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    //hook 里每次挂起、醒来都有 debug 日志，不关掉比的就是日志了
+    SYLAR_LOG_ROOT()->setLevel(sylar::LogLevel::INFO);
+    sylar::Config::Lookup<std::string>("iomanager.backend")->setValue(backend);
+    s_lb_done = 0;
+
+    sylar::IOManager iom(threads, false, "loopback");
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+
+    std::atomic<bool> listening = {false};
+    std::atomic<int> accept_errno = {0};
+    iom.schedule([&addr, &listening, &accept_errno](){
+        s_lb_listen = socket(AF_INET, SOCK_STREAM, 0);
+        bind(s_lb_listen, (const sockaddr*)&addr, sizeof(addr));
+        socklen_t len = sizeof(addr);
+        getsockname(s_lb_listen, (sockaddr*)&addr, &len);
+        listen(s_lb_listen, 1024);
+        listening = true;
+        while(true)
+        {
+            int c = accept(s_lb_listen, nullptr, nullptr);
+            if(c < 0)
+            {
+                accept_errno = errno;
+                break;
+            }
+            sylar::IOManager::GetThis()->schedule(std::bind(&loopback_echo, c));
+        }
+    });
+    while(!listening)
+    {
+        usleep(100);
+    }
+
+    rusage ru_start;
+    getrusage(RUSAGE_SELF, &ru_start);
+    uint64_t start = sylar::GetCurrentUS();
+    int per = requests / conns;
+    for(int i = 0; i < conns; ++i)
+    {
+        iom.schedule(std::bind(&loopback_client, addr, per));
+    }
+    while(s_lb_done < per * conns)
+    {
+        usleep(1000);
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+    rusage ru_end;
+    getrusage(RUSAGE_SELF, &ru_end);
+    uint64_t sys_us = (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1000000
+        + ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec;
+    int total = per * conns;
+
+    //读超时：连上了不发东西，对面也就不回，100ms 之后应该是 ETIMEDOUT
+    std::atomic<int> timeout_errno = {0};
+    std::atomic<int> timeout_ms = {-1};
+    iom.schedule([&addr, &timeout_errno, &timeout_ms](){
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        connect(sock, (const sockaddr*)&addr, sizeof(addr));
+        timeval tv = {0, 100000};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char c;
+        uint64_t begin = sylar::GetCurrentMS();
+        read(sock, &c, 1);
+        timeout_errno = errno;
+        timeout_ms = sylar::GetCurrentMS() - begin;
+        close(sock);
+    });
+    while(timeout_ms < 0)
+    {
+        usleep(1000);
+    }
+
+    //关掉监听的 socket，等在 accept 上的要醒过来
+    iom.schedule([](){
+        close(s_lb_listen);
+    });
+    while(!accept_errno)
+    {
+        usleep(1000);
+    }
+    iom.stop();
+
+    SYLAR_LOG_INFO(g_logger) << "loopback backend=" << backend
+        << " uring=" << iom.isUring()
+        << " threads=" << threads << " conns=" << conns
+        << " requests=" << total
+        << " req/s=" << (uint64_t)(total * 1000000.0 / used)
+        << " sys_us/req=" << (double)sys_us / total
+        << " read_timeout errno=" << timeout_errno << " after=" << timeout_ms << "ms"
+        << " accept_errno=" << accept_errno;
+    SYLAR_ASSERT(s_lb_done == total);
+    SYLAR_ASSERT(timeout_errno == ETIMEDOUT && timeout_ms >= 90);
+    SYLAR_ASSERT(accept_errno == EBADF);
+}
+
+//fd 一直挂在 epoll 上之后，addEvent 还得跟以前一样：回调没把数据读完就再来等，也要马上再触发
+static std::atomic<int> s_rearm_fired = {0};
+
+static void rearm_callback(int fd)
+{
+    char c;
+    //一次只读一个字节，剩下的留着
+    ::read(fd, &c, 1);
+    if(++s_rearm_fired < 3)
+    {
+        sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ, std::bind(&rearm_callback, fd));
+    }
+}
+
+void test_rearm()
+{
+    int socks[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+    fcntl(socks[0], F_SETFL, O_NONBLOCK);
+
+    sylar::IOManager iom(2, false, "rearm");
+    //先写三个字节、只来一次边沿，后面两次靠 addEvent 重新挂
+    ::write(socks[1], "abc", 3);
+    int fd = socks[0];
+    iom.schedule([fd](){
+        sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ, std::bind(&rearm_callback, fd));
+    });
+
+    uint64_t start = sylar::GetCurrentMS();
+    while(s_rearm_fired < 3 && sylar::GetCurrentMS() - start < 1000)
+    {
+        usleep(1000);
+    }
+    SYLAR_LOG_INFO(g_logger) << "rearm fired=" << s_rearm_fired << " expect=3";
+    SYLAR_ASSERT(s_rearm_fired == 3);
+
+    //没人等的时候来了个边沿，数据被别人读掉了。再 addEvent 不能拿缓存的就绪马上触发，要等真的来数据
+    std::atomic<int> stale = {0};
+    ::write(socks[1], "d", 1);
+    usleep(50 * 1000);
+    char buf[8];
+    ::read(socks[0], buf, sizeof(buf));
+    iom.schedule([fd, &stale](){
+        sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ, [&stale](){
+            ++stale;
+        });
+    });
+    usleep(100 * 1000);
+    int early = stale;
+    ::write(socks[1], "e", 1);
+    start = sylar::GetCurrentMS();
+    while(!stale && sylar::GetCurrentMS() - start < 1000)
+    {
+        usleep(1000);
+    }
+    SYLAR_LOG_INFO(g_logger) << "rearm stale_fired=" << early << " expect=0"
+        << " fired_after_write=" << stale << " expect=1";
+    SYLAR_ASSERT(early == 0);
+    SYLAR_ASSERT(stale == 1);
+
+    //fd 被 dup 过，关掉的时候内核不会把它从 epoll 上摘掉。cancelAll 不摘的话，
+    //同号的新 fd 会收到旧文件的边沿
+    int dupfd = ::dup(socks[0]);
+    iom.cancelAll(socks[0]);
+    ::close(socks[0]);
+    int socks2[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, socks2);
+    fcntl(socks2[0], F_SETFL, O_NONBLOCK);
+    std::atomic<int> spurious = {0};
+    int fd2 = socks2[0];
+    iom.schedule([fd2, &spurious](){
+        sylar::IOManager::GetThis()->addEvent(fd2, sylar::IOManager::READ, [&spurious](){
+            ++spurious;
+        });
+    });
+    usleep(50 * 1000);
+    ::write(socks[1], "f", 1);
+    usleep(100 * 1000);
+    SYLAR_LOG_INFO(g_logger) << "rearm reused_fd=" << (fd2 == fd) << " spurious=" << spurious << " expect=0";
+    SYLAR_ASSERT(spurious == 0);
+    iom.cancelAll(fd2);
+    iom.stop();
+    ::close(dupfd);
+    ::close(socks[1]);
+    ::close(socks2[0]);
+    ::close(socks2[1]);
+}
+
 int main(int argc, char** argv)
 {
+    if(argc > 1 && std::string(argv[1]) == "pingpong")
+    {
+        //./test_iomanager pingpong [线程数] [来回次数] [间隔 us] [最多几个线程空转，0 自动]
+        //先不转跑一遍，再按默认的 100us 转跑一遍
+        int threads = argc > 2 ? atoi(argv[2]) : 2;
+        int rounds = argc > 3 ? atoi(argv[3]) : 10000;
+        int gap = argc > 4 ? atoi(argv[4]) : 50;
+        int spinners = argc > 5 ? atoi(argv[5]) : 0;
+        test_pingpong(threads, rounds, gap, 0, spinners);
+        test_pingpong(threads, rounds, gap, 100, spinners);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "drain")
+    {
+        //./test_iomanager drain [线程数] [deadline ms]
+        //先跑一遍 deadline 前能排空的，再跑一遍排不空、新任务转给 backup 的，再用 use_caller 的各跑一遍
+        int threads = argc > 2 ? atoi(argv[2]) : 2;
+        uint64_t timeout = argc > 3 ? atoi(argv[3]) : 300;
+        test_drain(threads, timeout, false);
+        test_drain(threads, timeout, true);
+        test_drain_caller(timeout, false);
+        test_drain_caller(timeout, true);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "fdtable")
+    {
+        //./test_iomanager fdtable [线程数] [协程数] [每个协程的次数] [后面块上的 fd]
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int fibers = argc > 3 ? atoi(argv[3]) : 64;
+        int loops = argc > 4 ? atoi(argv[4]) : 10000;
+        int high_fd = argc > 5 ? atoi(argv[5]) : 10000;
+        test_fdtable(threads, fibers, loops, high_fd);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "wake")
+    {
+        //./test_iomanager wake [线程数] [轮数]
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int rounds = argc > 3 ? atoi(argv[3]) : 200;
+        test_wake(threads, rounds);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "sharded")
+    {
+        //./test_iomanager sharded [线程数] [fd 数] [轮数] [0 不分片，对比用]
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int fds = argc > 3 ? atoi(argv[3]) : 64;
+        int rounds = argc > 4 ? atoi(argv[4]) : 1000;
+        bool sharded = argc > 5 ? atoi(argv[5]) : true;
+        test_sharded(threads, fds, rounds, sharded);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "loopback")
+    {
+        //./test_iomanager loopback [线程数] [连接数] [请求数] [epoll|uring]
+        int threads = argc > 2 ? atoi(argv[2]) : 2;
+        int conns = argc > 3 ? atoi(argv[3]) : 16;
+        int requests = argc > 4 ? atoi(argv[4]) : 100000;
+        std::string backend = argc > 5 ? argv[5] : "uring";
+        test_loopback(threads, conns, requests, backend);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "rearm")
+    {
+        //./test_iomanager rearm
+        test_rearm();
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "burst")
+    {
+        //./test_iomanager burst [线程数] [轮数]
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int rounds = argc > 3 ? atoi(argv[3]) : 50;
+        test_burst(threads, rounds);
+        return 0;
+    }
+
     // test1();
     test_timer();
     return 0;
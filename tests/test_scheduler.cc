@@ -1,7 +1,32 @@
 #include "sylar/sylar.h"
+#include <atomic>
+#include <algorithm>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
+//统计整个进程的堆分配次数，alloc 模式用
+//直接用 glibc 的，malloc/free 的话新一点的 gcc 会报 new/delete 不匹配
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void __libc_free(void* p);
+
+static std::atomic<uint64_t> s_allocs = {0};
+
+void* operator new(size_t size)
+{
+    ++s_allocs;
+    void* p = __libc_malloc(size);
+    if(!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    __libc_free(p);
+}
+
 void test_fiber()
 {
     static int s_count = 5;
@@ -14,8 +39,474 @@ void test_fiber()
         // sylar::Scheduler::GetThis()->schedule(&test_fiber);
 }
 
+//吞吐测试：外面只丢几个种子任务进去，剩下的全在工作线程里派生
+//派生的走本地队列，闲着的线程靠偷，线程数翻倍吞吐应该也差不多翻倍
+static std::atomic<uint64_t> s_done = {0};
+
+static void bench_leaf()
+{
+    ++s_done;
+}
+
+static void bench_leaf_inline()
+{
+    //真的是在调度器主协程上直接跑的
+    SYLAR_ASSERT(sylar::Scheduler::InInlineTask());
+    ++s_done;
+}
+
+static void bench_seed(uint64_t count, bool run_inline)
+{
+    sylar::Scheduler* sc = sylar::Scheduler::GetThis();
+    for(uint64_t i = 0; i < count; ++i)
+    {
+        if(run_inline)
+        {
+            sc->scheduleInline(&bench_leaf_inline);
+        }
+        else
+        {
+            sc->schedule(&bench_leaf);
+        }
+    }
+}
+
+void test_throughput(int threads, uint64_t tasks, bool run_inline = false)
+{
+    //日志会把调度的开销全盖掉
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    s_done = 0;
+
+    int seeds = threads * 4;
+    uint64_t start = sylar::GetCurrentUS();
+    {
+        sylar::Scheduler sc(threads, false, "bench");
+        sc.start();
+        for(int i = 0; i < seeds; ++i)
+        {
+            sc.schedule(std::bind(&bench_seed, tasks / seeds, run_inline));
+        }
+        sc.stop();
+    }
+    uint64_t used = sylar::GetCurrentUS() - start;
+
+    SYLAR_LOG_INFO(g_logger) << "threads=" << threads
+        << " inline=" << run_inline
+        << " tasks=" << s_done
+        << " used=" << used << "us"
+        << " throughput=" << (used ? s_done * 1000000 / used : 0) << "/s";
+    //偷来偷去也不能丢任务、不能跑两遍
+    SYLAR_ASSERT(s_done == tasks / seeds * seeds);
+}
+
+//分配测试：单线程，每轮先放下一轮的种子，再放一批回调
+//本地队列是后进先出的，所以这一批回调会先跑完，节点都还回本线程，下一轮就能复用
+template<size_t N>
+struct Payload
+{
+    char data[N];
+};
+
+static const int s_alloc_batch = 64;
+static const int s_alloc_warmup = 16;
+static const int s_alloc_rounds = 1000;
+static uint64_t s_alloc_begin = 0;
+
+template<size_t N>
+static void alloc_round(int round)
+{
+    sylar::Scheduler* sc = sylar::Scheduler::GetThis();
+    if(round == s_alloc_warmup)
+    {
+        s_alloc_begin = s_allocs;
+        s_done = 0;
+    }
+    if(round == s_alloc_rounds)
+    {
+        uint64_t tasks = s_done;
+        uint64_t allocs = s_allocs - s_alloc_begin;
+        SYLAR_LOG_INFO(g_logger) << "capture=" << N << "B"
+            << " tasks=" << tasks
+            << " allocs=" << allocs
+            << " allocs/task=" << (tasks ? (double)allocs / tasks : 0);
+        SYLAR_ASSERT(tasks == (uint64_t)(s_alloc_rounds - s_alloc_warmup) * s_alloc_batch);
+        //放得进任务节点里的，节点复用起来以后一次分配都不该有
+        if(N <= sylar::Task::INLINE_SIZE)
+        {
+            SYLAR_ASSERT(allocs == 0);
+        }
+        return;
+    }
+
+    sc->schedule(std::bind(&alloc_round<N>, round + 1));
+    Payload<N> payload;
+    memset(payload.data, 0, N);
+    for(int i = 0; i < s_alloc_batch; ++i)
+    {
+        sc->schedule([payload](){
+            s_done += payload.data[0] + 1;
+        });
+    }
+}
+
+template<size_t N>
+void test_alloc()
+{
+    sylar::Scheduler sc(1, false, "alloc");
+    sc.start();
+    sc.schedule(std::bind(&alloc_round<N>, 0));
+    sc.stop();
+}
+
+//优先级测试：单线程，先压一大堆后台任务再放几个紧急的
+//紧急的应该几乎不用排队；反过来紧急的一直压着，后台的也要能按权重分到
+static std::atomic<uint64_t> s_background_done = {0};
+static std::atomic<uint64_t> s_critical_done = {0};
+//紧急任务跑的时候最多已经跑了几个后台的；后台跑满 100 个的时候紧急的跑了几个
+static uint64_t s_critical_max_wait = 0;
+static uint64_t s_starve_critical = 0;
+
+static void prio_background()
+{
+    ++s_background_done;
+}
+
+static void prio_critical()
+{
+    uint64_t waited = s_background_done;
+    SYLAR_LOG_INFO(g_logger) << "critical run after background=" << waited;
+    s_critical_max_wait = std::max(s_critical_max_wait, waited);
+    ++s_critical_done;
+}
+
+static void prio_seed()
+{
+    sylar::Scheduler* sc = sylar::Scheduler::GetThis();
+    for(int i = 0; i < 10000; ++i)
+    {
+        sc->schedule(&prio_background, -1, sylar::Scheduler::BACKGROUND);
+    }
+    for(int i = 0; i < 3; ++i)
+    {
+        sc->schedule(&prio_critical, -1, sylar::Scheduler::CRITICAL);
+    }
+    SYLAR_LOG_INFO(g_logger) << "depth critical=" << sc->getQueueDepth(sylar::Scheduler::CRITICAL)
+        << " normal=" << sc->getQueueDepth(sylar::Scheduler::NORMAL)
+        << " background=" << sc->getQueueDepth(sylar::Scheduler::BACKGROUND);
+}
+
+static void starve_critical()
+{
+    ++s_critical_done;
+}
+
+static void starve_background()
+{
+    ++s_background_done;
+    if(s_background_done == 100)
+    {
+        s_starve_critical = s_critical_done;
+        SYLAR_LOG_INFO(g_logger) << "100 background done after critical=" << s_starve_critical;
+    }
+}
+
+static void starve_seed()
+{
+    sylar::Scheduler* sc = sylar::Scheduler::GetThis();
+    for(int i = 0; i < 100; ++i)
+    {
+        sc->schedule(&starve_background, -1, sylar::Scheduler::BACKGROUND);
+    }
+    for(int i = 0; i < 10000; ++i)
+    {
+        sc->schedule(&starve_critical, -1, sylar::Scheduler::CRITICAL);
+    }
+}
+
+void test_priority()
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    {
+        s_background_done = 0;
+        s_critical_done = 0;
+        s_critical_max_wait = 0;
+        sylar::Scheduler sc(1, false, "prio");
+        sc.start();
+        sc.schedule(&prio_seed);
+        sc.stop();
+    }
+    SYLAR_ASSERT(s_critical_done == 3);
+    //按 8:4:1 的权重，3 个紧急任务前面顶多插进来一个后台的
+    SYLAR_ASSERT(s_critical_max_wait <= 1);
+    SYLAR_ASSERT(s_background_done == 10000);
+    {
+        s_background_done = 0;
+        s_critical_done = 0;
+        s_starve_critical = 0;
+        sylar::Scheduler sc(1, false, "starve");
+        sc.start();
+        sc.schedule(&starve_seed);
+        sc.stop();
+    }
+    //紧急的一直压着，后台的也要在紧急的跑完之前做完
+    SYLAR_ASSERT(s_starve_critical > 0 && s_starve_critical < 10000);
+    SYLAR_ASSERT(s_background_done == 100 && s_critical_done == 10000);
+}
+
+//绑核测试：./test_scheduler affinity core|numa|numa:0 [线程数]
+static std::string s_affinity_mode;
+static std::atomic<int> s_affinity_done = {0};
+
+static void affinity_report()
+{
+    int cpu = sched_getcpu();
+    std::vector<int> allowed = sylar::GetAllowedCpus();
+    SYLAR_LOG_INFO(g_logger) << "thread=" << sylar::GetThreadId()
+        << " cpu=" << cpu
+        << " allowed=" << allowed.size()
+        << " mem_node=" << sylar::GetThreadMemoryNode();
+    SYLAR_ASSERT(std::find(allowed.begin(), allowed.end(), cpu) != allowed.end());
+    if(s_affinity_mode == "core")
+    {
+        //一个线程只绑一个核
+        SYLAR_ASSERT(allowed.size() == 1);
+    }
+    ++s_affinity_done;
+}
+
+void test_affinity(const std::string& mode, int threads)
+{
+    sylar::Config::Lookup<std::string>("scheduler.affinity")->setValue(mode);
+    s_affinity_mode = mode;
+    s_affinity_done = 0;
+    sylar::Scheduler sc(threads, false, "affinity");
+    sc.start();
+    for(int i = 0; i < threads * 2; ++i)
+    {
+        sc.schedule(&affinity_report);
+    }
+    sc.stop();
+    SYLAR_ASSERT(s_affinity_done == threads * 2);
+}
+
+//协程缓存：./test_scheduler pool [缓存大小]
+//一半的回调中途让出去（走的是协程那个分支回来的），一半直接跑完，看命中率
+static std::atomic<uint64_t> s_pool_done = {0};
+
+static void pool_task(int i)
+{
+    if(i % 2)
+    {
+        sylar::Fiber::YieldToReady();
+    }
+    ++s_pool_done;
+}
+
+static void pool_seed(int count)
+{
+    sylar::Scheduler* sc = sylar::Scheduler::GetThis();
+    for(int i = 0; i < count; ++i)
+    {
+        sc->schedule(std::bind(&pool_task, i));
+    }
+}
+
+void test_pool(uint32_t pool_size)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    sylar::Config::Lookup<uint32_t>("scheduler.fiber_pool_size")->setValue(pool_size);
+    s_pool_done = 0;
+    sylar::Scheduler sc(2, false, "pool");
+    sc.start();
+    for(int i = 0; i < 100; ++i)
+    {
+        sc.schedule(std::bind(&pool_seed, 1000));
+    }
+    sc.stop();
+    sylar::Scheduler::FiberPoolStats stats = sc.getFiberPoolStats();
+    SYLAR_LOG_INFO(g_logger) << "pool_size=" << pool_size
+        << " done=" << s_pool_done
+        << " hits=" << stats.hits
+        << " misses=" << stats.misses
+        << " cached=" << stats.cached;
+    SYLAR_ASSERT(s_pool_done == 100000);
+    //100 个 seed 加 100000 个回调，每个回调拿一次协程
+    SYLAR_ASSERT(stats.hits + stats.misses == 100100);
+    if(pool_size == 0)
+    {
+        SYLAR_ASSERT(stats.hits == 0);
+    }
+    else
+    {
+        SYLAR_ASSERT(stats.hits > stats.misses);
+    }
+    SYLAR_ASSERT(stats.cached <= pool_size * 2);
+}
+
+//运行时指标：跑吞吐测试的同时，另一个线程隔一会取一次快照
+void test_metrics(int threads, uint64_t tasks)
+{
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    s_done = 0;
+    sylar::Scheduler sc(threads, false, "metrics");
+    sc.start();
+    int seeds = threads * 4;
+    for(int i = 0; i < seeds; ++i)
+    {
+        sc.schedule(std::bind(&bench_seed, tasks / seeds, false));
+    }
+    uint64_t last = 0;
+    for(int i = 0; i < 3; ++i)
+    {
+        usleep(20 * 1000);
+        sylar::Scheduler::Metrics m = sc.getMetrics();
+        SYLAR_LOG_INFO(g_logger) << "metrics: " << m.toString();
+        //跑着的时候取的快照，计数只会往上走
+        SYLAR_ASSERT(m.tasks >= last);
+        last = m.tasks;
+    }
+    sc.stop();
+    sylar::Scheduler::Metrics m = sc.getMetrics();
+    SYLAR_LOG_INFO(g_logger) << "final metrics: " << m.toString();
+
+    //seed 本身也算任务
+    uint64_t expect = tasks / seeds * seeds + seeds;
+    SYLAR_ASSERT(m.tasks == expect);
+    uint64_t worker_tasks = 0;
+    for(auto& i : m.workers)
+    {
+        worker_tasks += i.tasks;
+    }
+    SYLAR_ASSERT(worker_tasks == expect);
+    SYLAR_ASSERT(m.global_depth == 0);
+    for(int i = 0; i < sylar::Scheduler::PRIORITY_COUNT; ++i)
+    {
+        SYLAR_ASSERT(m.queue_depth[i] == 0);
+    }
+}
+
+//看门狗：一个任务死算 300ms 不让出，应该被打出栈来；另一个隔一阵看 ShouldYield，应该让出好几次
+static volatile uint64_t s_spin_sink = 0;
+static std::atomic<int> s_coop_yields = {0};
+
+static void spin_without_yield(uint64_t ms)
+{
+    uint64_t end = sylar::GetCurrentMS() + ms;
+    while(sylar::GetCurrentMS() < end)
+    {
+        ++s_spin_sink;
+    }
+}
+
+static void spin_with_yield(uint64_t ms)
+{
+    uint64_t end = sylar::GetCurrentMS() + ms;
+    int yields = 0;
+    while(sylar::GetCurrentMS() < end)
+    {
+        ++s_spin_sink;
+        if(sylar::Fiber::ShouldYield())
+        {
+            ++yields;
+            sylar::Fiber::YieldToReady();
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "cooperative task yielded " << yields << " times in " << ms << "ms";
+    s_coop_yields = yields;
+}
+
+void test_watchdog()
+{
+    //默认不开，这里打开
+    sylar::Config::Lookup<uint32_t>("scheduler.watchdog_ms")->setValue(200);
+    sylar::Config::Lookup<uint32_t>("scheduler.yield_slice_ms")->setValue(20);
+    sylar::Scheduler sc(1, false, "watchdog");
+    sc.start();
+    sc.schedule(std::bind(&spin_with_yield, 200));
+    sc.schedule(std::bind(&spin_without_yield, 300));
+    sc.stop();
+    sylar::Scheduler::Metrics m = sc.getMetrics();
+    SYLAR_LOG_INFO(g_logger) << "metrics: " << m.toString();
+    //20ms 一片，200ms 里怎么也得让出几次
+    SYLAR_ASSERT(s_coop_yields >= 2);
+    //不让出的那个跑了 300ms，超过 200ms 要被抓到；会让出的那个不能被算进去
+    SYLAR_ASSERT(m.workers.size() == 1);
+    SYLAR_ASSERT(m.workers[0].stalls == 1);
+}
+
 int main(int argc, char** argv)
 {
+    if(argc > 1 && std::string(argv[1]) == "watchdog")
+    {
+        //./test_scheduler watchdog
+        SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::WARN);
+        test_watchdog();
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "metrics")
+    {
+        //./test_scheduler metrics [线程数] [任务数]
+        test_metrics(argc > 2 ? atoi(argv[2]) : 2, argc > 3 ? atoll(argv[3]) : 2000000);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "pool")
+    {
+        if(argc > 2)
+        {
+            test_pool(atoi(argv[2]));
+        }
+        else
+        {
+            test_pool(0);
+            test_pool(1);
+            test_pool(16);
+        }
+        return 0;
+    }
+
+    if(argc > 2 && std::string(argv[1]) == "affinity")
+    {
+        test_affinity(argv[2], argc > 3 ? atoi(argv[3]) : 2);
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "priority")
+    {
+        test_priority();
+        return 0;
+    }
+
+    if(argc > 1 && std::string(argv[1]) == "alloc")
+    {
+        //./test_scheduler alloc，lambda 抓不同大小的东西，看每个任务要分配几次
+        SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+        test_alloc<8>();
+        test_alloc<32>();
+        test_alloc<48>();
+        test_alloc<64>();
+        return 0;
+    }
+
+    if(argc > 1 && (std::string(argv[1]) == "bench" || std::string(argv[1]) == "inline"))
+    {
+        //./test_scheduler bench [最大线程数] [每轮任务数]，线程数 1,2,4.. 翻倍跑
+        //./test_scheduler inline ...，同样的任务用 scheduleInline 放进去再跑一遍对比
+        bool run_inline = std::string(argv[1]) == "inline";
+        int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+        uint64_t tasks = argc > 3 ? atoll(argv[3]) : 1000000;
+        for(int i = 1; i <= max_threads; i *= 2)
+        {
+            test_throughput(i, tasks);
+            if(run_inline)
+            {
+                test_throughput(i, tasks, true);
+            }
+        }
+        return 0;
+    }
+
     SYLAR_LOG_INFO(g_logger) << "main";
     sylar::Scheduler sc(3, false, "test");
 
@@ -26,4 +517,4 @@ int main(int argc, char** argv)
     SYLAR_LOG_INFO(g_logger) << "over";
 
     return 0;
-}
\ No newline at end of file
+}
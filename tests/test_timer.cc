@@ -0,0 +1,216 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+//时间轮跟原来的 set 到期时间要一样：从 0 到 2.5s 撒一把（跨过毫秒轮、挪到秒轮上的都有），
+//每三个取消一个、每五个 reset 一下，看触发的个数对不对、有没有早到的、最多晚了多少
+static std::atomic<int> s_wheel_fired = {0};
+static std::atomic<int> s_wheel_early = {0};
+static std::atomic<uint64_t> s_wheel_late = {0};
+
+static void wheel_callback(uint64_t expect)
+{
+    uint64_t now = sylar::GetCurrentMS();
+    if(now < expect)
+    {
+        ++s_wheel_early;
+    }
+    else
+    {
+        uint64_t late = now - expect;
+        uint64_t old = s_wheel_late;
+        while(late > old && !s_wheel_late.compare_exchange_weak(old, late));
+    }
+    ++s_wheel_fired;
+}
+
+void test_wheel(bool wheel, int count)
+{
+    sylar::Config::Lookup<bool>("timer.wheel")->setValue(wheel);
+    s_wheel_fired = 0;
+    s_wheel_early = 0;
+    s_wheel_late = 0;
+
+    sylar::IOManager iom(2, false, "wheel");
+    std::vector<sylar::Timer::ptr> timers;
+    int expect = 0;
+    uint64_t max_ms = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        uint64_t ms = (uint64_t)i * 2500 / count;
+        //reset 成从现在起再等一半
+        uint64_t real = i % 5 == 0 ? ms / 2 : ms;
+        uint64_t expect_ms = sylar::GetCurrentMS() + real;
+        timers.push_back(iom.addTimer(ms, std::bind(&wheel_callback, expect_ms)));
+        if(i % 3 == 0)
+        {
+            timers.back()->cancel();
+            continue;
+        }
+        if(i % 5 == 0)
+        {
+            timers.back()->reset(real, true);
+        }
+        ++expect;
+        max_ms = std::max(max_ms, real);
+    }
+
+    //循环的：50ms 一次，跑 10 次
+    static std::atomic<int> s_recurring = {0};
+    s_recurring = 0;
+    sylar::Timer::ptr recurring;
+    recurring = iom.addTimer(50, [&recurring](){
+        if(++s_recurring == 10)
+        {
+            recurring->cancel();
+        }
+    }, true);
+
+    usleep((max_ms + 200) * 1000);
+    SYLAR_LOG_INFO(g_logger) << (wheel ? "wheel" : "set")
+        << " fired=" << s_wheel_fired << " expect=" << expect
+        << " early=" << s_wheel_early << " max_late=" << s_wheel_late << "ms"
+        << " recurring=" << s_recurring;
+    iom.stop();
+    SYLAR_ASSERT(s_wheel_fired == expect);
+    SYLAR_ASSERT(s_wheel_early == 0);
+    SYLAR_ASSERT(s_recurring == 10);
+}
+
+//不跑调度器，只看 TimerManager 自己的开销
+class BenchTimerManager : public sylar::TimerManager
+{
+public:
+    void onTimerInsertedAtFront() override
+    {
+        ++m_front;
+    }
+    uint64_t m_front = 0;
+};
+
+static void bench_report(const char* name, const char* what, uint64_t us, uint64_t ops)
+{
+    SYLAR_LOG_INFO(g_logger) << name << " " << what << ": " << (us * 1000 / std::max<uint64_t>(ops, 1)) << " ns/op";
+}
+
+//秒轮一格
+static const uint64_t s_wheelSec = 1024;
+
+//threads 个线程一起跑 fn(ops)，算的是墙上时间摊到总次数
+static uint64_t bench_threads(int threads, int ops, std::function<void(int)> fn)
+{
+    std::vector<sylar::Thread::ptr> thrs;
+    uint64_t start = sylar::GetCurrentUS();
+    for(int i = 0; i < threads; ++i)
+    {
+        thrs.push_back(std::make_shared<sylar::Thread>(std::bind(fn, ops), "bench_" + std::to_string(i)));
+    }
+    for(auto& t : thrs)
+    {
+        t->join();
+    }
+    return sylar::GetCurrentUS() - start;
+}
+
+//do_io 的样子：后台挂着 live 个长超时，前面不停地 加一个、取消一个
+void bench_timer(bool wheel, int live, int ops, int threads)
+{
+    sylar::Config::Lookup<bool>("timer.wheel")->setValue(wheel);
+    const char* name = wheel ? "wheel" : "set  ";
+    BenchTimerManager tm;
+    std::vector<sylar::Timer::ptr> background;
+    background.reserve(live);
+
+    uint64_t begin_ms = sylar::GetCurrentMS();
+    uint64_t start = sylar::GetCurrentUS();
+    for(int i = 0; i < live; ++i)
+    {
+        //5s 到 60s 的读超时
+        background.push_back(tm.addTimer(5000 + (i * 7919) % 55000, [](){}));
+    }
+    bench_report(name, "insert", sylar::GetCurrentUS() - start, live);
+
+    start = sylar::GetCurrentUS();
+    for(int i = 0; i < ops; ++i)
+    {
+        sylar::Timer::ptr t = tm.addTimer(3000 + i % 2000, [](){});
+        t->cancel();
+    }
+    bench_report(name, "add+cancel", sylar::GetCurrentUS() - start, ops);
+
+    start = sylar::GetCurrentUS();
+    uint64_t sum = 0;
+    for(int i = 0; i < ops; ++i)
+    {
+        sum += tm.getNextTimer();
+    }
+    bench_report(name, "getNextTimer", sylar::GetCurrentUS() - start, ops);
+
+    //好几个工作线程一起 加、取消，一起算下次等多久，看锁争起来的样子
+    uint64_t us = bench_threads(threads, ops / threads, [&tm](int n){
+        for(int i = 0; i < n; ++i)
+        {
+            sylar::Timer::ptr t = tm.addTimer(3000 + i % 2000, [](){});
+            t->cancel();
+        }
+    });
+    bench_report(name, "mt add+cancel", us, ops);
+    us = bench_threads(threads, ops / threads, [&tm](int n){
+        for(int i = 0; i < n; ++i)
+        {
+            tm.getNextTimer();
+        }
+    });
+    bench_report(name, "mt getNextTimer", us, ops);
+    //最早的是 5s 那个，加了又取消的不能留下来。轮子上挂在秒轮的算到那一秒开头，最多早 1s；前面跑了多久也要扣掉
+    uint64_t next = tm.getNextTimer();
+    uint64_t elapsed = sylar::GetCurrentMS() - begin_ms;
+    SYLAR_ASSERT(next <= 5000 && next + elapsed + s_wheelSec >= 5000);
+
+    start = sylar::GetCurrentUS();
+    for(auto& t : background)
+    {
+        t->cancel();
+    }
+    bench_report(name, "cancel", sylar::GetCurrentUS() - start, live);
+    SYLAR_ASSERT(tm.getNextTimer() == ~0ull);
+
+    //一批马上到期的，拿出来的开销
+    for(int i = 0; i < live; ++i)
+    {
+        tm.addTimer(i % 20, [](){});
+    }
+    usleep(30 * 1000);
+    std::vector<std::function<void()>> cbs;
+    start = sylar::GetCurrentUS();
+    tm.listExpiredCb(cbs);
+    bench_report(name, "expire", sylar::GetCurrentUS() - start, live);
+    SYLAR_LOG_INFO(g_logger) << name << " expired=" << cbs.size() << " front_tickles=" << tm.m_front
+        << " next_timeout=" << sum / std::max(ops, 1) << "ms";
+    SYLAR_ASSERT(cbs.size() == (size_t)live);
+    SYLAR_ASSERT(tm.getNextTimer() == ~0ull);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc > 1 && std::string(argv[1]) == "bench")
+    {
+        //./test_timer bench [后台挂着的定时器数] [加、取消的次数] [线程数]
+        int live = argc > 2 ? atoi(argv[2]) : 200000;
+        int ops = argc > 3 ? atoi(argv[3]) : 1000000;
+        int threads = argc > 4 ? atoi(argv[4]) : 4;
+        bench_timer(true, live, ops, threads);
+        bench_timer(false, live, ops, threads);
+        return 0;
+    }
+
+    //./test_timer [定时器个数]，时间轮、set 各跑一遍
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    test_wheel(true, count);
+    test_wheel(false, count);
+    return 0;
+}